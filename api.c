@@ -26,6 +26,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -33,8 +34,11 @@
 #include "config.h"
 #include "finit.h"
 #include "conf.h"
+#include "cron.h"
 #include "helpers.h"
 #include "plugin.h"
+#include "private.h"
+#include "queue.h"
 #include "sig.h"
 #include "service.h"
 
@@ -43,6 +47,15 @@
 
 uev_t api_watcher;
 
+/* initctl --wait clients, answered when their services are ready */
+typedef struct api_wait {
+	LIST_ENTRY(api_wait) link;
+	int                  sd;
+	struct init_request  rq;
+} api_wait_t;
+
+static LIST_HEAD(, api_wait) waiters = LIST_HEAD_INITIALIZER();
+
 /* Allowed characters in job/id/name */
 static int isallowed(int ch)
 {
@@ -77,16 +90,17 @@ static int call(int (*action)(svc_t *), char *buf, size_t len)
 	token = strtok_r(input, " ", &pos);
 	while (token) {
 		svc_t *svc;
+		svc_iter_t iter;
 		char *ptr = strchr(token, ':');
 
 		if (isdigit(token[0])) {
 			int job = atonum(token);
 
 			if (!ptr) {
-				svc = svc_job_iterator(1, job);
+				svc = svc_job_iterator(&iter, 1, job);
 				while (svc) {
 					result += action(svc);
-					svc = svc_job_iterator(0, job);
+					svc = svc_job_iterator(&iter, 0, job);
 				}
 			} else {
 				*ptr++ = 0;
@@ -96,10 +110,10 @@ static int call(int (*action)(svc_t *), char *buf, size_t len)
 
 		} else {
 			if (!ptr) {
-				svc = svc_named_iterator(1, token);
+				svc = svc_named_iterator(&iter, 1, token);
 				while (svc) {
 					result += action(svc);
-					svc = svc_named_iterator(0, token);
+					svc = svc_named_iterator(&iter, 0, token);
 				}
 			} else {
 				*ptr++ = 0;
@@ -123,6 +137,141 @@ static int do_pause  (char *buf, size_t len) { return call(service_pause,   buf,
 static int do_reload (char *buf, size_t len) { return call(service_reload,  buf, len); }
 static int do_restart(char *buf, size_t len) { return call(service_restart, buf, len); }
 
+/* NAME|JOB NUM, for services declared with :FIRST-LAST */
+static int do_scale(char *buf, size_t len)
+{
+	char *input, *name, *num, *pos;
+	const char *err = NULL;
+	svc_iter_t iter;
+	int val;
+
+	input = sanitize(buf, len);
+	if (!input)
+		return -1;
+
+	name = strtok_r(input, " ", &pos);
+	num  = strtok_r(NULL, " ", &pos);
+	if (!name || !num)
+		return 1;
+
+	val = strtonum(num, 0, MAX_NUM_INSTANCES, &err);
+	if (err) {
+		_e("Invalid number of instances, %s: %s", err, num);
+		return 1;
+	}
+
+	if (isdigit(name[0])) {
+		svc_t *svc = svc_job_iterator(&iter, 1, atonum(name));
+
+		if (!svc)
+			return 1;
+		name = basename(svc->cmd);
+	}
+
+	return service_scale(name, val);
+}
+
+/* Not sanitized like job/id/name, an at job is a full command line */
+static int do_at(char *buf, size_t len)
+{
+	buf[len - 1] = 0;
+
+	return cron_at(buf);
+}
+
+static int is_starting(svc_t *svc)
+{
+	return svc && svc->state == SVC_STARTING_STATE;
+}
+
+static int is_failed(svc_t *svc)
+{
+	return !svc || (svc_is_daemon(svc) && svc->pid <= 0);
+}
+
+/* call() modifies its buffer, so every check gets its own copy */
+static int check(int (*action)(svc_t *), struct init_request *rq)
+{
+	char buf[sizeof(rq->data)];
+
+	memcpy(buf, rq->data, sizeof(buf));
+	return call(action, buf, sizeof(buf));
+}
+
+/* Still starting services, or reloading /etc/finit.d */
+static int is_waiting(struct init_request *rq)
+{
+	if (rq->cmd == INIT_CMD_RELOAD)
+		return service_reload_busy(NULL);
+
+	return check(is_starting, rq) > 0;
+}
+
+static int is_failure(struct init_request *rq)
+{
+	int result = 0;
+
+	if (rq->cmd == INIT_CMD_RELOAD) {
+		service_reload_busy(&result);
+		return result;
+	}
+
+	return check(is_failed, rq);
+}
+
+/*
+ * For 'initctl --wait start', hold on to the client until all matched
+ * services are ready, or have failed.  Same for 'initctl reload' until
+ * the reload is done.  Returns %TRUE(1) if deferred.
+ */
+static int api_defer(int sd, struct init_request *rq)
+{
+	api_wait_t *w;
+
+	if (!is_waiting(rq))
+		return 0;
+
+	w = malloc(sizeof(*w));
+	if (!w) {
+		_pe("Failed allocating initctl waiter");
+		return 0;
+	}
+
+	w->sd = sd;
+	memcpy(&w->rq, rq, sizeof(w->rq));
+	LIST_INSERT_HEAD(&waiters, w, link);
+
+	return 1;
+}
+
+/**
+ * api_wakeup - Answer initctl clients waiting for services to be ready
+ *
+ * Called when a service leaves %SVC_STARTING_STATE, or a reload is
+ * done.  A waiting client gets its ACK when none of its services are
+ * starting anymore, or a NACK if any of them failed.
+ */
+void api_wakeup(void)
+{
+	api_wait_t *w, *tmp;
+
+	LIST_FOREACH_SAFE(w, &waiters, link, tmp) {
+		if (is_waiting(&w->rq))
+			continue;
+
+		if (is_failure(&w->rq))
+			w->rq.cmd = INIT_CMD_NACK;
+		else
+			w->rq.cmd = INIT_CMD_ACK;
+		if (write(w->sd, &w->rq, sizeof(w->rq)) != sizeof(w->rq))
+			_d("Failed sending ACK/NACK back to client.");
+
+		close(w->sd);
+		LIST_REMOVE(w, link);
+		free(w);
+	}
+}
+
 #ifndef INETD_DISABLED
 static int do_query_inetd(char *buf, size_t len)
 {
@@ -202,6 +351,7 @@ static void cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
 {
 	int sd;
 	struct init_request rq;
+	char data[sizeof(rq.data)];
 
 	sd = accept(w->fd, NULL, NULL);
 	if (sd < 0) {
@@ -233,6 +383,7 @@ static void cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
 			break;
 		}
 
+		svc_update_begin();
 		switch (rq.cmd) {
 		case INIT_CMD_RUNLVL:
 			switch (rq.runlevel) {
@@ -274,16 +425,41 @@ static void cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
 
 		case INIT_CMD_RELOAD: /* 'init q' and 'initctl reload' */
 			service_reload_dynamic();
+			if (api_defer(sd, &rq)) {
+				svc_update_end();
+				return;	/* Client answered by api_wakeup() */
+			}
+			service_reload_busy(&result);
 			break;
 
 		case INIT_CMD_START_SVC:
 			result = do_start(rq.data, sizeof(rq.data));
 			break;
 
+		case INIT_CMD_START_SVC_WAIT:
+			memcpy(data, rq.data, sizeof(data));
+			result = do_start(rq.data, sizeof(rq.data));
+			memcpy(rq.data, data, sizeof(rq.data));
+			if (!result && api_defer(sd, &rq)) {
+				svc_update_end();
+				return;	/* Client answered by api_wakeup() */
+			}
+			if (!result)
+				result = is_failure(&rq);
+			break;
+
 		case INIT_CMD_STOP_SVC:
 			result = do_pause(rq.data, sizeof(rq.data));
 			break;
 
+		case INIT_CMD_SCALE_SVC:
+			result = do_scale(rq.data, sizeof(rq.data));
+			break;
+
+		case INIT_CMD_AT:
+			result = do_at(rq.data, sizeof(rq.data));
+			break;
+
 		case INIT_CMD_RELOAD_SVC:
 			result = do_reload(rq.data, sizeof(rq.data));
 			break;
@@ -310,6 +486,7 @@ static void cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
 			_d("Unsupported cmd: %d", rq.cmd);
 			break;
 		}
+		svc_update_end();
 
 		if (result)
 			rq.cmd = INIT_CMD_NACK;
@@ -0,0 +1,314 @@
+/* cgroup v2 placement, resource limits and accounting per service
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include "libite/lite.h"
+
+#include "finit.h"
+#include "helpers.h"
+#include "cgroup.h"
+
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
+/* Controllers enabled for services, if the kernel has them */
+static char *controllers[] = { "cpu", "memory", "io", "pids", NULL };
+
+/* Limits allowed in cgroup:KEY=VAL, all files in the service's group */
+static char *limits[] = { "cpu.", "memory.", "io.", "pids.", NULL };
+
+static int write_file(char *path, char *val)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	len = write(fd, val, strlen(val));
+	close(fd);
+
+	return len < 0 ? -1 : 0;
+}
+
+/* Enable controllers for children of @dir, one at a time, some may be missing */
+static void enable(char *dir)
+{
+	char path[PATH_MAX], val[16];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/cgroup.subtree_control", dir);
+	for (i = 0; controllers[i]; i++) {
+		snprintf(val, sizeof(val), "+%s", controllers[i]);
+		if (write_file(path, val))
+			_d("Cannot enable %s controller in %s", controllers[i], dir);
+	}
+}
+
+/* cgroup v2 mounted, and not a v1 or hybrid setup? */
+static int is_cgroup2(void)
+{
+	struct statfs sfs;
+
+	if (statfs(CGROUP_ROOT, &sfs))
+		return 0;
+
+	return sfs.f_type == CGROUP2_SUPER_MAGIC;
+}
+
+/**
+ * cgroup_init - Mount cgroup v2 and create the group for services
+ *
+ * Mounts the unified hierarchy, unless already mounted, and enables
+ * all available controllers for services.  Systems with cgroup v1, or
+ * without cgroup support, run services without any cgroup as before.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if services cannot be placed in cgroups.
+ */
+int cgroup_init(void)
+{
+	if (!is_cgroup2()) {
+		if (mount("none", CGROUP_ROOT, "cgroup2", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) ||
+		    !is_cgroup2()) {
+			_d("No cgroup v2 support, services run without cgroups");
+			return errno = ENOTSUP;
+		}
+	}
+
+	if (mkdir(CGROUP_SVC, 0755) && errno != EEXIST) {
+		_pe("Failed creating %s", CGROUP_SVC);
+		return errno;
+	}
+
+	enable(CGROUP_ROOT);
+	enable(CGROUP_SVC);
+
+	return 0;
+}
+
+/**
+ * cgroup_path - Path to the cgroup of a service, or a file in it
+ * @svc:  Service
+ * @file: File in the cgroup, e.g. "memory.current", or %NULL
+ * @buf:  Buffer for the path
+ * @len:  Size of @buf
+ *
+ * Groups are named after the service, see svc_ident().
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if @buf is too small.
+ */
+int cgroup_path(svc_t *svc, char *file, char *buf, size_t len)
+{
+	char name[MAX_ARG_LEN + 12];
+	size_t n;
+
+	svc_ident(svc, name, sizeof(name));
+	if (file)
+		n = snprintf(buf, len, "%s/%s/%s", CGROUP_SVC, name, file);
+	else
+		n = snprintf(buf, len, "%s/%s", CGROUP_SVC, name);
+	if (n >= len)
+		return errno = ENAMETOOLONG;
+
+	return 0;
+}
+
+/* Write cgroup:KEY=VAL[,KEY=VAL] limits, '/' in VAL is a space */
+static void cgroup_limits(svc_t *svc)
+{
+	char buf[LINE_SIZE], *key, *ptr;
+
+	strlcpy(buf, svc_cgroup(svc), sizeof(buf));
+	for (key = strtok_r(buf, ",", &ptr); key; key = strtok_r(NULL, ",", &ptr)) {
+		char path[PATH_MAX], *val;
+		int i;
+
+		val = strchr(key, '=');
+		if (val)
+			*val++ = 0;
+		if (!val || strchr(key, '/')) {
+			_e("%s: invalid cgroup setting %s", svc->cmd, key);
+			continue;
+		}
+
+		for (i = 0; limits[i]; i++) {
+			if (!strncmp(key, limits[i], strlen(limits[i])))
+				break;
+		}
+		if (!limits[i]) {
+			_e("%s: unsupported cgroup setting %s", svc->cmd, key);
+			continue;
+		}
+
+		for (i = 0; val[i]; i++) {
+			if (val[i] == '/')
+				val[i] = ' ';
+		}
+
+		if (cgroup_path(svc, key, path, sizeof(path)) || write_file(path, val))
+			_pe("%s: failed setting %s to %s", svc->cmd, key, val);
+	}
+}
+
+/**
+ * cgroup_prepare - Create cgroup for a service about to start
+ * @svc: Service
+ *
+ * Creates the cgroup, if needed, and (re)applies the limits from the
+ * service stanza.  The child of spawn() joins the group by writing to
+ * the returned cgroup.procs, before it calls execve().
+ *
+ * Returns:
+ * Open file descriptor to the cgroup.procs file, or -1 if the service
+ * is to run without a cgroup.
+ */
+int cgroup_prepare(svc_t *svc)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (cgroup_path(svc, NULL, path, sizeof(path)))
+		return -1;
+
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		if (errno != ENOENT)
+			_pe("Failed creating cgroup %s", path);
+		return -1;
+	}
+
+	cgroup_limits(svc);
+
+	strlcat(path, "/cgroup.procs", sizeof(path));
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		_pe("Failed opening %s", path);
+
+	return fd;
+}
+
+/**
+ * cgroup_kill - Send SIGKILL to all processes of a service
+ * @svc: Service
+ *
+ * Uses cgroup.kill, so processes that have forked away from the main
+ * PID of the service, or are busy forking, are also killed.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if the kernel does not have cgroup.kill,
+ * or the service has no cgroup.
+ */
+int cgroup_kill(svc_t *svc)
+{
+	char path[PATH_MAX];
+
+	if (cgroup_path(svc, "cgroup.kill", path, sizeof(path)))
+		return errno;
+
+	return write_file(path, "1");
+}
+
+/**
+ * cgroup_remove - Remove the cgroup of a removed service
+ * @svc: Service
+ *
+ * Only an empty cgroup can be removed, any remaining processes are
+ * killed first.  Done in the background by the kernel, so this may
+ * fail, in which case the group is reused if the service comes back.
+ */
+void cgroup_remove(svc_t *svc)
+{
+	char path[PATH_MAX];
+
+	if (cgroup_path(svc, NULL, path, sizeof(path)))
+		return;
+
+	cgroup_kill(svc);
+	if (rmdir(path) && errno != ENOENT)
+		_d("Cannot remove %s yet: %s", path, strerror(errno));
+}
+
+/**
+ * cgroup_stat - Resource usage of all processes of a service
+ * @svc:      Service
+ * @cpu_usec: Total CPU time, from usage_usec in cpu.stat
+ * @mem:      Current memory use in bytes, from memory.current
+ *
+ * Values that cannot be read, e.g. due to a missing controller, are
+ * set to zero.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if the service has no cgroup.
+ */
+int cgroup_stat(svc_t *svc, uint64_t *cpu_usec, uint64_t *mem)
+{
+	char path[PATH_MAX], line[80];
+	FILE *fp;
+
+	*cpu_usec = *mem = 0;
+
+	if (cgroup_path(svc, "cpu.stat", path, sizeof(path)))
+		return errno;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return errno;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "usage_usec %" SCNu64, cpu_usec) == 1)
+			break;
+	}
+	fclose(fp);
+
+	if (!cgroup_path(svc, "memory.current", path, sizeof(path))) {
+		fp = fopen(path, "r");
+		if (fp) {
+			if (fscanf(fp, "%" SCNu64, mem) != 1)
+				*mem = 0;
+			fclose(fp);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
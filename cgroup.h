@@ -0,0 +1,49 @@
+/* cgroup v2 placement, resource limits and accounting per service
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef FINIT_CGROUP_H_
+#define FINIT_CGROUP_H_
+
+#include <stdint.h>
+#include "svc.h"
+
+#define CGROUP_ROOT  "/sys/fs/cgroup"
+#define CGROUP_SVC   CGROUP_ROOT "/system"	/* One child per service */
+
+int   cgroup_init    (void);
+int   cgroup_path    (svc_t *svc, char *file, char *buf, size_t len);
+int   cgroup_prepare (svc_t *svc);
+int   cgroup_kill    (svc_t *svc);
+void  cgroup_remove  (svc_t *svc);
+int   cgroup_stat    (svc_t *svc, uint64_t *cpu_usec, uint64_t *mem);
+
+#endif	/* FINIT_CGROUP_H_ */
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -28,6 +28,7 @@
 #include <string.h>
 
 #include "finit.h"
+#include "event.h"
 #include "service.h"
 #include "tty.h"
 #include "libite/lite.h"
@@ -126,8 +127,11 @@ void conf_parse_events(svc_t *svc, char *events)
 	/* By default we assume UNIX daemons support SIGHUP */
 	svc->sighup = 1;
 
-	if (!events)
+	if (!events) {
+		svc_set_events(svc, NULL);
+		event_compile(svc, NULL);
 		return;
+	}
 
 	/* First character must be '!' if SIGHUP is not supported. */
 	ptr = events;
@@ -140,13 +144,13 @@ void conf_parse_events(svc_t *svc, char *events)
 		i++;
 	ptr[i] = 0;
 
-	if (i >= sizeof(svc->events)) {
-		FLOG_WARN("Too long event list in declaration of %s: %s", svc->cmd, ptr);
+	if (svc_set_events(svc, ptr)) {
+		FLOG_WARN("Failed saving event list in declaration of %s: %s", svc->cmd, ptr);
 		return;
 	}
+	event_compile(svc, ptr);
 
 	svc->state = SVC_CONDHALT_STATE;
-	strlcpy(svc->events, ptr, sizeof(svc->events));
 }
 
 static void parse_static(char *line)
@@ -204,6 +208,12 @@ static void parse_static(char *line)
 		return;
 	}
 
+	if (MATCH_CMD(line, "watchdog ", x)) {
+		if (watchdog) free(watchdog);
+		watchdog = strdup(strip_line(x));
+		return;
+	}
+
 	if (MATCH_CMD(line, "runparts ", x)) {
 		if (runparts) free(runparts);
 		runparts = strdup(strip_line(x));
@@ -292,6 +302,16 @@ static void parse_dynamic(char *line, time_t mtime)
 		return;
 	}
 
+	/* Task started at a recurring time, and once at a given time */
+	if (MATCH_CMD(line, "cron ", x)) {
+		service_register(SVC_TYPE_CRON, x, mtime, NULL);
+		return;
+	}
+	if (MATCH_CMD(line, "at ", x)) {
+		service_register(SVC_TYPE_AT, x, mtime, NULL);
+		return;
+	}
+
 	/* Classic inetd service */
 	if (MATCH_CMD(line, "inetd ", x)) {
 #ifndef INETD_DISABLED
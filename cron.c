@@ -0,0 +1,529 @@
+/* Built-in cron and at, jobs started at a given time
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "libite/lite.h"
+
+#include "finit.h"
+#include "cron.h"
+#include "helpers.h"
+#include "private.h"
+#include "service.h"
+
+#define CRON_MAX_STEPS 10000	/* Give up finding a time, e.g. Feb 30 */
+
+/* All scheduled jobs, a min-heap ordered by when they are due next */
+static svc_t **heap;
+static int num_jobs, max_jobs;
+
+static uev_t timer_watcher;
+static int   timer_fd = -1;
+
+static void heap_swap(int a, int b)
+{
+	svc_t *tmp = heap[a];
+
+	heap[a] = heap[b];
+	heap[b] = tmp;
+}
+
+static void heap_up(int i)
+{
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (heap[parent]->sched_next <= heap[i]->sched_next)
+			break;
+
+		heap_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void heap_down(int i)
+{
+	while (1) {
+		int min = i, left = 2 * i + 1, right = 2 * i + 2;
+
+		if (left < num_jobs && heap[left]->sched_next < heap[min]->sched_next)
+			min = left;
+		if (right < num_jobs && heap[right]->sched_next < heap[min]->sched_next)
+			min = right;
+		if (min == i)
+			break;
+
+		heap_swap(i, min);
+		i = min;
+	}
+}
+
+static int heap_push(svc_t *svc)
+{
+	if (num_jobs == max_jobs) {
+		svc_t **tmp;
+		int max = max_jobs ? max_jobs * 2 : 8;
+
+		tmp = realloc(heap, max * sizeof(svc_t *));
+		if (!tmp)
+			return -1;
+		heap = tmp;
+		max_jobs = max;
+	}
+
+	heap[num_jobs] = svc;
+	heap_up(num_jobs++);
+
+	return 0;
+}
+
+static void heap_remove(int i)
+{
+	heap[i] = heap[--num_jobs];
+	if (i < num_jobs) {
+		heap_up(i);
+		heap_down(i);
+	}
+}
+
+static int heap_find(svc_t *svc)
+{
+	int i;
+
+	for (i = 0; i < num_jobs; i++) {
+		if (heap[i] == svc)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Next minute after @now matching @sched, in local time, or 0 if there
+ * is none.  Steps to the start of the next year, month, day, hour, or
+ * minute, whichever is the first field not matching, and lets mktime()
+ * normalize the result and sort out DST.
+ */
+static time_t cron_next(svc_sched_t *sched, time_t now)
+{
+	struct tm tm;
+	int i;
+
+	localtime_r(&now, &tm);
+	tm.tm_sec = 0;
+	tm.tm_min++;
+
+	for (i = 0; i < CRON_MAX_STEPS; i++) {
+		time_t next;
+
+		tm.tm_isdst = -1;
+		next = mktime(&tm);
+		if (next == (time_t)-1)
+			break;
+
+		if (sched->year >= 0 && tm.tm_year + 1900 > sched->year)
+			break;
+		if (sched->year >= 0 && tm.tm_year + 1900 < sched->year) {
+			tm.tm_year = sched->year - 1900;
+			tm.tm_mon  = 0;
+			tm.tm_mday = 1;
+			tm.tm_hour = tm.tm_min = 0;
+			continue;
+		}
+
+		if (sched->mon >= 0 && tm.tm_mon + 1 != sched->mon) {
+			tm.tm_mon++;
+			tm.tm_mday = 1;
+			tm.tm_hour = tm.tm_min = 0;
+			continue;
+		}
+
+		if ((sched->mday >= 0 && tm.tm_mday != sched->mday) ||
+		    (sched->wday >= 0 && tm.tm_wday != sched->wday)) {
+			tm.tm_mday++;
+			tm.tm_hour = tm.tm_min = 0;
+			continue;
+		}
+
+		if (sched->hour >= 0 && tm.tm_hour != sched->hour) {
+			tm.tm_hour++;
+			tm.tm_min = 0;
+			continue;
+		}
+
+		if (sched->min >= 0 && tm.tm_min != sched->min) {
+			tm.tm_min++;
+			continue;
+		}
+
+		return next;
+	}
+
+	return 0;
+}
+
+/* Wake up when the first job is due, or never if there are no jobs */
+static void cron_arm(void)
+{
+	struct itimerspec its;
+
+	if (timer_fd < 0)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	if (num_jobs)
+		its.it_value.tv_sec = heap[0]->sched_next;
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL))
+		_pe("Failed setting cron timer");
+}
+
+/* The system clock was set, so the next time of all cron jobs may have changed */
+static void cron_resched(void)
+{
+	time_t now = time(NULL);
+	int i, num = 0;
+
+	for (i = 0; i < num_jobs; i++) {
+		svc_t *svc = heap[i];
+
+		if (svc->type == SVC_TYPE_CRON)
+			svc->sched_next = cron_next(&svc->sched, now);
+		if (svc->sched_next)
+			heap[num++] = svc;
+	}
+
+	num_jobs = num;
+	for (i = num_jobs / 2 - 1; i >= 0; i--)
+		heap_down(i);
+}
+
+/* A job is due, skipped if still running from last time or not allowed in runlevel */
+static void cron_run(svc_t *svc)
+{
+	if (svc->pid > 0) {
+		_d("%s is still running, skipping this time.", svc->cmd);
+		return;
+	}
+
+	if (service_enabled(svc, 0, NULL) != SVC_START) {
+		_d("%s not enabled in runlevel %d, skipping this time.", svc->cmd, runlevel);
+		return;
+	}
+
+	_d("Starting %s job %s", svc->type == SVC_TYPE_AT ? "at" : "cron", svc->cmd);
+	service_start(svc);
+}
+
+static void timer_cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
+{
+	uint64_t num;
+	time_t now;
+
+	if (read(w->fd, &num, sizeof(num)) < 0 && errno == ECANCELED) {
+		_d("System clock changed, rescheduling cron jobs.");
+		cron_resched();
+	}
+
+	svc_update_begin();
+	now = time(NULL);
+	while (num_jobs && heap[0]->sched_next <= now) {
+		svc_t *svc = heap[0];
+
+		heap_remove(0);
+		if (svc->type == SVC_TYPE_CRON)
+			svc->sched_next = cron_next(&svc->sched, now);
+		else
+			svc->sched_next = 0;
+		if (svc->sched_next && heap_push(svc)) {
+			_e("Out of memory, cannot reschedule %s", svc->cmd);
+			svc->sched_next = 0;
+		}
+
+		cron_run(svc);
+
+		/* Not started, so it will not be collected either */
+		if (!svc->pid)
+			cron_collect(svc);
+	}
+	svc_update_end();
+
+	cron_arm();
+}
+
+/* Field of a schedule, a number in [@min,@max], or '*' for any */
+static int field(char *str, int min, int max, int *val)
+{
+	const char *err = NULL;
+
+	if (!strcmp(str, "*")) {
+		*val = -1;
+		return 0;
+	}
+
+	*val = strtonum(str, min, max, &err);
+	if (err)
+		return errno = EINVAL;
+
+	return 0;
+}
+
+/**
+ * cron_parse - Parse schedule of a cron or at job
+ * @spec:  Schedule, without the leading '@'
+ * @sched: Parsed schedule
+ *
+ * The schedule is an ISO date and time, @[YY|YYYY]-mm-ddTHH:MM, where
+ * any field can be '*', or one of @yearly, @annually, @monthly,
+ * @weekly, @daily, @midnight, and @hourly.  For at jobs @+N is useful,
+ * N minutes from now.  Times are in local time.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero with errno set to %EINVAL on error.
+ */
+int cron_parse(char *spec, svc_sched_t *sched)
+{
+	struct {
+		char        *name;
+		svc_sched_t  sched;
+	} alias[] = {		/* year mon mday wday hour min */
+		{ "yearly",   { -1,  1,  1, -1,  0,  0 } },
+		{ "annually", { -1,  1,  1, -1,  0,  0 } },
+		{ "monthly",  { -1, -1,  1, -1,  0,  0 } },
+		{ "weekly",   { -1, -1, -1,  0,  0,  0 } },
+		{ "daily",    { -1, -1, -1, -1,  0,  0 } },
+		{ "midnight", { -1, -1, -1, -1,  0,  0 } },
+		{ "hourly",   { -1, -1, -1, -1, -1,  0 } },
+	};
+	char buf[32], *date, *mon, *mday, *hour, *min;
+	size_t i;
+
+	for (i = 0; i < NELEMS(alias); i++) {
+		if (!strcasecmp(spec, alias[i].name)) {
+			*sched = alias[i].sched;
+			return 0;
+		}
+	}
+
+	if (spec[0] == '+') {
+		const char *err = NULL;
+		struct tm tm;
+		time_t at;
+
+		at = strtonum(&spec[1], 1, INT_MAX / 60, &err);
+		if (err)
+			return errno = EINVAL;
+
+		at = time(NULL) + at * 60;
+		localtime_r(&at, &tm);
+
+		sched->year = tm.tm_year + 1900;
+		sched->mon  = tm.tm_mon + 1;
+		sched->mday = tm.tm_mday;
+		sched->wday = -1;
+		sched->hour = tm.tm_hour;
+		sched->min  = tm.tm_min;
+		return 0;
+	}
+
+	if (strlcpy(buf, spec, sizeof(buf)) >= sizeof(buf))
+		return errno = EINVAL;
+
+	date = buf;
+	mon  = strchr(date, '-');
+	if (!mon)
+		return errno = EINVAL;
+	*mon++ = 0;
+	mday = strchr(mon, '-');
+	if (!mday)
+		return errno = EINVAL;
+	*mday++ = 0;
+	hour = strchr(mday, 'T');
+	if (!hour)
+		return errno = EINVAL;
+	*hour++ = 0;
+	min = strchr(hour, ':');
+	if (!min)
+		return errno = EINVAL;
+	*min++ = 0;
+
+	if (field(date, 0, 9999, &sched->year) || field(mon, 1, 12, &sched->mon) ||
+	    field(mday, 1, 31, &sched->mday)   || field(hour, 0, 23, &sched->hour) ||
+	    field(min, 0, 59, &sched->min))
+		return errno = EINVAL;
+	sched->wday = -1;
+
+	/* YY */
+	if (sched->year >= 0 && sched->year < 100)
+		sched->year += 2000;
+
+	return 0;
+}
+
+/**
+ * cron_add - Schedule, or reschedule, a cron or at job
+ * @svc: Job, with its schedule in @svc->sched
+ *
+ * Jobs that are never due, e.g. an at job in the past, are not kept.
+ */
+void cron_add(svc_t *svc)
+{
+	int i = heap_find(svc);
+
+	if (i >= 0)
+		heap_remove(i);
+
+	svc->sched_next = cron_next(&svc->sched, time(NULL));
+	if (!svc->sched_next) {
+		_e("No future time to run %s, not scheduled.", svc->cmd);
+	} else if (heap_push(svc)) {
+		_e("Out of memory, cannot schedule %s", svc->cmd);
+		svc->sched_next = 0;
+	}
+
+	cron_arm();
+}
+
+/**
+ * cron_del - Unschedule a cron or at job
+ * @svc: Job that is being removed
+ */
+void cron_del(svc_t *svc)
+{
+	int i = heap_find(svc);
+
+	svc->sched_next = 0;
+	if (i < 0)
+		return;
+
+	heap_remove(i);
+	cron_arm();
+}
+
+/**
+ * cron_collect - A cron or at job has exited, or was skipped
+ * @svc: Job
+ *
+ * At jobs from initctl are removed when done.
+ */
+void cron_collect(svc_t *svc)
+{
+	if (svc->state == SVC_RUNNING_STATE)
+		svc->state = SVC_HALTED_STATE;
+
+	if (svc->type != SVC_TYPE_AT || !svc->sched_api || svc->sched_next)
+		return;
+
+	svc->state = SVC_HALTED_STATE;
+	service_unregister(svc);
+}
+
+/**
+ * cron_at - Add an at job, from initctl
+ * @line: Job, @SCHEDULE [LVLS] /path/to/cmd [ARGS] [-- Description]
+ *
+ * Each job is a new instance of its command, so the same command can
+ * be scheduled many times.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero with errno set on error.
+ */
+int cron_at(char *line)
+{
+	char buf[LINE_SIZE], cmd[MAX_ARG_LEN], *ptr;
+	svc_t *svc;
+	int id;
+
+	for (ptr = line; *ptr; ptr += strcspn(ptr, " ")) {
+		ptr += strspn(ptr, " ");
+		if (*ptr == '/' || !*ptr)
+			break;
+	}
+	if (*ptr != '/')
+		return errno = EINVAL;
+
+	strlcpy(cmd, ptr, MIN(sizeof(cmd), strcspn(ptr, " ") + 1));
+	id = svc_next_id(cmd);
+	snprintf(buf, sizeof(buf), ":%d %s", id, line);
+
+	if (service_register(SVC_TYPE_AT, buf, 0, NULL))
+		return errno;
+
+	svc = svc_find(cmd, id);
+	if (!svc)
+		return errno = ENOENT;
+
+	svc->sched_api = 1;
+	if (!svc->sched_next) {
+		svc->state = SVC_HALTED_STATE;
+		service_unregister(svc);
+		return errno = EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * cron_init - Start timer for cron and at jobs
+ * @ctx: Event context
+ *
+ * One timer, for the job that is due first.  It is a timerfd on the
+ * system clock, rather than a libuev timer, to be told when the clock
+ * is set, e.g. by NTP on systems without RTC.
+ *
+ * Returns:
+ * POSIX OK(0) or non-zero on error.
+ */
+int cron_init(uev_ctx_t *ctx)
+{
+	timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		_pe("Failed creating cron timer");
+		return 1;
+	}
+
+	if (uev_io_init(ctx, &timer_watcher, timer_cb, NULL, timer_fd, UEV_READ)) {
+		close(timer_fd);
+		timer_fd = -1;
+		return 1;
+	}
+
+	cron_arm();
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,587 @@
+/* Dependency graph for parallel start of services, tasks and run commands
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "finit.h"
+#include "helpers.h"
+#include "private.h"
+#include "service.h"
+#include "dag.h"
+
+typedef enum {
+	DAG_WAIT = 0,		/* Waiting for dependencies            */
+	DAG_READY,		/* Queued for start in next wave       */
+	DAG_RUNNING,		/* Started, run/task not yet collected */
+	DAG_DONE,
+	DAG_FAILED
+} dag_state_t;
+
+typedef struct {
+	int          to;	/* Index of dependent node              */
+	int          hard;	/* requires:, dependent fails with us */
+} dag_edge_t;
+
+typedef struct {
+	svc_t       *svc;
+	dag_state_t  state;
+	int          wait;	/* Number of dependencies not yet done */
+	int          fail;	/* A required dependency failed        */
+	char        *names;	/* Basename of command, and provides:  */
+	dag_edge_t  *out;	/* Nodes depending on this one         */
+	int          num_out, max_out;
+} dag_node_t;
+
+typedef struct {
+	char        *name;
+	int          node;
+} dag_name_t;
+
+/*
+ * Startup graph, private to PID 1.  Nodes are added in registration
+ * order, by service_bootstrap(), service_runlevel() and on reload, and
+ * are started in waves: all nodes with no unfinished dependencies are
+ * started at once, in registration order.  A service, or a task that
+ * nothing requires, is done when it has been started.  A run command,
+ * or a required task, is done when it has been collected.  Each
+ * collected child may start the next wave, see dag_done().
+ */
+static struct {
+	dag_node_t  *node;
+	int          num, max;
+	int          built;	/* Nodes with resolved dependencies */
+	int          waiting;	/* Nodes in DAG_WAIT or DAG_READY   */
+	int          running;	/* Nodes in DAG_RUNNING             */
+	int         *queue;	/* Nodes in DAG_READY               */
+	int          queued;
+	dag_name_t  *names;	/* Sorted index of names to nodes   */
+	int          num_names;
+	int          sync;	/* Wait for all tasks, see dag_sync() */
+} dag;
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(((dag_name_t *)a)->name, ((dag_name_t *)b)->name);
+}
+
+static int int_cmp(const void *a, const void *b)
+{
+	return *(int *)a - *(int *)b;
+}
+
+/* Check if @name is in comma separated @list */
+static int in_list(char *list, char *name)
+{
+	size_t len = strlen(name);
+
+	while (*list) {
+		size_t n = strcspn(list, ",");
+
+		if (n == len && !strncmp(list, name, len))
+			return 1;
+
+		list += n;
+		if (*list)
+			list++;
+	}
+
+	return 0;
+}
+
+static void reset(void)
+{
+	int i;
+
+	for (i = 0; i < dag.num; i++) {
+		dag_node_t *node = &dag.node[i];
+
+		if (node->svc->dag == i + 1)
+			node->svc->dag = 0;
+		free(node->names);
+		free(node->out);
+	}
+
+	free(dag.names);
+	dag.names     = NULL;
+	dag.num_names = 0;
+	dag.num       = 0;
+	dag.built     = 0;
+	dag.queued    = 0;
+}
+
+static void push(int i)
+{
+	dag.node[i].state = DAG_READY;
+	dag.queue[dag.queued++] = i;
+}
+
+static int edge(int from, int to, int hard)
+{
+	dag_node_t *node = &dag.node[from];
+	dag_edge_t *e;
+
+	if (from == to)
+		return 0;
+
+	switch (node->state) {
+	case DAG_DONE:
+		return 0;
+
+	case DAG_FAILED:
+		if (hard)
+			dag.node[to].fail = 1;
+		return 0;
+
+	default:
+		break;
+	}
+
+	if (node->num_out == node->max_out) {
+		int max = node->max_out ? node->max_out * 2 : 4;
+
+		e = realloc(node->out, max * sizeof(*e));
+		if (!e)
+			return errno = ENOMEM;
+		node->out = e;
+		node->max_out = max;
+	}
+
+	e = &node->out[node->num_out++];
+	e->to   = to;
+	e->hard = hard;
+	dag.node[to].wait++;
+
+	return 0;
+}
+
+/* Sorted index of all names provided by nodes in the graph */
+static int index_names(void)
+{
+	dag_name_t *names;
+	char *name;
+	int i, num = 0;
+
+	/* Names are NUL separated, ending with an empty one, see dag_add() */
+	for (i = 0; i < dag.num; i++) {
+		for (name = dag.node[i].names; name[0]; name += strlen(name) + 1)
+			num++;
+	}
+
+	names = realloc(dag.names, num * sizeof(*names));
+	if (!names && num) {
+		dag.num_names = 0;
+		return errno = ENOMEM;
+	}
+
+	dag.names = names;
+	dag.num_names = 0;
+	for (i = 0; i < dag.num; i++) {
+		for (name = dag.node[i].names; name[0]; name += strlen(name) + 1) {
+			names[dag.num_names].name = name;
+			names[dag.num_names].node = i;
+			dag.num_names++;
+		}
+	}
+	qsort(dag.names, dag.num_names, sizeof(*names), name_cmp);
+
+	return 0;
+}
+
+/* A running service, or a run/task that has completed successfully */
+static int is_started(svc_t *svc)
+{
+	if (svc_is_daemon(svc))
+		return svc->pid > 0;
+	if (SVC_TYPE_RUN == svc->type || SVC_TYPE_TASK == svc->type)
+		return svc_priv(svc)->done;
+
+	return 1;		/* inetd, listening whenever registered */
+}
+
+/*
+ * Provided by anything not in the graph, looked up by basename in the
+ * name hash, or among the services with provides:
+ */
+static int is_available(char *name)
+{
+	svc_t *svc;
+	svc_iter_t iter;
+
+	for (svc = svc_named_iterator(&iter, 1, name); svc; svc = svc_named_iterator(&iter, 0, name)) {
+		if (is_started(svc))
+			return 1;
+	}
+
+	for (svc = svc_provides_iterator(&iter, 1); svc; svc = svc_provides_iterator(&iter, 0)) {
+		if (in_list(svc_provides(svc), name) && is_started(svc))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void resolve(int i, char *list, int hard)
+{
+	char buf[LINE_SIZE], *name, *ptr = NULL;
+	svc_t *svc = dag.node[i].svc;
+
+	strlcpy(buf, list, sizeof(buf));
+	for (name = strtok_r(buf, ",", &ptr); name; name = strtok_r(NULL, ",", &ptr)) {
+		dag_name_t key = { .name = name }, *hit = NULL;
+
+		if (dag.num_names)
+			hit = bsearch(&key, dag.names, dag.num_names, sizeof(key), name_cmp);
+		if (hit) {
+			while (hit > dag.names && !strcmp((hit - 1)->name, name))
+				hit--;
+			for (; hit < &dag.names[dag.num_names] && !strcmp(hit->name, name); hit++)
+				edge(hit->node, i, hard);
+			continue;
+		}
+
+		if (!hard || is_available(name))
+			continue;
+
+		_e("%s requires %s, which is not available.", svc->cmd, name);
+		dag.node[i].fail = 1;
+	}
+}
+
+/* Node has been started, or failed, release nodes waiting for it */
+static void finish(int i, int ok)
+{
+	dag_node_t *node = &dag.node[i];
+	int j;
+
+	if (node->state == DAG_RUNNING)
+		dag.running--;
+	else if (node->state < DAG_RUNNING)
+		dag.waiting--;
+	else
+		return;
+
+	node->state = ok ? DAG_DONE : DAG_FAILED;
+	for (j = 0; j < node->num_out; j++) {
+		dag_edge_t *e = &node->out[j];
+		dag_node_t *next = &dag.node[e->to];
+
+		if (next->state != DAG_WAIT)
+			continue;
+
+		if (!ok && e->hard)
+			next->fail = 1;
+		if (--next->wait <= 0)
+			push(e->to);
+	}
+}
+
+/* Does any node in the graph require: this one? */
+static int is_required(int i)
+{
+	dag_node_t *node = &dag.node[i];
+	int j;
+
+	for (j = 0; j < node->num_out; j++) {
+		if (node->out[j].hard)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void launch(int i)
+{
+	dag_node_t *node = &dag.node[i];
+	svc_t *svc = node->svc;
+
+	/* Removed while queued */
+	if (node->state != DAG_READY)
+		return;
+
+	if (node->fail) {
+		_e("Not starting %s, a required service failed.", svc->cmd);
+		finish(i, 0);
+		return;
+	}
+
+	node->state = DAG_RUNNING;
+	dag.waiting--;
+	dag.running++;
+
+	/* Socket activated, clients can connect before it has started */
+	if (service_start(svc))
+		finish(i, 0);
+	else if (svc_is_daemon(svc) && svc->num_sock)
+		finish(i, 1);
+	/* Tasks are fire-and-forget, unless something requires: them */
+	else if (SVC_TYPE_TASK == svc->type && !dag.sync && !is_required(i))
+		finish(i, svc->pid > 0);
+	/* A service with ready: is done when service_ready() says so */
+	else if (svc->pid <= 0)
+		finish(i, 0);
+	else if (svc_is_daemon(svc) && svc->state != SVC_STARTING_STATE)
+		finish(i, 1);
+}
+
+/* Start waves of ready nodes until we must wait for a run/task */
+static void step(void)
+{
+	static int active = 0;
+
+	if (active)
+		return;
+	active = 1;
+
+	for (;;) {
+		int i, num = dag.queued;
+
+		/* Nothing left to wait for, the rest must be in a loop */
+		if (!num && !dag.running && dag.waiting) {
+			for (i = 0; i < dag.num; i++) {
+				if (dag.node[i].state != DAG_WAIT)
+					continue;
+
+				_e("Dependency loop detected, starting %s anyway.", dag.node[i].svc->cmd);
+				push(i);
+				num++;
+				break;
+			}
+		}
+		if (!num)
+			break;
+
+		qsort(dag.queue, num, sizeof(int), int_cmp);
+		for (i = 0; i < num; i++)
+			launch(dag.queue[i]);
+
+		dag.queued -= num;
+		memmove(dag.queue, &dag.queue[num], dag.queued * sizeof(int));
+	}
+
+	active = 0;
+
+	/* A reload in progress is done when all its services have started */
+	if (!dag_busy())
+		service_reload_check();
+}
+
+/**
+ * dag_add - Add service to startup graph
+ * @svc: Service, task or run command to start
+ *
+ * Nothing is started until dag_run() is called.  The graph is reset
+ * when all nodes from previous calls have been started and collected.
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on error.
+ */
+int dag_add(svc_t *svc)
+{
+	dag_node_t *node;
+	char *provides;
+	size_t len;
+
+	if (!dag_busy())
+		reset();
+
+	/* Already waiting to be started? */
+	if (svc->dag > 0 && svc->dag <= dag.num) {
+		node = &dag.node[svc->dag - 1];
+		if (node->svc == svc && node->state < DAG_DONE)
+			return 0;
+	}
+
+	if (dag.num == dag.max) {
+		int max = dag.max ? dag.max * 2 : MIN_NUM_SVC;
+		dag_node_t *nodes;
+		int *queue;
+
+		nodes = realloc(dag.node, max * sizeof(*nodes));
+		if (!nodes)
+			goto nomem;
+		dag.node = nodes;
+
+		queue = realloc(dag.queue, max * sizeof(*queue));
+		if (!queue)
+			goto nomem;
+		dag.queue = queue;
+		dag.max = max;
+	}
+
+	/* "basename\0provides\0\0", comma separated provides: split later */
+	provides = svc_provides(svc);
+	len = strlen(basename(svc->cmd)) + strlen(provides) + 3;
+
+	node = &dag.node[dag.num];
+	memset(node, 0, sizeof(*node));
+	node->names = calloc(1, len);
+	if (!node->names)
+		goto nomem;
+
+	strlcpy(node->names, basename(svc->cmd), len);
+	if (provides[0]) {
+		char *ptr = node->names + strlen(node->names) + 1;
+
+		strlcpy(ptr, provides, len - (ptr - node->names));
+		while ((ptr = strchr(ptr, ',')))
+			*ptr++ = 0;
+	}
+
+	node->svc   = svc;
+	node->state = DAG_WAIT;
+	svc->dag    = ++dag.num;
+	dag.waiting++;
+
+	return 0;
+nomem:
+	_e("Out of memory, starting %s without dependencies.", svc->cmd);
+	service_start(svc);
+
+	return errno = ENOMEM;
+}
+
+/**
+ * dag_run - Resolve dependencies of new nodes and start first wave
+ *
+ * Services are ordered by requires: and after: on the names each one
+ * provides, its basename and any provides:.  A service that requires
+ * something which fails, or is not available, is not started.  After
+ * is only for ordering.  For compatibility everything registered after
+ * a run command without any dependency declarations waits for it, as
+ * before.  Such run commands no longer block PID 1 though.
+ */
+void dag_run(void)
+{
+	int i, barrier = -1;
+
+	if (index_names())
+		_e("Out of memory, ignoring dependencies.");
+
+	for (i = dag.built; i < dag.num; i++) {
+		svc_t *svc = dag.node[i].svc;
+
+		if (barrier >= 0)
+			edge(barrier, i, 0);
+
+		resolve(i, svc_requires(svc), 1);
+		resolve(i, svc_after(svc), 0);
+
+		if (SVC_TYPE_RUN == svc->type && !svc_requires(svc)[0] &&
+		    !svc_provides(svc)[0] && !svc_after(svc)[0])
+			barrier = i;
+	}
+
+	for (i = dag.built; i < dag.num; i++) {
+		if (!dag.node[i].wait)
+			push(i);
+	}
+	dag.built = dag.num;
+
+	step();
+}
+
+/**
+ * dag_done - Report completion of a run/task, or removal of a service
+ * @svc: Service in the startup graph
+ * @ok:  Completed successfully, dependents requiring @svc may start
+ *
+ * Called by service_monitor() when a run/task is collected, starting
+ * the next wave of nodes that waited for it.
+ */
+void dag_done(svc_t *svc, int ok)
+{
+	int i = svc->dag - 1;
+
+	if (i < 0 || i >= dag.num || dag.node[i].svc != svc)
+		return;
+
+	finish(i, ok);
+	step();
+}
+
+/**
+ * dag_failed - Check if a service failed to start
+ * @svc: Service in the startup graph
+ *
+ * Returns:
+ * %TRUE(1) if @svc, or a service it requires, failed to start in the
+ * last run of the graph, otherwise %FALSE(0).
+ */
+int dag_failed(svc_t *svc)
+{
+	int i = svc->dag - 1;
+
+	if (i < 0 || i >= dag.num || dag.node[i].svc != svc)
+		return 0;
+
+	return dag.node[i].state == DAG_FAILED;
+}
+
+/**
+ * dag_busy - Check if the startup graph has unfinished nodes
+ *
+ * Returns:
+ * %TRUE(1) if any node is still waiting or running, otherwise %FALSE(0)
+ */
+int dag_busy(void)
+{
+	return dag.waiting || dag.running;
+}
+
+/**
+ * dag_sync - Wait for all tasks to complete from now on
+ *
+ * Used when changing to runlevel 0 or 6, all run and task stanzas of
+ * that runlevel must complete before do_shutdown() kills everything.
+ */
+void dag_sync(void)
+{
+	dag.sync = 1;
+}
+
+/**
+ * dag_wait - Run the event loop until the startup graph is done
+ *
+ * For bootstrap, before the main event loop runs, the next stage of
+ * the boot must not start until everything in this one has.  Besides
+ * collecting children, services signal readiness over the notify
+ * socket, or by writing a pidfile, and ready timers must fire.
+ */
+void dag_wait(void)
+{
+	while (dag_busy()) {
+		if (uev_run(ctx, UEV_ONCE))
+			break;
+	}
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -25,160 +25,363 @@
 #include "libite/lite.h"
 
 #include "finit.h"
+#include "event.h"
 #include "service.h"
 
-struct ifc {
-	LIST_ENTRY(ifc) link;
+/*
+ * A condition, the default gateway or an interface being up, and the
+ * services requiring it.  Conditions are never removed, services refer
+ * to them by their index, see event_compile().  The first is GW.  An
+ * interface name must match exactly, unless it ends with a wildcard,
+ * e.g. IFUP:ppp* is met by any interface with a name starting with ppp.
+ */
+typedef struct {
+	char     ifname[IFNAMSIZ];	/* Empty for GW */
+	int      known;			/* Seen, and not deleted */
+	int      up;			/* This interface is up */
+	int      met;			/* Any matching interface is up */
+	unsigned int changed;		/* Generation of last change of met */
 
-	int  updown;
-	char ifname[IFNAMSIZ];
-};
+	svc_t  **deps;
+	int      num_deps, max_deps;
+} cond_t;
 
-static int              gwup    = 0;
-static LIST_HEAD(, ifc) ifcache = LIST_HEAD_INITIALIZER();
+#define COND_GW 0
 
+static cond_t          *conds;
+static int              num_conds, max_conds;
 
-static int cache_gw(char *updown)
+/* Bumped when events change, invalidates cached plugin callback results */
+static unsigned int     generation = 1;
+
+
+/* Does condition @id match interface @ifname, e.g. ppp* matches ppp0 */
+static int cond_match(int id, char *ifname)
 {
-	int oldgw = gwup;
+	cond_t *c = &conds[id];
+	size_t len;
 
-	if (!strncasecmp(updown, "UP", 2))
-		gwup = 1;
-	else
-		gwup = 0;
+	if (id == COND_GW)
+		return 0;
 
-	return (oldgw == gwup) ? 0 : gwup == 0 ? -1 : 1;
+	len = strnlen(c->ifname, sizeof(c->ifname));
+	if (len && c->ifname[len - 1] == '*')
+		return !strncmp(c->ifname, ifname, len - 1);
+
+	return !strncmp(c->ifname, ifname, sizeof(c->ifname));
 }
 
-static struct ifc *find_if(char *ifname)
+/* GW is up, or any interface matching condition @id is up */
+static int cond_met(int id)
 {
-	struct ifc *entry;
+	int i;
+
+	if (id == COND_GW)
+		return conds[COND_GW].up;
 
-	LIST_FOREACH(entry, &ifcache, link) {
-		if (!strncmp(entry->ifname, ifname, sizeof(entry->ifname)))
-			return entry;
+	for (i = COND_GW + 1; i < num_conds; i++) {
+		if (conds[i].up && cond_match(id, conds[i].ifname))
+			return 1;
 	}
 
-	return NULL;
+	return 0;
 }
 
-static int alloc_if(char *ifname, int updown)
+static int cond_alloc(char *ifname)
 {
-	struct ifc *entry = calloc(1, sizeof(struct ifc));
+	if (num_conds == max_conds) {
+		cond_t *tmp;
+		int max = max_conds ? max_conds * 2 : 8;
+
+		tmp = realloc(conds, max * sizeof(cond_t));
+		if (!tmp) {
+			_pe("Failed recording interface event");
+			return -1;
+		}
+		conds = tmp;
+		max_conds = max;
+	}
 
-	if (!entry) {
-		_pe("Failed recording interface event");
-		return 0;
+	_d("Creating new condition for %s", ifname[0] ? ifname : "GW");
+	memset(&conds[num_conds], 0, sizeof(cond_t));
+	strlcpy(conds[num_conds].ifname, ifname, sizeof(conds[num_conds].ifname));
+	conds[num_conds].met = cond_met(num_conds);
+
+	return num_conds++;
+}
+
+/* Condition ID of @ifname, or GW if empty, optionally created, or -1 */
+static int cond_find(char *ifname, int create)
+{
+	int i;
+
+	if (!num_conds && cond_alloc("") < 0)
+		return -1;
+	if (!ifname[0])
+		return COND_GW;
+
+	for (i = COND_GW + 1; i < num_conds; i++) {
+		if (!strncmp(conds[i].ifname, ifname, sizeof(conds[i].ifname)))
+			return i;
 	}
 
-	_d("Creating new node for %s", ifname);
-	entry->updown = updown;
-	strlcpy(entry->ifname, ifname, sizeof(entry->ifname));
-	LIST_INSERT_HEAD(&ifcache, entry, link);
+	if (!create)
+		return -1;
 
-	return 1;
+	return cond_alloc(ifname);
 }
 
-static int free_if(char *ifname)
+static int svc_has_cond(svc_t *svc, int id)
 {
-	struct ifc *entry = find_if(ifname);
+	int i;
 
-	if (!entry)
+	if (svc->type != SVC_TYPE_SERVICE)
 		return 0;
 
-	LIST_REMOVE(entry, link);
-	return -1;
+	for (i = 0; i < svc->num_cond; i++) {
+		if (svc->cond[i] == id)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int has_events(char *events)
+{
+	return events && events[0];
+}
+
+static int dep_add(int id, svc_t *svc)
+{
+	cond_t *c = &conds[id];
+
+	if (c->num_deps == c->max_deps) {
+		svc_t **tmp;
+		int max = c->max_deps ? c->max_deps * 2 : 4;
+
+		tmp = realloc(c->deps, max * sizeof(svc_t *));
+		if (!tmp)
+			return -1;
+		c->deps = tmp;
+		c->max_deps = max;
+	}
+	c->deps[c->num_deps++] = svc;
+
+	return 0;
+}
+
+static void dep_del(int id, svc_t *svc)
+{
+	cond_t *c = &conds[id];
+	int i;
+
+	for (i = 0; i < c->num_deps; i++) {
+		if (c->deps[i] == svc) {
+			c->deps[i] = c->deps[--c->num_deps];
+			return;
+		}
+	}
+}
+
+static int cache_gw(char *updown)
+{
+	cond_t *c = &conds[COND_GW];
+	int oldgw = c->up;
+
+	if (!strncasecmp(updown, "UP", 2))
+		c->up = 1;
+	else
+		c->up = 0;
+	c->known = 1;
+
+	return (oldgw == c->up) ? 0 : c->up == 0 ? -1 : 1;
 }
 
-static int cache_if(char *ifname, int updown)
+static int cache_if(int id, int updown)
 {
-	struct ifc *entry = find_if(ifname);
+	cond_t *c = &conds[id];
+	int old = c->up;
 
-	if (entry) {
-		int old = entry->updown;
-		
-		entry->updown = updown;
-		return old == updown ? 0 : updown ? 1 : -1;
+	if (!c->known) {
+		c->known = 1;
+		c->up = updown;
+		return updown ? 1 : 0;
 	}
 
-	return alloc_if(ifname, updown);
+	c->up = updown;
+	return old == updown ? 0 : updown ? 1 : -1;
+}
+
+static int free_if(int id)
+{
+	cond_t *c = &conds[id];
+
+	if (!c->known)
+		return 0;
+
+	c->known = 0;
+	c->up = 0;
+	return -1;
 }
 
 /*
  * System events like GW/IF are cached, this function caters to that
- * Returns: 0 if no change, -1 on condition low, +1 on condition high
+ * Returns: 0 if no change, -1 on condition low, +1 on condition high,
+ * and the GW or interface that changed in @id
  */
-static int event_cache(char *msg)
+static int event_cache(char *msg, int *id)
 {
-	if (!strncmp(msg, "GW:", 3))
-		return cache_gw(&msg[3]);
+	char *ifname = NULL;
 
-	if (!strncmp(msg, "IFUP:", 5))
-		return cache_if(&msg[5], 1);
+	if (!strncmp(msg, "IFUP:", 5) || !strncmp(msg, "IFDN:", 5))
+		ifname = &msg[5];
+	else if (!strncmp(msg, "IFDEL:", 6))
+		ifname = &msg[6];
+	else if (strncmp(msg, "GW:", 3))
+		return 0; /* No chnage, unknown event. */
 
-	if (!strncmp(msg, "IFDN:", 5))
-		return cache_if(&msg[5], 0);
+	/* Wildcards are only for conditions, not for events */
+	if (ifname && strchr(ifname, '*'))
+		return 0;
+
+	*id = cond_find(ifname ? ifname : "", 1);
+	if (*id < 0)
+		return 0;
+
+	if (!ifname)
+		return cache_gw(&msg[3]);
 
 	if (!strncmp(msg, "IFDEL:", 6))
-		return free_if(&msg[6]);
+		return free_if(*id);
 
-	return 0; /* No chnage, unknown event. */
+	return cache_if(*id, msg[2] == 'U');
 }
 
 int event_cache_gw(void)
 {
-	return gwup;
+	if (!num_conds)
+		return 0;
+
+	return conds[COND_GW].met;
 }
 
 int event_cache_if(char *ifname)
 {
-	struct ifc *entry = find_if(ifname);
+	int id = cond_find(ifname, 0);
 
-	if (!entry)
+	if (id < 0)
 		return 0;
-	
-	return entry->updown;
+
+	return conds[id].up;
 }
 
-static int has_events(char *events)
+/**
+ * event_compile - Compile events a service requires to condition IDs
+ * @svc:    Service
+ * @events: Comma separated events, GW and IFUP:IFNAME, or %NULL
+ *
+ * Parsed once, when the service is registered, instead of each time
+ * the service is checked.  Each condition also keeps a list of the
+ * services requiring it, so an event only concerns those.  IFDN:IFNAME
+ * is the same condition as IFUP:IFNAME.  With a trailing wildcard,
+ * IFUP:IFNAME*, it is met when any interface with a name starting with
+ * IFNAME is up.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if any event could not be compiled.
+ */
+int event_compile(svc_t *svc, char *events)
 {
-	return events && events[0];
+	char buf[LINE_SIZE], *msg, *pos;
+	int rc = 0;
+
+	event_forget(svc);
+	if (!has_events(events))
+		return 0;
+
+	strlcpy(buf, events, sizeof(buf));
+	for (msg = strtok_r(buf, ",", &pos); msg; msg = strtok_r(NULL, ",", &pos)) {
+		int i, id;
+
+		if (!strncmp(msg, "GW", 2))
+			id = cond_find("", 1);
+		else if (!strncmp(msg, "IFUP:", 5) || !strncmp(msg, "IFDN:", 5))
+			id = cond_find(&msg[5], 1);
+		else {
+			_e("Unknown event %s in %s, discarding.", msg, svc->cmd);
+			rc = errno = EINVAL;
+			continue;
+		}
+
+		for (i = 0; i < svc->num_cond; i++) {
+			if (svc->cond[i] == id)
+				break;
+		}
+		if (i < svc->num_cond)
+			continue;
+
+		if (svc->num_cond == MAX_NUM_SVC_COND) {
+			_e("Too many events in %s, discarding %s.", svc->cmd, msg);
+			rc = errno = E2BIG;
+			break;
+		}
+
+		if (id < 0 || dep_add(id, svc)) {
+			_e("Out of memory, discarding event %s in %s.", msg, svc->cmd);
+			rc = errno = ENOMEM;
+			continue;
+		}
+		svc->cond[svc->num_cond++] = id;
+	}
+
+	return rc;
 }
 
-static int matches_event(char *events, char *event)
+/**
+ * event_forget - Remove service from the conditions it requires
+ * @svc: Service being removed, or registered again
+ */
+void event_forget(svc_t *svc)
 {
-	return strcasestr(events, event) ? 1 : 0;
+	int i;
+
+	for (i = 0; i < svc->num_cond; i++)
+		dep_del(svc->cond[i], svc);
+	svc->num_cond = 0;
 }
 
-int event_service_cond(char *events)
+/* All conditions of service met, or it has none */
+int event_service_cond(svc_t *svc)
 {
-	int cond = 1;
-	char *msg;
-	char temp[MAX_ARG_LEN];
+	int i;
 
-	/* No required events, condition satisfied */
-	if (!has_events(events))
-		return cond;
+	for (i = 0; i < svc->num_cond; i++) {
+		if (!conds[svc->cond[i]].met) {
+			_d("%s waiting for %s", svc->cmd, conds[svc->cond[i]].ifname[0]
+			   ? conds[svc->cond[i]].ifname : "GW");
+			return 0;
+		}
+	}
 
-	strlcpy(temp, events, sizeof(temp));
-	msg = strtok(temp, ",");
-	while (msg) {
-		_d("Looking for %s (in %s), cond %d", msg, events, cond);
+	return 1;
+}
 
-		if (!strncmp(msg, "GW", 2))
-			cond &= event_cache_gw();
-		else if (!strncmp(msg, "IFUP:", 5))
-			cond &= event_cache_if(&msg[5]);
-		else if (!strncmp(msg, "IFDN:", 5))
-			cond &= event_cache_if(&msg[5]);
-		else
-			_e("Unknown event %s, discarding.", msg);
-
-		_d("=> cond %d", cond);
-		msg = strtok(NULL, ",");
-	}
+/*
+ * Current generation of events, service plugin callbacks only need to
+ * be called again when this changes, see service_enabled()
+ */
+unsigned int event_generation(void)
+{
+	return generation;
+}
 
-	return cond;
+/*
+ * Force service plugin callbacks to be called again, e.g. on reload
+ */
+void event_invalidate(void)
+{
+	if (!++generation)
+		generation = 1;
 }
 
 /*
@@ -189,8 +392,7 @@ int event_service_cond(char *events)
  */
 void event_dispatch(char *msg)
 {
-	int change;
-	svc_t *svc;
+	int change, id, i, j;
 
 	if (!msg) {
 		_e("Invalid message received.");
@@ -198,36 +400,65 @@ void event_dispatch(char *msg)
 	}
 
 	_d("%s", msg);
-	change = event_cache(msg);
+	change = event_cache(msg, &id);
 	if (!change) {
 		_d("Nothing to do");
 		return;
 	}
+	event_invalidate();
+
+	/* Conditions matching the GW or interface, e.g. both ppp* and ppp0 */
+	for (i = 0; i < num_conds; i++) {
+		int met;
 
-	/* Iterate over svc_t and call service_restart() for event matches */
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
-		if (svc->type != SVC_TYPE_SERVICE  ||
-		    !service_enabled(svc, 1, NULL) ||
-		    !has_events(svc->events)       ||
-		    !matches_event(svc->events, msg)) {
-			_d("No match for %s in service %s", msg, svc->cmd);
+		if (i != id && !cond_match(i, conds[id].ifname))
 			continue;
-		}
 
-		if (change == 1) {
-			_d("%s matches <%s> %s (re)starting ...", msg, svc->events, svc->cmd);
-			if (!svc->pid) {
-				service_start(svc);
-				continue;
+		met = cond_met(i);
+		if (met == conds[i].met)
+			continue;
+
+		conds[i].met = met;
+		conds[i].changed = generation;
+	}
+
+	/* Only services requiring a changed condition, (re)start or stop them */
+	for (i = 0; i < num_conds; i++) {
+		cond_t *c = &conds[i];
+
+		if (c->changed != generation)
+			continue;
+
+		for (j = 0; j < c->num_deps; j++) {
+			svc_t *svc = c->deps[j];
+			int k;
+
+			/* Already handled, requires an earlier changed condition */
+			for (k = 0; k < i; k++) {
+				if (conds[k].changed == generation && svc_has_cond(svc, k))
+					break;
 			}
+			if (k < i)
+				continue;
 
-			if (svc->sighup)
-				service_reload(svc);
-			else
-				service_restart(svc);
-		} else { /* change == -1 */
-			if (svc->pid && !event_service_cond(svc->events))
-				service_stop(svc, SVC_CONDHALT_STATE);
+			if (change == 1) {
+				if (!service_enabled(svc, 1, NULL))
+					continue;
+
+				_d("%s matches <%s> %s (re)starting ...", msg, svc_events(svc), svc->cmd);
+				if (!svc->pid) {
+					service_start(svc);
+					continue;
+				}
+
+				if (svc->sighup)
+					service_reload(svc);
+				else
+					service_restart(svc);
+			} else { /* change == -1 */
+				if (svc->pid && !event_service_cond(svc))
+					service_stop(svc, SVC_CONDHALT_STATE);
+			}
 		}
 	}
 }
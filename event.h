@@ -24,11 +24,18 @@
 #ifndef FINIT_EVENT_H_
 #define FINIT_EVENT_H_
 
+#include "svc.h"
+
 int  event_cache_gw     (void);
 int  event_cache_if     (char *ifname);
-int  event_service_cond (char *events);
+int  event_compile      (svc_t *svc, char *events);
+void event_forget       (svc_t *svc);
+int  event_service_cond (svc_t *svc);
 void event_dispatch     (char *msg);
 
+unsigned int event_generation (void);
+void         event_invalidate (void);
+
 #endif	/* FINIT_EVENT_H_ */
 
 /**
@@ -28,11 +28,17 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -45,6 +51,20 @@
 
 #define NUM_ARGS    16
 
+/* No glibc wrapper for ioprio_set(), see linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
+
+/* Resources for rlimit:NAME=SOFT[/HARD], in &spawn_attr_t order */
+static struct {
+	char *name;
+	int   resource;
+} rlimits[SPAWN_NUM_RLIMIT] = {
+	{ "nofile",  RLIMIT_NOFILE  },
+	{ "memlock", RLIMIT_MEMLOCK },
+	{ "core",    RLIMIT_CORE    },
+};
+
 
 /* Wait for process completion, returns status of waitpid(2) syscall */
 int complete(char *cmd, int pid)
@@ -65,10 +85,550 @@ int complete(char *cmd, int pid)
 	return status;
 }
 
+/**
+ * spawn_path - Resolve command to an absolute path using $PATH
+ * @cmd: Command, with or without a path
+ * @buf: Buffer for the resulting path
+ * @len: Size of @buf
+ *
+ * Done in the parent since the child of spawn() must not touch the
+ * heap or any libc state shared with us.
+ *
+ * Returns:
+ * Pointer to @buf with the first executable match, or @cmd if it
+ * already contains a '/' or is not found in any $PATH directory.
+ */
+char *spawn_path(char *cmd, char *buf, size_t len)
+{
+	char *path, *dir;
+
+	if (strchr(cmd, '/'))
+		return cmd;
+
+	path = getenv("PATH");
+	if (!path)
+		path = _PATH_DEFPATH;
+
+	while (*path) {
+		size_t n = strcspn(path, ":");
+
+		dir = path;
+		path += n;
+		if (*path)
+			path++;
+
+		if (!n)
+			continue;
+
+		if ((size_t)snprintf(buf, len, "%.*s/%s", (int)n, dir, cmd) >= len)
+			continue;
+		if (!access(buf, X_OK))
+			return buf;
+	}
+
+	return cmd;
+}
+
+/**
+ * spawn_env - Prepare environment for a process
+ * @uid:   User the process will run as
+ * @extra: %NULL terminated list of "NAME=value" to add, or %NULL
+ *
+ * Regular users get the default $PATH instead of the one used by
+ * Finit.  This used to be a setenv() in the child, which is no longer
+ * possible since the child of spawn() borrows our memory.  The @extra
+ * variables are for protocols between Finit and the process, e.g.,
+ * $NOTIFY_SOCKET, they replace any inherited variable by the same name.
+ *
+ * Returns:
+ * NULL for root with no @extra, i.e., use the current environment.
+ * Otherwise a malloc'ed copy of the environ[] array, only the array,
+ * with changes.  Free with free() after spawn() has returned.
+ */
+char **spawn_env(uid_t uid, char *extra[])
+{
+	static char path[] = "PATH=" _PATH_DEFPATH;
+	char **envp;
+	int i, j = 0, num = 0;
+
+	if (extra)
+		while (extra[num])
+			num++;
+
+	if ((uid == (uid_t)-1 || uid == 0) && !num)
+		return NULL;
+
+	for (i = 0; environ[i]; i++)
+		;
+
+	envp = calloc(i + num + 2, sizeof(char *));
+	if (!envp)
+		return NULL;
+
+	for (i = 0; environ[i]; i++) {
+		int k;
+
+		if (uid != (uid_t)-1 && uid > 0 && !strncmp(environ[i], "PATH=", 5))
+			continue;
+
+		for (k = 0; k < num; k++) {
+			size_t len = strcspn(extra[k], "=") + 1;
+
+			if (!strncmp(environ[i], extra[k], len))
+				break;
+		}
+		if (k < num)
+			continue;
+
+		envp[j++] = environ[i];
+	}
+	if (uid != (uid_t)-1 && uid > 0)
+		envp[j++] = path;
+	for (i = 0; i < num; i++)
+		envp[j++] = extra[i];
+	envp[j] = NULL;
+
+	return envp;
+}
+
+/* cpus:LIST, e.g. cpus:0-3,6 */
+static int attr_cpus(spawn_attr_t *attr, char *val)
+{
+	char *tok, *ptr;
+
+	CPU_ZERO(&attr->cpus);
+	for (tok = strtok_r(val, ",", &ptr); tok; tok = strtok_r(NULL, ",", &ptr)) {
+		char *end;
+		long first, last;
+
+		first = last = strtol(tok, &end, 10);
+		if (end != tok && *end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (end == tok || *end || first < 0 || last < first || last >= CPU_SETSIZE)
+			return errno = EINVAL;
+
+		while (first <= last)
+			CPU_SET(first++, &attr->cpus);
+	}
+
+	if (!CPU_COUNT(&attr->cpus))
+		return errno = EINVAL;
+	attr->set |= SPAWN_CPUS;
+
+	return 0;
+}
+
+/* nice:-20..19 */
+static int attr_nice(spawn_attr_t *attr, char *val)
+{
+	const char *errstr;
+
+	attr->nice = strtonum(val, -20, 19, &errstr);
+	if (errstr)
+		return errno = EINVAL;
+	attr->set |= SPAWN_NICE;
+
+	return 0;
+}
+
+/* sched:fifo/PRIO, sched:rr/PRIO, sched:other, sched:batch, sched:idle */
+static int attr_sched(spawn_attr_t *attr, char *val)
+{
+	const char *errstr = NULL;
+	char *prio = strchr(val, '/');
+
+	if (prio)
+		*prio++ = 0;
+
+	attr->prio = 0;
+	if (!strcmp(val, "fifo") || !strcmp(val, "rr")) {
+		attr->policy = val[0] == 'f' ? SCHED_FIFO : SCHED_RR;
+		attr->prio = strtonum(prio ? prio : "", 1, 99, &errstr);
+	} else if (!strcmp(val, "other") && !prio) {
+		attr->policy = SCHED_OTHER;
+	} else if (!strcmp(val, "batch") && !prio) {
+		attr->policy = SCHED_BATCH;
+	} else if (!strcmp(val, "idle") && !prio) {
+		attr->policy = SCHED_IDLE;
+	} else
+		return errno = EINVAL;
+
+	if (errstr)
+		return errno = EINVAL;
+	attr->set |= SPAWN_SCHED;
+
+	return 0;
+}
+
+/* ioprio:rt/0..7, ioprio:be/0..7, ioprio:idle */
+static int attr_ioprio(spawn_attr_t *attr, char *val)
+{
+	const char *errstr = NULL;
+	char *data = strchr(val, '/');
+	int class, level = 0;
+
+	if (data)
+		*data++ = 0;
+
+	if (!strcmp(val, "rt"))
+		class = 1;
+	else if (!strcmp(val, "be"))
+		class = 2;
+	else if (!strcmp(val, "idle") && !data)
+		class = 3;
+	else
+		return errno = EINVAL;
+
+	if (class != 3)
+		level = strtonum(data ? data : "", 0, 7, &errstr);
+	if (errstr)
+		return errno = EINVAL;
+
+	attr->ioprio = class << IOPRIO_CLASS_SHIFT | level;
+	attr->set |= SPAWN_IOPRIO;
+
+	return 0;
+}
+
+static int rlim_val(char *val, rlim_t *lim)
+{
+	const char *errstr;
+
+	if (!strcmp(val, "unlimited") || !strcmp(val, "infinity")) {
+		*lim = RLIM_INFINITY;
+		return 0;
+	}
+
+	*lim = strtonum(val, 0, LLONG_MAX, &errstr);
+	if (errstr)
+		return errno = EINVAL;
+
+	return 0;
+}
+
+/* rlimit:NAME=SOFT[/HARD][,NAME=SOFT[/HARD]], hard defaults to soft */
+static int attr_rlimit(spawn_attr_t *attr, char *val)
+{
+	char *tok, *ptr;
+
+	for (tok = strtok_r(val, ",", &ptr); tok; tok = strtok_r(NULL, ",", &ptr)) {
+		char *soft, *hard;
+		int i;
+
+		soft = strchr(tok, '=');
+		if (!soft)
+			return errno = EINVAL;
+		*soft++ = 0;
+
+		hard = strchr(soft, '/');
+		if (hard)
+			*hard++ = 0;
+
+		for (i = 0; i < SPAWN_NUM_RLIMIT; i++) {
+			if (!strcmp(tok, rlimits[i].name))
+				break;
+		}
+		if (i == SPAWN_NUM_RLIMIT)
+			return errno = EINVAL;
+
+		if (rlim_val(soft, &attr->rlim[i].rlim_cur) ||
+		    rlim_val(hard ? hard : soft, &attr->rlim[i].rlim_max))
+			return errno = EINVAL;
+		attr->set |= SPAWN_RLIMIT(i);
+	}
+
+	return 0;
+}
+
+/* oom:-1000..1000, for /proc/self/oom_score_adj */
+static int attr_oom(spawn_attr_t *attr, char *val)
+{
+	const char *errstr;
+	int adj;
+
+	adj = strtonum(val, -1000, 1000, &errstr);
+	if (errstr)
+		return errno = EINVAL;
+
+	snprintf(attr->oom, sizeof(attr->oom), "%d", adj);
+	attr->set |= SPAWN_OOM;
+
+	return 0;
+}
+
+/**
+ * spawn_attr - Parse a scheduling or resource limit option
+ * @attr: Attributes to update
+ * @opt:  Option from a service stanza, e.g., "nice:5"
+ *
+ * Supported options are cpus:LIST, nice:NUM, sched:POLICY[/PRIO],
+ * ioprio:CLASS[/LEVEL], rlimit:NAME=SOFT[/HARD][,...] and oom:ADJ.
+ * They are validated here, in the parent, the child of spawn() only
+ * applies them.
+ *
+ * Returns:
+ * POSIX OK(0) if @opt was parsed, %ENOENT if @opt is not one of the
+ * above options, or %EINVAL if its value is invalid.
+ */
+int spawn_attr(spawn_attr_t *attr, char *opt)
+{
+	static struct {
+		char *name;
+		int (*parse)(spawn_attr_t *, char *);
+	} opts[] = {
+		{ "cpus",   attr_cpus   },
+		{ "nice",   attr_nice   },
+		{ "sched",  attr_sched  },
+		{ "ioprio", attr_ioprio },
+		{ "rlimit", attr_rlimit },
+		{ "oom",    attr_oom    },
+	};
+	size_t i;
+
+	for (i = 0; i < NELEMS(opts); i++) {
+		size_t len = strlen(opts[i].name);
+		char buf[LINE_SIZE];
+		spawn_attr_t tmp;
+
+		if (strncasecmp(opt, opts[i].name, len) || opt[len] != ':')
+			continue;
+
+		/* Parse into a copy, an invalid value must not clobber @attr */
+		tmp = *attr;
+		strlcpy(buf, &opt[len + 1], sizeof(buf));
+		if (opts[i].parse(&tmp, buf)) {
+			_e("Invalid %s, ignoring.", opt);
+			return errno = EINVAL;
+		}
+		*attr = tmp;
+
+		return 0;
+	}
+
+	return errno = ENOENT;
+}
+
+/* Runs in the child of spawn(), before dropping privileges */
+static void spawn_apply(spawn_attr_t *attr)
+{
+	int i;
+
+	/* Best effort, like the rest of the child, errors cannot be logged */
+	if (attr->set & SPAWN_CPUS)
+		sched_setaffinity(0, sizeof(attr->cpus), &attr->cpus);
+	if (attr->set & SPAWN_NICE)
+		setpriority(PRIO_PROCESS, 0, attr->nice);
+	if (attr->set & SPAWN_SCHED) {
+		struct sched_param param = { .sched_priority = attr->prio };
+
+		sched_setscheduler(0, attr->policy, &param);
+	}
+	if (attr->set & SPAWN_IOPRIO)
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, attr->ioprio);
+
+	for (i = 0; i < SPAWN_NUM_RLIMIT; i++) {
+		if (attr->set & SPAWN_RLIMIT(i))
+			setrlimit(rlimits[i].resource, &attr->rlim[i]);
+	}
+
+	if (attr->set & SPAWN_OOM) {
+		int fd = open("/proc/self/oom_score_adj", O_WRONLY);
+
+		if (fd >= 0) {
+			(void)write(fd, attr->oom, strlen(attr->oom));
+			close(fd);
+		}
+	}
+}
+
+/**
+ * spawn_cred - Resolve user and groups of a process
+ * @cred:  Credentials to set up
+ * @user:  User name, or %NULL to keep the current user
+ * @group: Group name, or %NULL for the primary group of @user
+ *
+ * Looks up uid, gid and supplementary groups once, when a service is
+ * registered, instead of in the child of every spawn().  The lookup
+ * may go through NSS and read /etc/passwd and /etc/group, which is far
+ * too much for a vfork() child.  The list of supplementary groups is
+ * that of initgroups(3), capped at %SPAWN_MAX_GROUPS.
+ *
+ * Static builds cannot use NSS, there @cred is set to keep the current
+ * user, as before.
+ *
+ * Returns:
+ * POSIX OK(0), or %ENOENT if @user or @group does not exist, in which
+ * case @cred keeps the current user and the caller should not start
+ * anything with it.
+ */
+int spawn_cred(spawn_cred_t *cred, char *user, char *group)
+{
+#ifndef ENABLE_STATIC
+	struct passwd *pw;
+	struct group *gr;
+	int num;
+#endif
+
+	cred->uid     = (uid_t)-1;
+	cred->gid     = (gid_t)-1;
+	cred->ngroups = -1;
+
+	if (!user || !user[0])
+		return 0;
+
+#ifndef ENABLE_STATIC
+	pw = getpwnam(user);
+	if (!pw)
+		return errno = ENOENT;
+
+	cred->gid = pw->pw_gid;
+	if (group && group[0]) {
+		gr = getgrnam(group);
+		if (!gr) {
+			cred->gid = (gid_t)-1;
+			return errno = ENOENT;
+		}
+		cred->gid = gr->gr_gid;
+	}
+
+	num = SPAWN_MAX_GROUPS;
+	if (getgrouplist(user, cred->gid, cred->groups, &num) < 0) {
+		_e("User %s is member of too many groups, using first %d",
+		   user, SPAWN_MAX_GROUPS);
+		num = SPAWN_MAX_GROUPS;
+	}
+	cred->ngroups = num;
+	cred->uid     = pw->pw_uid;
+#endif
+
+	return 0;
+}
+
+/* Runs in the child of spawn(), never run as root by mistake */
+static int spawn_drop(spawn_cred_t *cred)
+{
+	if (cred->ngroups >= 0 && setgroups(cred->ngroups, cred->groups))
+		return 1;
+	if (cred->gid != (gid_t)-1 && setgid(cred->gid))
+		return 1;
+	if (cred->uid != (uid_t)-1 && setuid(cred->uid))
+		return 1;
+
+	return 0;
+}
+
+/* Append our PID, the child of spawn() cannot use snprintf() */
+static void spawn_pid(char *buf)
+{
+	char digits[12];
+	pid_t pid = getpid();
+	int i = 0;
+
+	do
+		digits[i++] = '0' + pid % 10;
+	while (pid /= 10);
+
+	while (i)
+		*buf++ = digits[--i];
+	*buf = 0;
+}
+
+/**
+ * spawn - Start a new process from a prepared &spawn_t
+ * @sp: Path, argv, environment, credentials and stdio for the process
+ *
+ * Uses vfork(), i.e., clone(CLONE_VM | CLONE_VFORK), unless Finit is
+ * built with --disable-vfork.  The cost of vfork() does not scale with
+ * the size of our address space, and we are suspended only until the
+ * child has called execve(), which is always the first thing it does
+ * after resetting signals, stdio and user.  Everything that needs the
+ * heap, NSS or stdio, e.g., getuser() or logging, must be done by the
+ * caller before calling this function.
+ *
+ * All signals are blocked in the parent across the call so that none
+ * of our handlers can run in the child while it shares our memory.
+ * The child starts with default signal dispositions and an empty mask.
+ * Any @sp->fd[] above stderr is closed in the child after dup2().
+ *
+ * For socket activation the @sp->lfd[] sockets are moved to fd 3 and
+ * up, first out of the way, so the array is clobbered by the child,
+ * and the child's PID is appended to @sp->lpid, which must have room
+ * for it.  The rest of the environment is prepared by the caller.
+ * With @sp->cgfd the child moves itself to that cgroup before exec.
+ * Scheduling and resource limits in @sp->attr are applied while the
+ * child is still root, so they may be raised for an unprivileged user.
+ *
+ * Returns:
+ * PID of the new process, or -1 on error with errno set.
+ */
+pid_t spawn(spawn_t *sp)
+{
+	sigset_t all, omask;
+	pid_t pid;
+
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK, &all, &omask);
+
+#ifdef VFORK_DISABLED
+	pid = fork();
+#else
+	pid = vfork();
+#endif
+	if (!pid) {
+		int i;
+		struct sigaction sa;
+
+		/* Reset signal handlers that were set by the parent process */
+		for (i = 1; i < NSIG; i++)
+			DFLSIG(sa, i, 0);
+
+		for (i = 0; i < 3; i++) {
+			if (sp->fd[i] >= 0 && sp->fd[i] != i)
+				dup2(sp->fd[i], i);
+		}
+		for (i = 0; i < 3; i++) {
+			if (sp->fd[i] > STDERR_FILENO)
+				close(sp->fd[i]);
+		}
+
+		/* dup2() clears FD_CLOEXEC, only on the fds we pass on */
+		for (i = 0; i < sp->num_lfd; i++)
+			sp->lfd[i] = fcntl(sp->lfd[i], F_DUPFD_CLOEXEC, 3 + sp->num_lfd);
+		for (i = 0; i < sp->num_lfd; i++)
+			dup2(sp->lfd[i], 3 + i);
+		if (sp->lpid)
+			spawn_pid(sp->lpid + strlen(sp->lpid));
+
+		/* Join cgroup while still root, "0" is the writing process.
+		 * If it fails we run without, like on systems without v2. */
+		if (sp->cgfd >= 0)
+			(void)write(sp->cgfd, "0", 1);
+
+		if (sp->attr)
+			spawn_apply(sp->attr);
+
+		/* Groups first, we may not change them after setuid() */
+		if (sp->cred && spawn_drop(sp->cred))
+			_exit(1);
+
+		sigemptyset(&all);
+		sigprocmask(SIG_SETMASK, &all, NULL);
+
+		execve(sp->path, sp->argv, sp->envp ? sp->envp : environ);
+		_exit(1); /* Only if execve() fails. */
+	}
+
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+
+	return pid;
+}
+
 int run(char *cmd)
 {
-	int status, result, i = 0;
+	int status, result, fd, i = 0;
 	char *args[NUM_ARGS + 1], *arg, *backup;
+	char path[CMD_SIZE];
+	spawn_t sp;
 	pid_t pid;
 
 	/* We must create a copy that is possible to modify. */
@@ -107,31 +667,23 @@ int run(char *cmd)
 		return 1;
 	}
 
-	pid = fork();
-	if (0 == pid) {
-		int i;
-		FILE *fp;
-		struct sigaction sa;
-
-		/* Reset signal handlers that were set by the parent process */
-		for (i = 1; i < NSIG; i++)
-			DFLSIG(sa, i, 0);
-
-		/* Always redirect stdio for run() */
-		fp = fopen("/dev/null", "w");
-		if (fp) {
-			int fd = fileno(fp);
-
-			dup2(fd, STDIN_FILENO);
-			dup2(fd, STDOUT_FILENO);
-			dup2(fd, STDERR_FILENO);
-		}
-
-		sig_unblock();
-		execvp(args[0], args);
-
-		_exit(1); /* Only if execv() fails. */
-	} else if (-1 == pid) {
+	/* Always redirect stdio for run() */
+	fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	sp.path  = spawn_path(args[0], path, sizeof(path));
+	sp.argv  = args;
+	sp.envp  = NULL;
+	sp.cred  = NULL;
+	sp.fd[0] = sp.fd[1] = sp.fd[2] = fd;
+	sp.lfd   = NULL;
+	sp.lpid  = NULL;
+	sp.cgfd  = -1;
+	sp.attr  = NULL;
+	sp.num_lfd = 0;
+
+	pid = spawn(&sp);
+	if (fd >= 0)
+		close(fd);
+	if (-1 == pid) {
 		_pe("%s", args[0]);
 		free(backup);
 
@@ -304,6 +856,7 @@ int run_parts(char *dir, char *cmd)
 		pid_t pid = 0;
 		mode_t mode;
 		char *args[NUM_ARGS];
+		spawn_t sp;
 		char *name = e[i]->d_name;
 		char path[CMD_SIZE];
 
@@ -331,12 +884,22 @@ int run_parts(char *dir, char *cmd)
 		}
 		args[j++] = NULL;
 
-		pid = fork();
-		if (!pid) {
-			_d("Calling %s ...", path);
-			sig_unblock();
-			execv(path, args);
-			exit(0);
+		_d("Calling %s ...", path);
+		sp.path  = path;
+		sp.argv  = args;
+		sp.envp  = NULL;
+		sp.cred  = NULL;
+		sp.fd[0] = sp.fd[1] = sp.fd[2] = -1;
+		sp.lfd   = NULL;
+		sp.lpid  = NULL;
+		sp.cgfd  = -1;
+		sp.attr  = NULL;
+		sp.num_lfd = 0;
+
+		pid = spawn(&sp);
+		if (-1 == pid) {
+			_pe("Failed starting %s", path);
+			continue;
 		}
 
                 complete(path, pid);
@@ -30,13 +30,19 @@
 #include <sys/stat.h>		/* umask(), mkdir() */
 
 #include "finit.h"
+#include "cgroup.h"
 #include "conf.h"
+#include "cron.h"
+#include "dag.h"
 #include "helpers.h"
 #include "private.h"
 #include "plugin.h"
+#include "ready.h"
+#include "sock.h"
 #include "service.h"
 #include "sig.h"
 #include "tty.h"
+#include "wdog.h"
 #include "libite/lite.h"
 #include "inetd.h"
 
@@ -53,6 +59,7 @@ char *hostname  = NULL;
 char *rcsd      = FINIT_RCSD;
 char *runparts  = NULL;
 char *console   = NULL;
+char *watchdog  = NULL;
 
 uev_ctx_t *ctx  = NULL;		/* Main loop context */
 
@@ -106,6 +113,17 @@ int main(int argc, char* argv[])
 	mount("none", "/dev/shm", "tmpfs", 0, NULL);
 	umask(022);
 
+	/*
+	 * Mount cgroup v2, each service is placed in a group of its own
+	 */
+	cgroup_init();
+
+	/*
+	 * Create service table in /dev/shm, shared with initctl
+	 */
+	if (svc_init())
+		_pe("Failed creating service table %s", FINIT_SHM);
+
 	/*
 	 * Parse kernel parameters
 	 */
@@ -134,7 +152,9 @@ int main(int argc, char* argv[])
 	/*
 	 * Parse /etc/finit.conf, main configuration file
 	 */
+	svc_update_begin();
 	conf_parse_config();
+	svc_update_end();
 
 	/* Set hostname as soon as possible, for syslog et al. */
 	set_hostname(&hostname);
@@ -172,13 +192,30 @@ int main(int argc, char* argv[])
 	/* Base FS up, enable standard SysV init signals */
 	sig_setup(&loop);
 
+	/* Services may signal they are ready from now on */
+	ready_init(&loop);
+
+	/* Kick /dev/watchdog, if set, and let processes subscribe */
+	wdog_init(&loop);
+
+	/* Start cron and at jobs when they are due */
+	cron_init(&loop);
+
+	/* Bind sockets for socket activated services before any starts */
+	svc_update_begin();
+	sock_init();
+	svc_update_end();
+
 	_d("Base FS up, calling hooks ...");
 	plugin_run_hooks(HOOK_BASEFS_UP);
 
 	/*
 	 * Start all bootstrap tasks, no network available!
 	 */
+	svc_update_begin();
 	service_bootstrap();
+	svc_update_end();
+	dag_wait();
 
 	/*
 	 * Network stuff
@@ -198,7 +235,10 @@ int main(int argc, char* argv[])
 	/*
 	 * Start all tasks/services in the configured runlevel
 	 */
+	svc_update_begin();
 	service_runlevel(cfglevel);
+	svc_update_end();
+	dag_wait();
 
 	_d("Running svc up hooks ...");
 	plugin_run_hooks(HOOK_SVC_UP);
@@ -53,6 +53,9 @@
 #define INIT_CMD_RESTART_SVC    7    /* STOP + START service */
 #define INIT_CMD_QUERY_INETD    8
 #define INIT_CMD_EMIT           9
+#define INIT_CMD_START_SVC_WAIT 10   /* START, reply when service is ready */
+#define INIT_CMD_SCALE_SVC      11   /* Start/stop instances of service */
+#define INIT_CMD_AT             12   /* Add one-shot at job */
 #define INIT_CMD_NACK           254
 #define INIT_CMD_ACK            255
 
@@ -77,6 +80,7 @@ extern char  *hostname;
 extern char  *username;
 extern char  *runparts;
 extern char  *console;
+extern char  *watchdog;
 extern char  *__progname;
 
 #endif /* FINIT_H_ */
@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 
+#include <dirent.h>
 #include <errno.h>
 #include <grp.h>
 #include <pwd.h>
@@ -32,6 +33,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <utmp.h>
 
 #include "finit.h"
@@ -215,6 +217,50 @@ int getgroup(char *group)
 #endif
 }
 
+/**
+ * now_ms - Monotonic time, for timeouts and latencies
+ *
+ * Returns:
+ * Milliseconds since some unspecified point in the past.
+ */
+int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * fd_closeall - Close all descriptors above stderr, except one
+ * @keep: Descriptor to keep open, e.g. socket to PID 1, or -1
+ *
+ * For helper processes forked from PID 1, so they do not keep any of
+ * our inetd, API or other sockets open.
+ */
+void fd_closeall(int keep)
+{
+	DIR *dir;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return;
+
+	while (1) {
+		struct dirent *d = readdir(dir);
+		int fd;
+
+		if (!d)
+			break;
+
+		fd = atoi(d->d_name);
+		if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir))
+			close(fd);
+	}
+	closedir(dir);
+}
+
 /* Signal safe sleep ... we get a lot of SIGCHLD at reboot */
 void do_sleep(unsigned int sec)
 {
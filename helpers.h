@@ -25,8 +25,12 @@
 #ifndef FINIT_HELPERS_H_
 #define FINIT_HELPERS_H_
 
+#include <sched.h>		/* cpu_set_t */
+#include <stdint.h>		/* int64_t */
 #include <stdio.h>
 #include <string.h>		/* strerror() */
+#include <sys/resource.h>	/* struct rlimit */
+#include <sys/types.h>		/* pid_t, uid_t */
 #include <syslog.h>
 
 #define DO_LOG(level, fmt, args...)				\
@@ -61,13 +65,82 @@ do {								\
 #define   _e(fmt, args...) do {              fprintf(stderr, "finit:%s:%s() - " fmt "\n", __FILE__, __func__, ##args); } while (0)
 #define  _pe(fmt, args...) do {              fprintf(stderr, "finit:%s:%s() - " fmt ". Error %d: %s\n", __FILE__, __func__, ##args, errno, strerror(errno)); } while (0)
 
+/* Type of object owning a child process in the PID index */
+typedef enum {
+	PID_TYPE_NONE = 0,
+	PID_TYPE_SVC,		/* svc_t, also inetd children */
+	PID_TYPE_TTY,		/* finit_tty_t */
+	PID_TYPE_PROBE,		/* svc_t, exec: health check of service */
+	PID_TYPE_LOG,		/* NULL, log buffer helper, see logbuf.c */
+} pid_type_t;
+
+/* Set in &spawn_attr_t for each attribute given */
+#define SPAWN_CPUS       0x01
+#define SPAWN_NICE       0x02
+#define SPAWN_SCHED      0x04
+#define SPAWN_IOPRIO     0x08
+#define SPAWN_OOM        0x10
+#define SPAWN_RLIMIT(i)  (0x100 << (i))
+
+#define SPAWN_NUM_RLIMIT 3	/* nofile, memlock, core */
+
+/*
+ * Scheduling and resource limits for a process, parsed by spawn_attr()
+ * from cpus:, nice:, sched:, ioprio:, rlimit: and oom: options.
+ */
+typedef struct {
+	int           set;		/* SPAWN_* flags           */
+	cpu_set_t     cpus;
+	int           nice;
+	int           policy;		/* SCHED_*                 */
+	int           prio;
+	int           ioprio;		/* Class and data combined */
+	char          oom[8];		/* For oom_score_adj       */
+	struct rlimit rlim[SPAWN_NUM_RLIMIT];
+} spawn_attr_t;
+
+#define SPAWN_MAX_GROUPS 32
+
+/*
+ * User, group and supplementary groups of a process, resolved by
+ * spawn_cred() so the child of spawn() needs no NSS or file lookups.
+ */
+typedef struct {
+	uid_t         uid;		/* (uid_t)-1 to keep current user */
+	gid_t         gid;		/* (gid_t)-1 to keep current group */
+	int           ngroups;		/* -1 to keep current groups      */
+	gid_t         groups[SPAWN_MAX_GROUPS];
+} spawn_cred_t;
+
+/*
+ * Everything a child needs to exec a program, prepared by the parent
+ * so that the child of spawn() only has to issue plain syscalls.
+ */
+typedef struct {
+	char   *path;		/* Absolute path to program          */
+	char  **argv;
+	char  **envp;		/* NULL for current environment      */
+	spawn_cred_t *cred;	/* User and groups, NULL to keep     */
+	int     fd[3];		/* New stdio, -1 to keep inherited   */
+	int    *lfd;		/* Sockets to pass as fd 3 and up    */
+	int     num_lfd;
+	char   *lpid;		/* "LISTEN_PID=" in envp, or NULL    */
+	int     cgfd;		/* cgroup.procs to join, or -1       */
+	spawn_attr_t *attr;	/* Scheduling and limits, or NULL    */
+} spawn_t;
+
 void    runlevel_set    (int pre, int now);
 int     runlevel_get    (void);
 char   *runlevel_string (int levels);
 
 int     pid_alive       (pid_t pid);
+int     pid_kill        (pid_t pid, int sig);
 char   *pid_get_name    (pid_t pid, char *name, size_t len);
 
+int     pid_track       (pid_t pid, pid_type_t type, void *data);
+void   *pid_untrack     (pid_t pid, pid_type_t *type);
+void   *pid_find        (pid_t pid, pid_type_t *type);
+
 void    procname_set    (char *name, char *args[]);
 
 void    print           (int action, const char *fmt, ...);
@@ -75,11 +148,18 @@ void    print_desc      (char *action, char *desc);
 int     print_result    (int fail);
 int     start_process   (char *cmd, char *args[], int console);
 void    do_sleep        (unsigned int sec);
+int64_t now_ms          (void);
+void    fd_closeall     (int keep);
 int     getuser         (char *username);
 int     getgroup        (char *group);
 void    set_hostname    (char **hostname);
 
 int     complete        (char *cmd, int pid);
+pid_t   spawn           (spawn_t *sp);
+char   *spawn_path      (char *cmd, char *buf, size_t len);
+char  **spawn_env       (uid_t uid, char *extra[]);
+int     spawn_attr      (spawn_attr_t *attr, char *opt);
+int     spawn_cred      (spawn_cred_t *cred, char *user, char *group);
 int     run             (char *cmd);
 int     run_interactive (char *cmd, char *fmt, ...);
 pid_t   run_getty       (char *cmd, char *args[], int console);
@@ -54,7 +54,9 @@ static void socket_cb(uev_t *w, void *arg, int UNUSED(events))
 	if (!svc->inetd.forking)
 		uev_io_stop(w);
 
+	svc_update_begin();
 	service_start(svc);
+	svc_update_end();
 }
 
 /* Launch Inet socket for service.
@@ -173,23 +175,17 @@ int inetd_stream_peek(int sd, char *ifname)
 	return 0;
 }
 
-/* Inetd monitor, called by service_monitor() */
-int inetd_respawn(pid_t pid)
+/* Inetd monitor, called by service_monitor() when a child is collected */
+void inetd_respawn(inetd_t *inetd, pid_t pid)
 {
-	svc_t *svc = svc_find_by_pid(pid);
-
-	if (svc_is_inetd(svc)) {
-		inetd_t *inetd = &svc->inetd;
+	svc_t *svc = (svc_t *)inetd->arg;
 
+	/* With nowait, svc->pid is only the latest of the children */
+	if (svc->pid == pid)
 		svc->pid = 0;
 
-		if (svc_in_runlevel(svc, runlevel) && !inetd->forking)
-			uev_io_set(&inetd->watcher, inetd->watcher.fd, UEV_READ);
-
-		return 1;	/* It was us! */
-	}
-
-	return 0;		/* Not an inetd service */
+	if (svc_in_runlevel(svc, runlevel) && !inetd->forking)
+		uev_io_set(&inetd->watcher, inetd->watcher.fd, UEV_READ);
 }
 
 
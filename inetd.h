@@ -58,7 +58,7 @@ int  inetd_stream_peek (int sd, char *ifname);
 void inetd_start       (inetd_t *inetd);
 void inetd_stop        (inetd_t *inetd);
 
-int  inetd_respawn     (pid_t pid);
+void inetd_respawn     (inetd_t *inetd, pid_t pid);
 
 int  inetd_new         (inetd_t *inetd, char *name, char *service, char *proto, int forking, void *arg);
 int  inetd_del         (inetd_t *inetd);
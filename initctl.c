@@ -23,12 +23,16 @@
 
 #include <ctype.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #include "finit.h"
+#include "cgroup.h"
 #include "helpers.h"
+#include "logbuf.h"
 #include "service.h"
 
 #include "libite/lite.h"
@@ -42,6 +46,9 @@ int debug    = 0;
 int verbose  = 0;
 int runlevel = 0;
 
+static int wait_rdy = 0;
+static int follow   = 0;
+
 static int do_send(struct init_request *rq, ssize_t len)
 {
 	int sd, result = 255;
@@ -93,7 +100,11 @@ static int do_runlevel(char *arg)
 	/* Not compatible with the SysV runlevel(8) command, it prints
 	 * "PREVLEVEL RUNLEVEL", we just print the current runlevel. */
 	if (!rq.runlevel) {
-		printf("%d\n", runlevel_get());
+		int lvl = svc_runlevel(NULL);
+
+		if (lvl < 0)
+			lvl = runlevel_get();
+		printf("%d\n", lvl);
 		return 0;
 	}
 
@@ -102,6 +113,7 @@ static int do_runlevel(char *arg)
 
 static int do_svc(int cmd, char *arg)
 {
+	int result;
 	struct init_request rq = {
 		.magic = INIT_MAGIC,
 		.cmd = cmd,
@@ -118,14 +130,38 @@ static int do_svc(int cmd, char *arg)
 	strlcpy(rq.data, arg, sizeof(rq.data));
 
 exit:
-	return do_send(&rq, sizeof(rq));
+	result = do_send(&rq, sizeof(rq));
+	if (result)
+		return result;
+
+	/* With --wait the reply says if the service(s) became ready */
+	if (cmd == INIT_CMD_START_SVC_WAIT && rq.cmd == INIT_CMD_NACK) {
+		fprintf(stderr, "Failed starting %s\n", arg);
+		return 1;
+	}
+
+	/* Reload replies when done, NACK if any service failed to stop/start */
+	if (cmd == INIT_CMD_RELOAD_SVC && (!arg || !arg[0]) && rq.cmd == INIT_CMD_NACK) {
+		fprintf(stderr, "Reload failed, see log for details\n");
+		return 1;
+	}
+
+	return 0;
 }
 
 static int do_emit   (char *arg) { return do_svc(INIT_CMD_EMIT,        arg); }
-static int do_start  (char *arg) { return do_svc(INIT_CMD_START_SVC,   arg); }
 static int do_stop   (char *arg) { return do_svc(INIT_CMD_STOP_SVC,    arg); }
 static int do_reload (char *arg) { return do_svc(INIT_CMD_RELOAD_SVC,  arg); }
 static int do_restart(char *arg) { return do_svc(INIT_CMD_RESTART_SVC, arg); }
+static int do_scale  (char *arg) { return do_svc(INIT_CMD_SCALE_SVC,   arg); }
+
+static int do_start(char *arg)
+{
+	if (wait_rdy)
+		return do_svc(INIT_CMD_START_SVC_WAIT, arg);
+
+	return do_svc(INIT_CMD_START_SVC, arg);
+}
 
 static int show_version(char *UNUSED(arg))
 {
@@ -139,16 +175,24 @@ static int show_version(char *UNUSED(arg))
 static int show_status(char *UNUSED(arg))
 {
 	svc_t *svc;
+	svc_iter_t iter;
 
-	/* Fetch UTMP runlevel, needed for svc_status() call below */
-	runlevel = runlevel_get();
+	/* Consistent copy of all services, and runlevel for svc_status() */
+	if (svc_snapshot()) {
+		if (errno != EBUSY) {
+			fprintf(stderr, "Failed connecting to finit: %s\n", strerror(errno));
+			return 1;
+		}
+		fprintf(stderr, "Finit busy, status may be inconsistent.\n");
+	}
+	runlevel = svc_runlevel(NULL);
 
 	if (!verbose) {
 		printf("#      Status   PID     Runlevels   Service               Description\n");
 		printf("====================================================================================\n");
 	}
 
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
 		char jobid[10], args[512] = "", *lvls;
 
 		if (svc_is_unique(svc))
@@ -164,7 +208,7 @@ static int show_status(char *UNUSED(arg))
 			printf("%-10.10s  ", lvls);
 
 		if (!verbose) {
-			printf("%-20s  %s\n", svc->cmd, svc->desc);
+			printf("%-20s  %s\n", svc->cmd, svc_desc(svc));
 			continue;
 		}
 
@@ -194,10 +238,12 @@ static int show_status(char *UNUSED(arg))
 		else
 #endif /* !INETD_DISABLED */
 		{
-			int i;
+			int i, argc;
+			char buf[LINE_SIZE], *argv[MAX_NUM_SVC_ARGS];
 
-			for (i = 1; i < MAX_NUM_SVC_ARGS; i++) {
-				strlcat(args, svc->args[i], sizeof(args));
+			argc = svc_argv(svc, buf, sizeof(buf), argv, NELEMS(argv));
+			for (i = 1; i < argc; i++) {
+				strlcat(args, argv[i], sizeof(args));
 				strlcat(args, " ", sizeof(args));
 			}
 
@@ -208,16 +254,240 @@ static int show_status(char *UNUSED(arg))
 	return 0;
 }
 
+/* Human readable memory size, like the -h of df(1) */
+static char *memstr(uint64_t bytes, char *buf, size_t len)
+{
+	char *unit = "KMGT";
+	double val = bytes / 1024.0;
+
+	if (bytes < 1024) {
+		snprintf(buf, len, "%" PRIu64, bytes);
+		return buf;
+	}
+
+	while (val >= 1024 && unit[1]) {
+		val /= 1024;
+		unit++;
+	}
+	snprintf(buf, len, "%.1f%c", val, *unit);
+
+	return buf;
+}
+
+/* Accounting read by us directly from the cgroup of each service */
+static int show_cgroup(char *UNUSED(arg))
+{
+	svc_t *svc;
+	svc_iter_t iter;
+
+	if (svc_snapshot() && errno != EBUSY) {
+		fprintf(stderr, "Failed connecting to finit: %s\n", strerror(errno));
+		return 1;
+	}
+
+	printf("#      PID     CPU (s)    Memory  Service\n");
+	printf("====================================================================================\n");
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		char jobid[10], mem[16];
+		uint64_t cpu_usec, bytes;
+
+		if (!svc_is_daemon(svc) || cgroup_stat(svc, &cpu_usec, &bytes))
+			continue;
+
+		if (svc_is_unique(svc))
+			snprintf(jobid, sizeof(jobid), "%d", svc->job);
+		else
+			snprintf(jobid, sizeof(jobid), "%d:%d", svc->job, svc->id);
+
+		printf("%-5s  %-6d  %9.2f  %8s  %s\n", jobid, svc->pid,
+		       cpu_usec / 1000000.0, memstr(bytes, mem, sizeof(mem)), svc->cmd);
+	}
+
+	return 0;
+}
+
+/* Result and latency of the last health check, see probe.c in Finit */
+static int show_health(char *UNUSED(arg))
+{
+	svc_t *svc;
+	svc_iter_t iter;
+
+	if (svc_snapshot() && errno != EBUSY) {
+		fprintf(stderr, "Failed connecting to finit: %s\n", strerror(errno));
+		return 1;
+	}
+
+	printf("#      PID     Health  Latency  Fails  Service               Probe\n");
+	printf("====================================================================================\n");
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		char jobid[10], ms[16] = "-", fails[16], *health = "-";
+
+		if (!svc_probe(svc)[0])
+			continue;
+
+		if (svc_is_unique(svc))
+			snprintf(jobid, sizeof(jobid), "%d", svc->job);
+		else
+			snprintf(jobid, sizeof(jobid), "%d:%d", svc->job, svc->id);
+
+		if (svc->pid > 0 && svc->probe_fails)
+			health = "failing";
+		else if (svc->pid > 0 && svc->probe_ms >= 0)
+			health = "ok";
+		if (svc->pid > 0 && svc->probe_ms >= 0)
+			snprintf(ms, sizeof(ms), "%d ms", svc->probe_ms);
+		snprintf(fails, sizeof(fails), "%d/%d", svc->probe_fails, svc->probe_max);
+
+		printf("%-5s  %-6d  %-7s  %7s  %-5s  %-20s  %s\n", jobid, svc->pid,
+		       health, ms, fails, svc->cmd, svc_probe(svc));
+	}
+
+	return 0;
+}
+
+/* Add an at job, or list when cron and at jobs are due next */
+static int do_at(char *arg)
+{
+	svc_t *svc;
+	svc_iter_t iter;
+
+	if (arg && arg[0]) {
+		struct init_request rq = {
+			.magic = INIT_MAGIC,
+			.cmd = INIT_CMD_AT,
+		};
+
+		strlcpy(rq.data, arg, sizeof(rq.data));
+		if (do_send(&rq, sizeof(rq)))
+			return 1;
+
+		if (rq.cmd == INIT_CMD_NACK) {
+			fprintf(stderr, "Failed scheduling %s, see log for details\n", arg);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (svc_snapshot() && errno != EBUSY) {
+		fprintf(stderr, "Failed connecting to finit: %s\n", strerror(errno));
+		return 1;
+	}
+
+	printf("#      PID     Type  Next              Command\n");
+	printf("====================================================================================\n");
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		char jobid[10], next[20] = "-";
+
+		if (!svc_is_cron(svc))
+			continue;
+
+		if (svc_is_unique(svc))
+			snprintf(jobid, sizeof(jobid), "%d", svc->job);
+		else
+			snprintf(jobid, sizeof(jobid), "%d:%d", svc->job, svc->id);
+
+		if (svc->sched_next) {
+			struct tm tm;
+
+			localtime_r(&svc->sched_next, &tm);
+			strftime(next, sizeof(next), "%Y-%m-%d %H:%M", &tm);
+		}
+
+		printf("%-5s  %-6d  %-4s  %-16s  %s\n", jobid, svc->pid,
+		       svc->type == SVC_TYPE_AT ? "at" : "cron", next, svc->cmd);
+	}
+
+	return 0;
+}
+
+/* Find JOB|NAME[:ID], first instance if no ID, same syntax as start */
+static svc_t *find_svc(char *arg)
+{
+	svc_iter_t iter;
+	char *ptr;
+
+	ptr = strchr(arg, ':');
+	if (ptr)
+		*ptr++ = 0;
+
+	if (isdigit(arg[0])) {
+		if (ptr)
+			return svc_find_by_jobid(atonum(arg), atonum(ptr));
+		return svc_job_iterator(&iter, 1, atonum(arg));
+	}
+
+	if (ptr)
+		return svc_find_by_nameid(arg, atonum(ptr));
+	return svc_named_iterator(&iter, 1, arg);
+}
+
+/* Output of a service, kept by the log helper in Finit, see logbuf.c */
+static int show_log(char *arg)
+{
+	struct logbuf_req req = { .follow = follow };
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+		.sun_path   = LOGBUF_SOCKET,
+	};
+	char buf[BUFSIZ];
+	ssize_t len;
+	svc_t *svc;
+	int sd;
+
+	arg = strtok(arg, " ");
+	if (!arg)
+		return 1;
+
+	if (svc_snapshot() && errno != EBUSY) {
+		fprintf(stderr, "Failed connecting to finit: %s\n", strerror(errno));
+		return 1;
+	}
+
+	svc = find_svc(arg);
+	if (!svc) {
+		fprintf(stderr, "No such service: %s\n", arg);
+		return 1;
+	}
+	svc_ident(svc, req.name, sizeof(req.name));
+
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (-1 == sd)
+		return 1;
+
+	if (connect(sd, (struct sockaddr*)&sun, sizeof(sun)) == -1 ||
+	    write(sd, &req, sizeof(req)) != sizeof(req)) {
+		perror("Failed communicating with log helper");
+		close(sd);
+		return 1;
+	}
+
+	while ((len = read(sd, buf, sizeof(buf))) > 0) {
+		if (fwrite(buf, len, 1, stdout) != 1)
+			break;
+		fflush(stdout);
+	}
+	close(sd);
+
+	return 0;
+}
+
 static int usage(int rc)
 {
 	fprintf(stderr, "Usage: %s [OPTIONS] <COMMAND>\n\n"
 		"Options:\n"
 		"  -d, --debug               Debug initctl (client)\n"
+		"  -f, --follow              Follow log, show new output as it arrives\n"
 		"  -v, --verbose             Verbose output\n"
+		"  -w, --wait                Wait for started service(s) to be ready\n"
 		"  -h, --help                This help text\n\n"
 		"Commands:\n"
+		"  at       [@TIME CMD]      Run CMD once at @TIME, or list cron and at jobs\n"
+		"  cgroup                    Show CPU time and memory use of services\n"
 		"  debug                     Toggle Finit (daemon) debug\n"
+		"  health                    Show result and latency of service health checks\n"
 		"  help                      This help text\n"
+		"  log      <JOB|NAME>[:ID]  Show recent output of service, see -f\n"
 		"  emit     <EV>             Emit event; a predefined event: RELOAD, STOP, START\n"
 		"                            or a custom string matching an event in a service\n"
 		"                            stanza, e.g: GW:UP, IFUP:IFNAME, IFDN:IFNAME. Where\n"
@@ -229,6 +499,7 @@ static int usage(int rc)
 		"  stop     <JOB|NAME>[:ID]  Stop/Pause a running service by job# or name\n"
 		"  restart  <JOB|NAME>[:ID]  Restart (stop/start) service by job# or name\n"
 		"  reload   <JOB|NAME>[:ID]  Reload (SIGHUP) service by job# or name\n"
+		"  scale    <JOB|NAME> <N>   Run N instances of service declared with :1-M\n"
 		"  version                   Show Finit version\n\n", __progname);
 
 	return rc;
@@ -238,8 +509,12 @@ int main(int argc, char *argv[])
 {
 	int c;
 	command_t command[] = {
+		{ "at",       do_at        },
+		{ "cgroup",   show_cgroup  },
 		{ "debug",    toggle_debug },
 		{ "emit",     do_emit      },
+		{ "health",   show_health  },
+		{ "log",      show_log     },
 		{ "reload",   do_reload    },
 		{ "runlevel", do_runlevel  },
 		{ "status",   show_status  },
@@ -247,18 +522,21 @@ int main(int argc, char *argv[])
 		{ "start",    do_start     },
 		{ "stop",     do_stop      },
 		{ "restart",  do_restart   },
+		{ "scale",    do_scale     },
 		{ "version",  show_version },
 		{ NULL, NULL }
 	};
 	struct option long_options[] = {
 		{"help",    0, NULL, 'h'},
 		{"debug",   0, NULL, 'd'},
+		{"follow",  0, NULL, 'f'},
 		{"verbose", 0, NULL, 'v'},
+		{"wait",    0, NULL, 'w'},
 		{NULL, 0, NULL, 0}
 	};
 
 	verbose = 0;
-	while ((c = getopt_long(argc, argv, "dh?v", long_options, NULL)) != EOF) {
+	while ((c = getopt_long(argc, argv, "dfh?vw", long_options, NULL)) != EOF) {
 		switch(c) {
 		case 'h':
 		case '?':
@@ -268,9 +546,17 @@ int main(int argc, char *argv[])
 			debug = 1;
 			break;
 
+		case 'f':
+			follow = 1;
+			break;
+
 		case 'v':
 			verbose = 1;
 			break;
+
+		case 'w':
+			wait_rdy = 1;
+			break;
 		}
 	}
 
@@ -0,0 +1,756 @@
+/* Per-service log ring buffers, kept by a helper process
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"		/* Generated by configure script */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "libite/lite.h"
+
+#include "finit.h"
+#include "helpers.h"
+#include "logbuf.h"
+#include "queue.h"
+#include "sig.h"
+
+/*
+ * The helper holds the read end of each service's stdout/stderr pipe
+ * and a ring of its most recent output.  Rings outlive the pipe, so the
+ * last words of a crashed service can still be read with initctl.
+ *
+ * Services with log:/path have their output spliced to the file instead,
+ * without copying it to user space, and the ring is not used.
+ */
+struct ring {
+	TAILQ_ENTRY(ring) link;
+
+	char   name[MAX_ARG_LEN + 12];
+	int    fd;		/* Read end of pipe, -1 when service is gone */
+	size_t pos;		/* Next byte to write */
+	int    full;		/* Wrapped, oldest byte is at @pos */
+	char   buf[LOGBUF_SIZE];
+
+	int    log;		/* Log file, or -1 when logging to the ring */
+	char   path[PATH_MAX];
+	off_t  size;		/* Current size of log file */
+	off_t  max;		/* Rotate at this size, 0 to never rotate */
+	int    count;		/* Number of rotated files to keep */
+};
+
+/* An initctl log -f, gets output from the ring as it arrives */
+struct follower {
+	TAILQ_ENTRY(follower) link;
+
+	int          sd;
+	struct ring *ring;
+};
+
+static TAILQ_HEAD(, ring)     rings     = TAILQ_HEAD_INITIALIZER(rings);
+static TAILQ_HEAD(, follower) followers = TAILQ_HEAD_INITIALIZER(followers);
+
+static struct {
+	pid_t pid;
+	int   sd;		/* PID 1 end of socketpair */
+} helper = { 0, -1 };
+
+static struct ring *ring_find(char *name)
+{
+	struct ring *r;
+
+	TAILQ_FOREACH(r, &rings, link) {
+		if (!strcmp(r->name, name))
+			return r;
+	}
+
+	return NULL;
+}
+
+static void ring_put(struct ring *r, char *buf, size_t len)
+{
+	if (len > LOGBUF_SIZE) {
+		buf += len - LOGBUF_SIZE;
+		len  = LOGBUF_SIZE;
+	}
+
+	while (len) {
+		size_t num = MIN(len, LOGBUF_SIZE - r->pos);
+
+		memcpy(&r->buf[r->pos], buf, num);
+		r->pos += num;
+		if (r->pos == LOGBUF_SIZE) {
+			r->pos  = 0;
+			r->full = 1;
+		}
+
+		buf += num;
+		len -= num;
+	}
+}
+
+/* Send @len bytes of the log file from @off, used for followers and dumps */
+static int log_send(struct ring *r, int sd, off_t off, size_t len, int flags)
+{
+	char buf[BUFSIZ];
+
+	while (len) {
+		ssize_t num;
+
+		num = pread(r->log, buf, MIN(len, sizeof(buf)), off);
+		if (num <= 0)
+			break;
+
+		if (send(sd, buf, num, flags) != num)
+			return -1;
+
+		off += num;
+		len -= num;
+	}
+
+	return 0;
+}
+
+static int ring_dump(struct ring *r, int sd)
+{
+	if (r->log >= 0) {
+		off_t off = r->size > LOGBUF_SIZE ? r->size - LOGBUF_SIZE : 0;
+
+		return log_send(r, sd, off, r->size - off, MSG_NOSIGNAL);
+	}
+
+	if (r->full && send(sd, &r->buf[r->pos], LOGBUF_SIZE - r->pos, MSG_NOSIGNAL) < 0)
+		return -1;
+	if (r->pos && send(sd, r->buf, r->pos, MSG_NOSIGNAL) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void follower_del(struct follower *f)
+{
+	TAILQ_REMOVE(&followers, f, link);
+	close(f->sd);
+	free(f);
+}
+
+static void log_close(struct ring *r)
+{
+	if (r->log < 0)
+		return;
+
+	close(r->log);
+	r->log = -1;
+}
+
+/* Service has been removed, drop its ring and anyone following it */
+static void ring_del(struct ring *r)
+{
+	struct follower *f, *tmp;
+
+	TAILQ_FOREACH_SAFE(f, &followers, link, tmp) {
+		if (f->ring == r)
+			follower_del(f);
+	}
+
+	if (r->fd >= 0)
+		close(r->fd);
+	log_close(r);
+	TAILQ_REMOVE(&rings, r, link);
+	free(r);
+}
+
+/* Not O_APPEND, splice() does not support it, we are the only writer.
+ * Read back for initctl log, so O_RDWR. */
+static int log_open(struct ring *r)
+{
+	r->log = open(r->path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (r->log < 0) {
+		_pe("Failed opening %s, logging %s to memory", r->path, r->name);
+		return -1;
+	}
+
+	r->size = lseek(r->log, 0, SEEK_END);
+	if (r->size < 0)
+		r->size = 0;
+
+	return 0;
+}
+
+/* path -> path.1 -> ... -> path.COUNT, the oldest is overwritten */
+static void log_rotate(struct ring *r)
+{
+	char old[PATH_MAX + 4], new[PATH_MAX + 4];
+	int i;
+
+	log_close(r);
+
+	for (i = r->count - 1; i > 0; i--) {
+		snprintf(old, sizeof(old), "%s.%d", r->path, i);
+		snprintf(new, sizeof(new), "%s.%d", r->path, i + 1);
+		rename(old, new);
+	}
+
+	if (r->count > 0) {
+		snprintf(new, sizeof(new), "%s.1", r->path);
+		rename(r->path, new);
+	} else {
+		erase(r->path);
+	}
+
+	log_open(r);
+}
+
+/* Move output from pipe to log file, read() + write() if splice() fails */
+static ssize_t log_write(struct ring *r)
+{
+	char buf[BUFSIZ];
+	ssize_t len;
+
+	len = splice(r->fd, NULL, r->log, NULL, LOGBUF_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (len < 0 && errno == EINVAL) {
+		len = read(r->fd, buf, sizeof(buf));
+		if (len > 0 && write(r->log, buf, len) != len)
+			len = -1;
+	}
+
+	/* Disk full or similar, keep the output in memory instead */
+	if (len < 0 && errno != EINTR && errno != EAGAIN) {
+		_pe("Failed writing %s, logging %s to memory", r->path, r->name);
+		log_close(r);
+		errno = EAGAIN;
+	}
+
+	return len;
+}
+
+/* Read new output from a service, pass it on to any followers */
+static void ring_read(struct ring *r)
+{
+	struct follower *f, *tmp;
+	char buf[BUFSIZ];
+	off_t off = 0;
+	ssize_t len;
+
+	if (r->log >= 0) {
+		off = r->size;
+		len = log_write(r);
+	} else {
+		len = read(r->fd, buf, sizeof(buf));
+	}
+	if (len <= 0) {
+		if (len < 0 && (errno == EINTR || errno == EAGAIN))
+			return;
+
+		close(r->fd);
+		r->fd = -1;
+		return;
+	}
+
+	if (r->log < 0)
+		ring_put(r, buf, len);
+
+	/* Slow readers are dropped rather than stalling everyone else */
+	TAILQ_FOREACH_SAFE(f, &followers, link, tmp) {
+		int rc;
+
+		if (f->ring != r)
+			continue;
+
+		if (r->log >= 0)
+			rc = log_send(r, f->sd, off, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		else
+			rc = send(f->sd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len;
+		if (rc)
+			follower_del(f);
+	}
+
+	if (r->log >= 0) {
+		r->size += len;
+		if (r->max && r->size >= r->max)
+			log_rotate(r);
+	}
+}
+
+/* Log file settings may have changed since the service was last started */
+static void log_setup(struct ring *r, char *spec)
+{
+	char path[PATH_MAX];
+
+	if (!spec[0] || logbuf_parse(spec, path, sizeof(path), &r->max, &r->count)) {
+		log_close(r);
+		return;
+	}
+
+	if (r->log >= 0 && !strcmp(r->path, path))
+		return;
+
+	log_close(r);
+	strlcpy(r->path, path, sizeof(r->path));
+	log_open(r);
+}
+
+/* New pipe from PID 1, the payload is the service name and log: spec,
+ * without a pipe the service has been removed. */
+static int pipe_recv(int sd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	char name[sizeof(((struct ring *)0)->name) + PATH_MAX + 32];
+	struct iovec iov = {
+		.iov_base = name,
+		.iov_len  = sizeof(name) - 1,
+	};
+	struct msghdr msg = {
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	struct ring *r;
+	char *spec;
+	ssize_t len;
+	int fd = -1;
+
+	len = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC);
+	if (len <= 0)
+		return len < 0 && errno == EINTR ? 0 : -1;
+	name[len] = 0;
+	spec = name + strlen(name);
+	if (spec < &name[len])
+		spec++;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+	/* A restarted service continues in its old ring */
+	r = ring_find(name);
+	if (fd < 0) {
+		if (r)
+			ring_del(r);
+		return 0;
+	}
+
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r) {
+			close(fd);
+			return 0;
+		}
+
+		strlcpy(r->name, name, sizeof(r->name));
+		r->fd  = -1;
+		r->log = -1;
+		TAILQ_INSERT_TAIL(&rings, r, link);
+	}
+
+	if (r->fd >= 0)
+		close(r->fd);
+	r->fd = fd;
+	log_setup(r, spec);
+
+	return 0;
+}
+
+/* Bound by the helper, /var/run may not be writable when it starts */
+static int client_listen(void)
+{
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+		.sun_path   = LOGBUF_SOCKET,
+	};
+	mode_t oldmask;
+	int sd;
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return -1;
+
+	erase(LOGBUF_SOCKET);
+	oldmask = umask(0077);
+	if (bind(sd, (struct sockaddr *)&sun, sizeof(sun)) || listen(sd, 5)) {
+		umask(oldmask);
+		close(sd);
+		return -1;
+	}
+	umask(oldmask);
+
+	return sd;
+}
+
+/* Send the ring to initctl, and keep it as follower if it asks for it */
+static void client_accept(int lsd)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct logbuf_req req;
+	struct follower *f;
+	struct ring *r;
+	int sd;
+
+	sd = accept4(lsd, NULL, NULL, SOCK_CLOEXEC);
+	if (sd < 0)
+		return;
+
+	/* Never let one client stall the helper for long */
+	setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (recv(sd, &req, sizeof(req), MSG_WAITALL) != sizeof(req))
+		goto done;
+	req.name[sizeof(req.name) - 1] = 0;
+
+	r = ring_find(req.name);
+	if (!r || ring_dump(r, sd) || !req.follow)
+		goto done;
+
+	f = malloc(sizeof(*f));
+	if (!f)
+		goto done;
+
+	f->sd   = sd;
+	f->ring = r;
+	TAILQ_INSERT_TAIL(&followers, f, link);
+	return;
+done:
+	close(sd);
+}
+
+static void helper_loop(int sd)
+{
+	struct pollfd *pfd = NULL;
+	size_t max = 0;
+	int lsd = -1;
+
+	fd_closeall(sd);
+	sig_unblock();
+
+	while (1) {
+		struct follower *f, *ftmp;
+		struct ring *r;
+		size_t i, follow, num = 2;
+
+		if (lsd < 0)
+			lsd = client_listen();
+
+		TAILQ_FOREACH(r, &rings, link)
+			num++;
+		TAILQ_FOREACH(f, &followers, link)
+			num++;
+		if (num > max) {
+			struct pollfd *tmp;
+
+			tmp = realloc(pfd, num * sizeof(*pfd));
+			if (!tmp) {
+				sleep(1);
+				continue;
+			}
+			pfd = tmp;
+			max = num;
+		}
+
+		/* Closed rings and the socket, if not bound yet, get fd -1 */
+		num = 0;
+		pfd[num].fd = sd;
+		pfd[num++].events = POLLIN;
+		pfd[num].fd = lsd;
+		pfd[num++].events = POLLIN;
+		TAILQ_FOREACH(r, &rings, link) {
+			pfd[num].fd = r->fd;
+			pfd[num++].events = POLLIN;
+		}
+		follow = num;
+		TAILQ_FOREACH(f, &followers, link) {
+			pfd[num].fd = f->sd;
+			pfd[num++].events = POLLIN;
+		}
+
+		/* Retry binding the client socket every now and then */
+		if (poll(pfd, num, lsd < 0 ? 1000 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* initctl hung up, we ignore any data from it */
+		i = follow;
+		TAILQ_FOREACH_SAFE(f, &followers, link, ftmp) {
+			if (pfd[i++].revents)
+				follower_del(f);
+		}
+
+		i = 2;
+		TAILQ_FOREACH(r, &rings, link) {
+			if (pfd[i++].revents & (POLLIN | POLLHUP))
+				ring_read(r);
+		}
+
+		if (pfd[1].revents & POLLIN)
+			client_accept(lsd);
+
+		/* PID 1 gone, or restarting us */
+		if (pfd[0].revents && pipe_recv(sd))
+			break;
+	}
+
+	_exit(0);
+}
+
+static int helper_start(void)
+{
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+		return 1;
+
+	pid = fork();
+	if (-1 == pid) {
+		close(sv[0]);
+		close(sv[1]);
+		return 1;
+	}
+
+	if (!pid) {
+		close(sv[0]);
+		helper_loop(sv[1]);
+	}
+
+	close(sv[1]);
+	helper.pid = pid;
+	helper.sd  = sv[0];
+	pid_track(pid, PID_TYPE_LOG, NULL);
+	_d("Started log buffer helper, PID %d", pid);
+
+	return 0;
+}
+
+static int helper_send(char *name, char *spec, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov[] = {
+		{ .iov_base = name, .iov_len = strlen(name) + 1 },
+		{ .iov_base = spec, .iov_len = strlen(spec)     },
+	};
+	struct msghdr msg = {
+		.msg_iov        = iov,
+		.msg_iovlen     = NELEMS(iov),
+		.msg_control    = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+
+	if (fd < 0) {
+		msg.msg_control    = NULL;
+		msg.msg_controllen = 0;
+	} else {
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	}
+
+	if (sendmsg(helper.sd, &msg, MSG_NOSIGNAL) < 0)
+		return 1;
+
+	return 0;
+}
+
+/* 64k, 10M, 1G, or plain bytes */
+static int sizenum(char *str, off_t *size)
+{
+	unsigned long long val;
+	char *end;
+
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return errno = EINVAL;
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		val *= 1024;
+		/* Fall through */
+	case 'm':
+	case 'M':
+		val *= 1024;
+		/* Fall through */
+	case 'k':
+	case 'K':
+		val *= 1024;
+		end++;
+		/* Fall through */
+	case 0:
+		break;
+
+	default:
+		return errno = EINVAL;
+	}
+	if (*end)
+		return errno = EINVAL;
+
+	*size = (off_t)val;
+
+	return 0;
+}
+
+/**
+ * logbuf_parse - Parse log file settings of a service
+ * @spec:  Argument to log:, /path[,size:N][,count:M]
+ * @path:  Buffer for the path of the log file
+ * @len:   Size of @path
+ * @size:  Rotate log file at this size, 0 to never rotate
+ * @count: Number of rotated files to keep, path.1 to path.COUNT
+ *
+ * The size may have a k, M or G suffix.  Used by PID 1 to check the
+ * service stanza, and by the log helper when the service is started.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on invalid @spec.
+ */
+int logbuf_parse(char *spec, char *path, size_t len, off_t *size, int *count)
+{
+	char buf[PATH_MAX + 32], *opt, *pos;
+
+	if (strlcpy(buf, spec, sizeof(buf)) >= sizeof(buf))
+		return errno = ENAMETOOLONG;
+
+	opt = strtok_r(buf, ",", &pos);
+	if (!opt || opt[0] != '/')
+		return errno = EINVAL;
+	if (strlcpy(path, opt, len) >= len)
+		return errno = ENAMETOOLONG;
+
+	*size  = 0;
+	*count = LOGBUF_COUNT;
+	while ((opt = strtok_r(NULL, ",", &pos))) {
+		const char *err = NULL;
+
+		if (!strncmp(opt, "size:", 5)) {
+			if (sizenum(&opt[5], size))
+				return errno;
+		} else if (!strncmp(opt, "count:", 6)) {
+			*count = strtonum(&opt[6], 0, 99, &err);
+			if (err)
+				return errno = EINVAL;
+		} else {
+			return errno = EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * logbuf_open - Create a pipe for a service's stdout and stderr
+ * @svc: Service about to be started
+ *
+ * The read end is handed over to the log helper, which is started on
+ * demand, and again once a helper that has died has been collected,
+ * see logbuf_collect().  Any earlier ring for @svc is kept, so output
+ * from before a respawn remains.  With log:/path the helper writes the
+ * output to that file instead.
+ *
+ * Returns:
+ * Write end of the pipe, or of /dev/null if the helper cannot take
+ * it, for the caller to close after spawn().  On error -1, in which
+ * case the service inherits our stdio as before.
+ */
+int logbuf_open(svc_t *svc)
+{
+	char name[sizeof(((struct logbuf_req *)0)->name)];
+	int fd[2];
+
+	if (pipe2(fd, O_CLOEXEC))
+		return -1;
+
+	svc_ident(svc, name, sizeof(name));
+	if (helper.sd == -1 && helper_start())
+		goto fail;
+
+	if (!helper_send(name, svc_log(svc), fd[0])) {
+		close(fd[0]);
+		return fd[1];
+	}
+
+	/*
+	 * The helper holds the pipes of all running services, never kill
+	 * it here, they would get SIGPIPE.  If it has died it is restarted
+	 * for the next service, when it has been collected.
+	 */
+	_pe("Failed sending %s log pipe to helper, discarding its output", name);
+fail:
+	close(fd[0]);
+	close(fd[1]);
+
+	return open("/dev/null", O_WRONLY | O_CLOEXEC);
+}
+
+/**
+ * logbuf_close - Drop the ring of a removed service
+ * @svc: Service being unregistered
+ */
+void logbuf_close(svc_t *svc)
+{
+	char name[sizeof(((struct logbuf_req *)0)->name)];
+
+	if (helper.sd == -1 || !svc_is_daemon(svc))
+		return;
+
+	svc_ident(svc, name, sizeof(name));
+	helper_send(name, "", -1);
+}
+
+/**
+ * logbuf_collect - The log helper has exited
+ * @pid: PID of the helper, no longer tracked
+ *
+ * Called by service_monitor(), the next service started gets a new
+ * helper.  The rings of the old one are lost.
+ */
+void logbuf_collect(pid_t pid)
+{
+	if (pid != helper.pid)
+		return;
+
+	_e("Log buffer helper, PID %d, exited, restarting it on demand", pid);
+	close(helper.sd);
+	helper.pid = 0;
+	helper.sd  = -1;
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,52 @@
+/* Per-service log ring buffers, kept by a helper process
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_LOGBUF_H_
+#define FINIT_LOGBUF_H_
+
+#include "svc.h"
+
+#define LOGBUF_SOCKET  _PATH_VARRUN "finit-log.sock"
+#define LOGBUF_SIZE    16384		/* Bytes of output kept per service */
+#define LOGBUF_COUNT   5		/* Default number of rotated log files */
+
+/* Request from initctl, reply is the ring followed by new output */
+struct logbuf_req {
+	char name[MAX_ARG_LEN + 12];	/* See svc_ident() */
+	int  follow;
+};
+
+int  logbuf_parse  (char *spec, char *path, size_t len, off_t *size, int *count);
+int  logbuf_open   (svc_t *svc);
+void logbuf_close  (svc_t *svc);
+void logbuf_collect(pid_t pid);
+
+#endif	/* FINIT_LOGBUF_H_ */
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -23,24 +23,337 @@
  */
 
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
+#include "finit.h"
 #include "helpers.h"
+#include "private.h"
+#include "svc.h"
 #include "libite/lite.h"
+#include "libuev/uev.h"
 
+#define PID_INDEX_MIN 64	/* Initial number of buckets, power of two */
+
+typedef struct {
+	pid_t       pid;		/* 0: unused bucket */
+	pid_type_t  type;
+	void       *data;
+	uev_t      *w;			/* pidfd watcher, or NULL */
+} pid_entry_t;
+
+/*
+ * PID index, open addressing with linear probing.  Maps the PID of each
+ * child we start to the object that owns it, so the SIGCHLD reaper does
+ * not have to walk all services and TTYs for every collected child.
+ */
+static struct {
+	pid_entry_t *tab;
+	size_t       size;		/* Number of buckets */
+	size_t       count;		/* Number of used buckets */
+} idx;
+
+/*
+ * Retired pidfd watchers, reused by watch().  Never freed, an event for
+ * a stopped watcher may still be pending in the current round of the
+ * event loop, and the watcher may already have been re-armed for a new
+ * PID by then.  Such a stale event is delivered to pid_exit_cb() with
+ * the new PID, which is harmless: it only collects the child if the new
+ * PID is a zombie, i.e., if it has exited, see waitpid(WNOHANG) there.
+ */
+typedef struct pid_watcher {
+	uev_t               w;		/* Must be first */
+	struct pid_watcher *next;
+} pid_watcher_t;
+
+static pid_watcher_t *retired;
+
+static size_t bucket(pid_t pid, size_t size)
+{
+	/* Knuth's multiplicative hash, size is always a power of two */
+	return ((uint32_t)pid * 2654435761u) & (size - 1);
+}
+
+static pid_entry_t *lookup(pid_t pid)
+{
+	size_t i;
+
+	if (!idx.size)
+		return NULL;
+
+	for (i = bucket(pid, idx.size); idx.tab[i].pid; i = (i + 1) & (idx.size - 1)) {
+		if (idx.tab[i].pid == pid)
+			return &idx.tab[i];
+	}
+
+	return NULL;
+}
+
+static void insert(pid_entry_t *tab, size_t size, pid_entry_t *entry)
+{
+	size_t i = bucket(entry->pid, size);
+
+	while (tab[i].pid)
+		i = (i + 1) & (size - 1);
+	tab[i] = *entry;
+}
+
+static int resize(size_t size)
+{
+	size_t i;
+	pid_entry_t *tab;
+
+	tab = calloc(size, sizeof(pid_entry_t));
+	if (!tab)
+		return errno = ENOMEM;
+
+	for (i = 0; i < idx.size; i++) {
+		if (idx.tab[i].pid)
+			insert(tab, size, &idx.tab[i]);
+	}
+
+	free(idx.tab);
+	idx.tab  = tab;
+	idx.size = size;
+
+	return 0;
+}
+
+static void pid_exit_cb(uev_t *w, void *arg, int UNUSED(events))
+{
+	pid_t pid = (pid_t)(intptr_t)arg;
+	pid_entry_t *entry = lookup(pid);
+	int status;
+
+	/* Stale event, already collected by the SIGCHLD handler */
+	if (!entry || entry->w != w)
+		return;
+
+	/* Still our zombie, so the PID cannot have been reused.  Also
+	 * guards against stale events for a reused watcher, see watch() */
+	if (waitpid(pid, &status, WNOHANG) != pid)
+		return;
+
+	_d("Collected child %d", pid);
+	svc_update_begin();
+	service_monitor(pid, status);
+	svc_update_end();
+}
+
+/*
+ * A pidfd refers to the process, not the PID, so signals cannot hit a
+ * new process that has reused the PID, and it becomes readable when
+ * the process exits.  Not supported before Linux 5.3, and not before
+ * the event loop is up, then we fall back to SIGCHLD and kill().
+ */
+static uev_t *watch(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	pid_watcher_t *pw;
+	int fd;
+
+	if (!ctx)
+		return NULL;
+
+	fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (retired) {
+		pw = retired;
+		retired = pw->next;
+	} else {
+		pw = malloc(sizeof(*pw));
+		if (!pw) {
+			close(fd);
+			return NULL;
+		}
+	}
+
+	if (uev_io_init(ctx, &pw->w, pid_exit_cb, (void *)(intptr_t)pid, fd, UEV_READ)) {
+		close(fd);
+		pw->next = retired;
+		retired = pw;
+		return NULL;
+	}
+
+	return &pw->w;
+#else
+	(void)pid;
+	return NULL;
+#endif
+}
+
+static void unwatch(pid_entry_t *entry)
+{
+	pid_watcher_t *pw = (pid_watcher_t *)entry->w;
+
+	if (!pw)
+		return;
+
+	uev_io_stop(&pw->w);
+	close(pw->w.fd);
+	pw->next = retired;
+	retired = pw;
+	entry->w = NULL;
+}
+
+/**
+ * pid_track - Add a child process to the PID index
+ * @pid:  Process ID of child
+ * @type: Type of object owning the child, e.g. %PID_TYPE_SVC
+ * @data: Pointer to owning object, e.g. an &svc_t or &finit_tty_t
+ *
+ * Call this in the parent after every successful fork() of a process
+ * that service_monitor() should know about when it is collected.  When
+ * the kernel supports it, the child is also watched with a pidfd, so
+ * its exit is handled on its own, and pid_kill() and pid_alive() are
+ * safe from PID reuse.
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero on error.
+ */
+int pid_track(pid_t pid, pid_type_t type, void *data)
+{
+	pid_entry_t *entry, e = { .pid = pid, .type = type, .data = data };
+
+	if (pid <= 0)
+		return errno = EINVAL;
+
+	entry = lookup(pid);
+	if (entry) {
+		unwatch(entry);
+		e.w = watch(pid);
+		*entry = e;
+		return 0;
+	}
+
+	/* Keep load factor below 1/2 */
+	if ((idx.count + 1) * 2 > idx.size) {
+		if (resize(idx.size ? idx.size * 2 : PID_INDEX_MIN)) {
+			_e("Out of memory, cannot track PID %d", pid);
+			return errno;
+		}
+	}
+
+	e.w = watch(pid);
+	insert(idx.tab, idx.size, &e);
+	idx.count++;
+
+	return 0;
+}
+
+/**
+ * pid_untrack - Remove a child process from the PID index
+ * @pid:  Process ID of child, usually after it has been collected
+ * @type: Optional pointer to return type of owning object in
+ *
+ * Returns:
+ * Pointer to the object owning @pid, or %NULL if @pid is unknown.
+ */
+void *pid_untrack(pid_t pid, pid_type_t *type)
+{
+	size_t i, j;
+	void *data;
+	pid_entry_t *entry = lookup(pid);
+
+	if (type)
+		*type = PID_TYPE_NONE;
+	if (!entry)
+		return NULL;
+
+	if (type)
+		*type = entry->type;
+	data = entry->data;
+	unwatch(entry);
+
+	/* Backward shift deletion, no tombstones needed */
+	i = entry - idx.tab;
+	idx.tab[i].pid = 0;
+	for (j = (i + 1) & (idx.size - 1); idx.tab[j].pid; j = (j + 1) & (idx.size - 1)) {
+		size_t home = bucket(idx.tab[j].pid, idx.size);
+
+		/* Can entry at j be moved to the hole at i? */
+		if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+			idx.tab[i] = idx.tab[j];
+			idx.tab[j].pid = 0;
+			i = j;
+		}
+	}
+	idx.count--;
+
+	return data;
+}
+
+/**
+ * pid_find - Look up owner of a child process in the PID index
+ * @pid:  Process ID of child
+ * @type: Optional pointer to return type of owning object in
+ *
+ * Returns:
+ * Pointer to the object owning @pid, or %NULL if @pid is unknown.
+ */
+void *pid_find(pid_t pid, pid_type_t *type)
+{
+	pid_entry_t *entry = lookup(pid);
+
+	if (type)
+		*type = entry ? entry->type : PID_TYPE_NONE;
+
+	return entry ? entry->data : NULL;
+}
+
+
+/**
+ * pid_kill - Send signal to a child process
+ * @pid: Process ID of child
+ * @sig: Signal to send
+ *
+ * Uses the pidfd of a tracked child, falls back to kill().
+ *
+ * Returns:
+ * POSIX OK(0) on success, or -1 with errno set on error.
+ */
+int pid_kill(pid_t pid, int sig)
+{
+	pid_entry_t *entry = lookup(pid);
+
+#ifdef SYS_pidfd_send_signal
+	if (entry && entry->w)
+		return syscall(SYS_pidfd_send_signal, entry->w->fd, sig, NULL, 0);
+#else
+	(void)entry;
+#endif
+
+	return kill(pid, sig);
+}
 
 /**
  * pid_alive - Check if a given process ID is running
  * @pid: Process ID to check for.
  *
+ * For a tracked child with a pidfd we only poll the pidfd, which is
+ * readable once the child has exited, otherwise we check /proc.
+ *
  * Returns:
- * %TRUE(1) if pid is alive (/proc/pid exists), otherwise %FALSE(0)
+ * %TRUE(1) if pid is alive, otherwise %FALSE(0)
  */
 int pid_alive(pid_t pid)
 {
 	char name[24]; /* Enough for max pid_t */
+	pid_entry_t *entry = lookup(pid);
+
+	if (entry && entry->w) {
+		struct pollfd pfd = { .fd = entry->w->fd, .events = POLLIN };
+
+		return poll(&pfd, 1, 0) == 0;
+	}
 
 	snprintf(name, sizeof(name), "/proc/%d", pid);
 
@@ -24,21 +24,59 @@
 #include <errno.h>
 #include <dlfcn.h>		/* dlopen() et al */
 #include <dirent.h>		/* readdir() et al */
-#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 
 #include "finit.h"
 #include "private.h"
 #include "helpers.h"
 #include "plugin.h"
+#include "sig.h"
 #include "queue.h"		/* BSD sys/queue.h API */
 #include "libite/lite.h"
 
 #define is_io_plugin(p) ((p)->io.cb && (p)->io.fd >= 0)
 
+#define WORKER_HUNG     5000	/* msec until a busy helper is restarted */
+
 static char *plugpath = NULL; /* Set by first load. */
 static TAILQ_HEAD(plugin_head, plugin) plugins  = TAILQ_HEAD_INITIALIZER(plugins);
 
+/* Helper process running service callbacks, see plugin_svc_cb() */
+static struct {
+	pid_t        pid;
+	int          sd;
+	unsigned int seq;	/* Of last request */
+	int          busy;	/* First job sent, waiting for reply */
+	uev_t        watcher;	/* Replies on sd */
+	uev_t        timer;	/* Restarts a hung helper */
+} worker = { 0, -1, 0, 0, { .fd = -1 }, { .fd = -1 } };
+
+struct worker_req {
+	unsigned int seq;
+	svc_t       *svc;
+	int          event;
+};
+
+struct worker_rep {
+	unsigned int seq;
+	svc_cmd_t    cmd;
+};
+
+/* Queued callback, the first one is sent to the helper */
+struct worker_job {
+	TAILQ_ENTRY(worker_job) link;
+	struct worker_req       req;	/* req.svc is NULL if removed */
+	unsigned int            gen;	/* Event generation when queued */
+};
+
+static TAILQ_HEAD(, worker_job) jobs = TAILQ_HEAD_INITIALIZER(jobs);
+
+static void worker_stop(void);
+static void worker_send(void);
+
 #ifndef ENABLE_STATIC
 static void check_plugin_depends(plugin_t *plugin);
 #endif
@@ -77,6 +115,12 @@ int plugin_register(plugin_t *plugin)
 
 	TAILQ_INSERT_TAIL(&plugins, plugin, link);
 
+	/* Callback helper needs to be restarted to see new plugin */
+	if (plugin->svc.cb) {
+		worker_stop();
+		worker_send();
+	}
+
 	return 0;
 }
 
@@ -88,9 +132,10 @@ int plugin_unregister(plugin_t *plugin)
 
 	if (plugin->svc.cb) {
 		svc_t *svc;
+		svc_iter_t iter;
 
 		/* Unregister plugin callback for all matching services */
-		for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
+		for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
 			if (strcmp(svc->cmd, plugin->name))
 				continue;
 
@@ -98,6 +143,9 @@ int plugin_unregister(plugin_t *plugin)
 			svc->dynamic      = 0;
 			svc->dynamic_stop = 0;
 		}
+
+		worker_stop();
+		worker_send();
 	}
 
 	/* Unload plugin */
@@ -177,6 +225,230 @@ void plugin_run_hooks(hook_point_t no)
 	}
 }
 
+/*
+ * Helper process main loop.  Forked from PID 1, so the service table
+ * and all plugins are mapped at the same addresses as in PID 1.  All
+ * descriptors but the socket to PID 1 and stdio are closed, so we do
+ * not keep any inetd or API sockets open.
+ */
+static void worker_loop(int sd)
+{
+	struct worker_req req;
+
+	fd_closeall(sd);
+	sig_unblock();
+	while (recv(sd, &req, sizeof(req), 0) == sizeof(req)) {
+		struct worker_rep rep = { req.seq, SVC_STOP };
+
+		/* PID 1 may have grown the string arena since we forked */
+		svc_sync();
+
+		if (req.svc->cb)
+			rep.cmd = req.svc->cb(req.svc, req.event, NULL);
+
+		if (send(sd, &rep, sizeof(rep), MSG_NOSIGNAL) != sizeof(rep))
+			break;
+	}
+
+	_exit(0);
+}
+
+static void worker_cb(uev_t *w, void *arg, int events);
+static void worker_hung_cb(uev_t *w, void *arg, int events);
+
+static int worker_start(void)
+{
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+		return 1;
+
+	pid = fork();
+	if (-1 == pid) {
+		close(sv[0]);
+		close(sv[1]);
+		return 1;
+	}
+
+	if (!pid) {
+		close(sv[0]);
+		worker_loop(sv[1]);
+	}
+
+	close(sv[1]);
+	worker.pid = pid;
+	worker.sd  = sv[0];
+	_d("Started service callback helper, PID %d", pid);
+
+	if (uev_io_init(ctx, &worker.watcher, worker_cb, NULL, worker.sd, UEV_READ)) {
+		worker_stop();
+		return 1;
+	}
+
+	return 0;
+}
+
+static void worker_stop(void)
+{
+	if (worker.sd == -1)
+		return;
+
+	/* Collected by sigchld_cb() like any other unknown child */
+	uev_io_stop(&worker.watcher);
+	uev_timer_stop(&worker.timer);
+	kill(worker.pid, SIGKILL);
+	close(worker.sd);
+	worker.pid  = 0;
+	worker.sd   = -1;
+	worker.busy = 0;
+}
+
+/* Drop first job, the one sent to the helper, without a reply */
+static void worker_drop(void)
+{
+	struct worker_job *job = TAILQ_FIRST(&jobs);
+
+	if (!job)
+		return;
+
+	TAILQ_REMOVE(&jobs, job, link);
+	free(job);
+}
+
+/* Send first queued job, unless the helper is busy with it already */
+static void worker_send(void)
+{
+	struct worker_job *job;
+
+	while (!worker.busy && (job = TAILQ_FIRST(&jobs))) {
+		svc_t *svc = job->req.svc;
+
+		if (!svc) {
+			worker_drop();
+			continue;
+		}
+
+		if (worker.sd == -1 && worker_start()) {
+			_pe("Failed starting helper for %s callback", svc->cmd);
+			worker_drop();
+			continue;
+		}
+
+		job->req.seq = ++worker.seq;
+		if (send(worker.sd, &job->req, sizeof(job->req), MSG_NOSIGNAL) != sizeof(job->req)) {
+			_pe("Failed calling %s callback", svc->cmd);
+			worker_stop();
+			worker_drop();
+			continue;
+		}
+
+		worker.busy = 1;
+		uev_timer_init(ctx, &worker.timer, worker_hung_cb, NULL, WORKER_HUNG, 0);
+	}
+}
+
+static void worker_cb(uev_t *UNUSED(w), void *UNUSED(arg), int UNUSED(events))
+{
+	struct worker_job *job = TAILQ_FIRST(&jobs);
+	struct worker_rep rep;
+
+	if (recv(worker.sd, &rep, sizeof(rep), 0) != sizeof(rep)) {
+		_e("Callback to %s crashed!", job && job->req.svc ? job->req.svc->cmd : "service");
+		worker_stop();
+		worker_drop();
+		worker_send();
+		return;
+	}
+
+	/* Not for us, the helper has been restarted since it was sent */
+	if (!worker.busy || !job || rep.seq != job->req.seq)
+		return;
+
+	uev_timer_stop(&worker.timer);
+	worker.busy = 0;
+	TAILQ_REMOVE(&jobs, job, link);
+	worker_send();
+
+	if (job->req.svc)
+		service_callback(job->req.svc, job->req.event, job->gen, rep.cmd);
+	free(job);
+}
+
+static void worker_hung_cb(uev_t *UNUSED(w), void *UNUSED(arg), int UNUSED(events))
+{
+	struct worker_job *job = TAILQ_FIRST(&jobs);
+
+	_e("Callback to %s hung, restarting helper.", job && job->req.svc ? job->req.svc->cmd : "service");
+	worker_stop();
+	worker_drop();
+	worker_send();
+}
+
+/**
+ * plugin_svc_cb - Call service plugin callback in helper process
+ * @svc:   Service with a plugin callback
+ * @event: Event to pass to callback
+ * @gen:   Event generation the result is valid for
+ *
+ * Callbacks used to run in a fork of PID 1 for each call, now a single
+ * helper process is started on demand and reused.  PID 1 does not wait
+ * for it, the call is queued and the reply, which may come much later,
+ * is handed to service_callback() that caches the result in @svc and
+ * starts or stops it.  Calls are sent one at a time, a call already in
+ * the queue for the same @svc, @event and @gen is not queued again.
+ *
+ * The helper is a fork of PID 1 from when it was started, so callbacks
+ * run on a snapshot of the plugins: any plugin globals PID 1 changes
+ * after that are stale in the helper.  Only the service table is shared
+ * with PID 1, svc_sync() refreshes the string arena before each call.
+ * If a callback crashes, or is still busy after %WORKER_HUNG msec, the
+ * helper is killed, the call dropped, and a new helper started for the
+ * next call.
+ *
+ * Returns:
+ * POSIX OK(0) if the call is queued, or non-zero on error.
+ */
+int plugin_svc_cb(svc_t *svc, int event, unsigned int gen)
+{
+	struct worker_job *job;
+
+	TAILQ_FOREACH(job, &jobs, link) {
+		if (job->req.svc == svc && job->req.event == event && job->gen == gen)
+			return 0;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		_pe("Failed queuing %s callback", svc->cmd);
+		return 1;
+	}
+
+	job->req.svc   = svc;
+	job->req.event = event;
+	job->gen       = gen;
+	TAILQ_INSERT_TAIL(&jobs, job, link);
+	worker_send();
+
+	return 0;
+}
+
+/**
+ * plugin_svc_forget - Drop queued callbacks of a service
+ * @svc: Service being removed
+ *
+ * A reply to a call already sent to the helper is ignored.
+ */
+void plugin_svc_forget(svc_t *svc)
+{
+	struct worker_job *job;
+
+	TAILQ_FOREACH(job, &jobs, link) {
+		if (job->req.svc == svc)
+			job->req.svc = NULL;
+	}
+}
+
 /* Generic libev I/O callback, looks up correct plugin and calls its callback */
 static void generic_io_cb(uev_t *w, void *arg, int events)
 {
@@ -187,7 +459,9 @@ static void generic_io_cb(uev_t *w, void *arg, int events)
 		uev_io_stop(w);
 
 		_d("Calling I/O %s from runloop...", basename(p->name));
+		svc_update_begin();
 		p->io.cb(p->io.arg, w->fd, events);
+		svc_update_end();
 
 		/* Update fd, may be changed by plugin callback, e.g., if FIFO */
 		uev_io_set(w, p->io.fd, p->io.flags);
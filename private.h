@@ -34,10 +34,14 @@ int       api_init         (uev_ctx_t *ctx);
 int       client           (int argc, char *argv[]);
 
 void      service_bootstrap(void);
-void      service_monitor  (pid_t lost);
+void      service_monitor  (pid_t lost, int status);
+void      service_callback (svc_t *svc, int event, unsigned int gen, svc_cmd_t cmd);
+void      api_wakeup       (void);
 
 void      plugin_run_hooks (hook_point_t no);
 int       plugin_load_all  (uev_ctx_t *ctx, char *path);
+int       plugin_svc_cb    (svc_t *svc, int event, unsigned int gen);
+void      plugin_svc_forget(svc_t *svc);
 
 #endif /* FINIT_PRIVATE_H_ */
 
@@ -0,0 +1,436 @@
+/* Health checks of running services, exec, TCP, UNIX socket or file age
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "libite/lite.h"
+#include "libuev/uev.h"
+
+#include "finit.h"
+#include "helpers.h"
+#include "private.h"
+#include "service.h"
+#include "probe.h"
+
+static void probe_cb(uev_t *w, void *arg, int events);
+
+/* Number in 1 .. @max, for interval:, timeout:, fail: and age: */
+static int probe_num(char *val, int max, int *num)
+{
+	const char *errstr;
+	int tmp;
+
+	tmp = strtonum(val, 1, max, &errstr);
+	if (errstr)
+		return errno = EINVAL;
+	*num = tmp;
+
+	return 0;
+}
+
+/* Check TYPE:TARGET and write it to @buf, a tcp: target as ADDR:PORT */
+static int probe_target(char *spec, char *buf, size_t len)
+{
+	char *target;
+	int n;
+
+	target = strchr(spec, ':');
+	if (!target || !target[1])
+		return errno = EINVAL;
+	*target++ = 0;
+
+	if (!strcmp(spec, "tcp")) {
+		struct in_addr ina;
+		char *addr = "127.0.0.1", *port;
+		int num;
+
+		port = strrchr(target, ':');
+		if (port) {
+			*port++ = 0;
+			addr = target;
+		} else {
+			port = target;
+		}
+
+		if (inet_pton(AF_INET, addr, &ina) != 1 || probe_num(port, UINT16_MAX, &num))
+			return errno = EINVAL;
+
+		n = snprintf(buf, len, "tcp:%s:%d", addr, num);
+	} else if (!strcmp(spec, "exec") || !strcmp(spec, "unix") || !strcmp(spec, "file")) {
+		struct sockaddr_un sun;
+
+		if (target[0] != '/')
+			return errno = EINVAL;
+		if (!strcmp(spec, "unix") && strlen(target) >= sizeof(sun.sun_path))
+			return errno = EINVAL;
+
+		n = snprintf(buf, len, "%s:%s", spec, target);
+	} else {
+		return errno = EINVAL;
+	}
+
+	if (n < 0 || (size_t)n >= len)
+		return errno = EINVAL;
+
+	return 0;
+}
+
+/**
+ * probe_parse - Parse probe:... option of a service
+ * @svc:  Service to set interval, timeout and thresholds of
+ * @spec: TYPE:TARGET[,interval:SEC][,timeout:SEC][,fail:N][,age:SEC]
+ * @buf:  Buffer for TYPE:TARGET, to save with svc_set_probe()
+ * @len:  Size of @buf
+ *
+ * TYPE:TARGET is one of exec:/path/to/cmd, tcp:[ADDR:]PORT, where ADDR
+ * is a numeric IPv4 address, unix:/path/to/socket or file:/path.  All
+ * lookups are done here, so a probe never blocks PID 1.  The file must
+ * have been modified within age:SEC, by default two intervals.
+ *
+ * Returns:
+ * POSIX OK(0), or %EINVAL if @spec is invalid, then @svc is untouched.
+ */
+int probe_parse(svc_t *svc, char *spec, char *buf, size_t len)
+{
+	int interval = PROBE_INTERVAL, tmo = PROBE_TIMEOUT, max = PROBE_FAIL, age = 0;
+	char tmp[LINE_SIZE], *opt, *ptr;
+
+	strlcpy(tmp, spec, sizeof(tmp));
+	opt = strtok_r(tmp, ",", &ptr);
+	if (!opt || probe_target(opt, buf, len))
+		return errno = EINVAL;
+
+	while ((opt = strtok_r(NULL, ",", &ptr))) {
+		int rc = EINVAL;
+
+		if (!strncmp(opt, "interval:", 9))
+			rc = probe_num(&opt[9], 86400, &interval);
+		else if (!strncmp(opt, "timeout:", 8))
+			rc = probe_num(&opt[8], 86400, &tmo);
+		else if (!strncmp(opt, "fail:", 5))
+			rc = probe_num(&opt[5], 100, &max);
+		else if (!strncmp(opt, "age:", 4))
+			rc = probe_num(&opt[4], 86400, &age);
+		if (rc)
+			return errno = EINVAL;
+	}
+
+	if (tmo > interval)
+		tmo = interval;
+
+	svc->probe_interval = interval;
+	svc->probe_tmo      = tmo;
+	svc->probe_max      = max;
+	svc->probe_age      = age ? age : 2 * interval;
+
+	return 0;
+}
+
+/* Wait @msec for the next probe, or for the one in progress */
+static void probe_timer(svc_t *svc, int64_t msec)
+{
+	uev_timer_stop(&svc_priv(svc)->probe_timer);
+	if (uev_timer_init(ctx, &svc_priv(svc)->probe_timer, probe_cb, svc, msec > 0 ? (int)msec : 1, 0))
+		_pe("Failed starting health check timer for %s", svc->cmd);
+}
+
+/* Clean up after the probe in progress, returns its latency in ms */
+static int64_t probe_end(svc_t *svc)
+{
+	int64_t ms = now_ms() - svc->probe_tm;
+
+	if (svc->probe_pid > 0) {
+		pid_kill(svc->probe_pid, SIGKILL);
+		pid_untrack(svc->probe_pid, NULL);
+	}
+	if (svc->probe_sd >= 0) {
+		uev_io_stop(&svc_priv(svc)->probe_watcher);
+		close(svc->probe_sd);
+	}
+
+	svc->probe_pid = 0;
+	svc->probe_sd  = -1;
+	svc->probe_tm  = 0;
+
+	return ms;
+}
+
+static void probe_done(svc_t *svc, int ok, char *why)
+{
+	int64_t ms = probe_end(svc);
+
+	if (ok) {
+		svc->probe_fails = 0;
+		svc->probe_ms    = ms;
+	} else {
+		svc->probe_fails++;
+		svc->probe_ms    = -1;
+		_e("Health check %s of %s %s, %d of %d", svc_probe(svc), svc->cmd,
+		   why, svc->probe_fails, svc->probe_max);
+
+		/* Probes start over when the service has been restarted */
+		if (svc->probe_fails >= svc->probe_max) {
+			_e("Service %s[%d] is unhealthy, restarting", svc->cmd, svc->pid);
+			service_unhealthy(svc);
+			return;
+		}
+	}
+
+	probe_timer(svc, svc->probe_interval * 1000 - ms);
+}
+
+static void connect_cb(uev_t *w, void *arg, int UNUSED(events))
+{
+	svc_t *svc = arg;
+	socklen_t len;
+	int err = 0;
+
+	len = sizeof(err);
+	if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+		err = errno;
+
+	svc_update_begin();
+	probe_done(svc, !err, "failed connecting");
+	svc_update_end();
+}
+
+static void probe_connect(svc_t *svc, char *type, char *target)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int sd;
+
+	memset(&ss, 0, sizeof(ss));
+	if (!strcmp(type, "unix")) {
+		struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+
+		sun->sun_family = AF_UNIX;
+		strlcpy(sun->sun_path, target, sizeof(sun->sun_path));
+		len = sizeof(*sun);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+		char *port = strrchr(target, ':');
+
+		if (!port) {
+			probe_done(svc, 0, "is invalid");
+			return;
+		}
+		*port++ = 0;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port   = htons(atoi(port));
+		inet_pton(AF_INET, target, &sin->sin_addr);
+		len = sizeof(*sin);
+	}
+
+	sd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		probe_done(svc, 0, "failed, no socket");
+		return;
+	}
+
+	if (!connect(sd, (struct sockaddr *)&ss, len)) {
+		close(sd);
+		probe_done(svc, 1, NULL);
+		return;
+	}
+	if (errno != EINPROGRESS) {
+		close(sd);
+		probe_done(svc, 0, "failed connecting");
+		return;
+	}
+
+	svc->probe_sd = sd;
+	if (uev_io_init(ctx, &svc_priv(svc)->probe_watcher, connect_cb, svc, sd, UEV_WRITE)) {
+		probe_done(svc, 0, "failed, cannot watch socket");
+		return;
+	}
+	probe_timer(svc, svc->probe_tmo * 1000);
+}
+
+static void probe_exec(svc_t *svc, char *path)
+{
+	char *argv[] = { path, NULL };
+	spawn_t sp;
+	pid_t pid;
+	int fd;
+
+	fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	sp.path  = path;
+	sp.argv  = argv;
+	sp.envp  = spawn_env(svc_priv(svc)->cred.uid, NULL);
+	sp.cred  = &svc_priv(svc)->cred;
+	sp.fd[0] = sp.fd[1] = sp.fd[2] = fd;
+	sp.lfd   = NULL;
+	sp.lpid  = NULL;
+	sp.cgfd  = -1;
+	sp.attr  = NULL;
+	sp.num_lfd = 0;
+
+	pid = spawn(&sp);
+	if (fd >= 0)
+		close(fd);
+	if (sp.envp)
+		free(sp.envp);
+
+	if (pid < 0) {
+		probe_done(svc, 0, "failed starting");
+		return;
+	}
+
+	svc->probe_pid = pid;
+	pid_track(pid, PID_TYPE_PROBE, svc);
+	probe_timer(svc, svc->probe_tmo * 1000);
+}
+
+static void probe_file(svc_t *svc, char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st)) {
+		probe_done(svc, 0, "failed, file missing");
+		return;
+	}
+
+	if (time(NULL) - st.st_mtime > svc->probe_age) {
+		probe_done(svc, 0, "failed, file is stale");
+		return;
+	}
+
+	probe_done(svc, 1, NULL);
+}
+
+static void probe_run(svc_t *svc)
+{
+	char spec[LINE_SIZE], *target;
+
+	/* Not yet ready, or on its way down */
+	if (svc->state != SVC_RUNNING_STATE) {
+		probe_timer(svc, svc->probe_interval * 1000);
+		return;
+	}
+
+	strlcpy(spec, svc_probe(svc), sizeof(spec));
+	target = strchr(spec, ':');
+	if (!target)
+		return;
+	*target++ = 0;
+
+	svc->probe_tm  = now_ms();
+	svc->probe_pid = 0;
+	svc->probe_sd  = -1;
+
+	if (!strcmp(spec, "exec"))
+		probe_exec(svc, target);
+	else if (!strcmp(spec, "file"))
+		probe_file(svc, target);
+	else
+		probe_connect(svc, spec, target);
+}
+
+/* Time for next probe, or the one in progress has timed out */
+static void probe_cb(uev_t *w, void *arg, int UNUSED(events))
+{
+	svc_t *svc = arg;
+
+	uev_timer_stop(w);
+
+	svc_update_begin();
+	if (svc->probe_tm)
+		probe_done(svc, 0, "timed out");
+	else if (svc->pid > 0)
+		probe_run(svc);
+	svc_update_end();
+}
+
+/**
+ * probe_start - Start health checks of a service
+ * @svc: Service that has just been started
+ *
+ * Probes run every interval, the first one interval after start, and
+ * only when the service is ready.  Each must pass within its timeout.
+ * After fail:N failed probes in a row the service is restarted, as if
+ * it had crashed, see service_unhealthy().
+ */
+void probe_start(svc_t *svc)
+{
+	probe_cancel(svc);
+	svc->probe_fails = 0;
+	svc->probe_ms    = -1;
+
+	if (!svc_probe(svc)[0])
+		return;
+
+	probe_timer(svc, svc->probe_interval * 1000);
+}
+
+/**
+ * probe_cancel - Stop health checks of a service
+ * @svc: Service that is stopped, collected or removed
+ *
+ * Any probe in progress is aborted, an exec: probe is killed.
+ */
+void probe_cancel(svc_t *svc)
+{
+	uev_timer_stop(&svc_priv(svc)->probe_timer);
+	if (svc->probe_tm)
+		probe_end(svc);
+}
+
+/**
+ * probe_collect - An exec: probe has exited
+ * @svc:    Service the probe belongs to
+ * @lost:   PID of the probe
+ * @status: Exit status of the probe, zero means the service is healthy
+ *
+ * Called by service_monitor(), the PID is no longer tracked.
+ */
+void probe_collect(svc_t *svc, pid_t lost, int status)
+{
+	if (!svc->probe_tm || lost != svc->probe_pid)
+		return;
+
+	svc->probe_pid = 0;
+	probe_done(svc, WIFEXITED(status) && !WEXITSTATUS(status), "failed");
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,341 @@
+/* Service readiness notification, notify socket and pidfiles
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "libite/lite.h"
+
+#include "finit.h"
+#include "helpers.h"
+#include "private.h"
+#include "service.h"
+#include "ready.h"
+
+/* Service waiting for its pidfile to be written */
+typedef struct {
+	svc_t *svc;
+	int    wd;		/* inotify watch on dirname of pidfile */
+	char  *name;		/* basename of pidfile                 */
+} ready_file_t;
+
+static uev_t notify_watcher;
+static uev_t inotify_watcher;
+
+static ready_file_t *files;
+static int num_files, max_files;
+
+static void notify_cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
+{
+	char buf[256];
+	char cbuf[CMSG_SPACE(sizeof(struct ucred))];
+	struct iovec iov = { buf, sizeof(buf) - 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	while (1) {
+		struct ucred *cred = NULL;
+		pid_type_t type;
+		ssize_t len;
+		char *line, *ptr;
+		svc_t *svc;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		len = recvmsg(w->fd, &msg, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				_pe("Failed reading notify socket");
+			break;
+		}
+		buf[len] = 0;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS)
+				cred = (struct ucred *)CMSG_DATA(cmsg);
+		}
+		if (!cred)
+			continue;
+
+		svc = pid_find(cred->pid, &type);
+		if (!svc || type != PID_TYPE_SVC) {
+			_d("Ignoring notification from unknown PID %d", cred->pid);
+			continue;
+		}
+
+		for (line = strtok_r(buf, "\n", &ptr); line; line = strtok_r(NULL, "\n", &ptr)) {
+			if (strcmp(line, "READY=1"))
+				continue;
+
+			_d("Service %s[%d] is ready", svc->cmd, svc->pid);
+			svc_update_begin();
+			service_ready(svc, 1);
+			svc_update_end();
+		}
+	}
+}
+
+static void inotify_cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	while ((len = read(w->fd, buf, sizeof(buf))) > 0) {
+		char *ptr;
+
+		for (ptr = buf; ptr < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)ptr;
+			int i;
+
+			ptr += sizeof(struct inotify_event) + ev->len;
+			if (!ev->len)
+				continue;
+
+			/* Backwards, service_ready() removes from list */
+			for (i = num_files - 1; i >= 0; i--) {
+				svc_t *svc;
+
+				if (i >= num_files || files[i].wd != ev->wd || strcmp(files[i].name, ev->name))
+					continue;
+
+				svc = files[i].svc;
+				_d("Service %s[%d] wrote %s, ready", svc->cmd, svc->pid, ev->name);
+				svc_update_begin();
+				service_ready(svc, 1);
+				svc_update_end();
+			}
+		}
+	}
+}
+
+static void timeout_cb(uev_t *w, void *arg, int UNUSED(events))
+{
+	svc_t *svc = arg;
+	char *spec = svc_ready(svc);
+	int ok = 0;
+
+	uev_timer_stop(w);
+
+	/* If we could not watch the directory, check once at timeout */
+	if (spec[0] == '/' && fexist(spec))
+		ok = 1;
+	else
+		_e("Service %s not ready after %d sec, failing dependents", svc->cmd, svc->ready_tmo);
+
+	svc_update_begin();
+	service_ready(svc, ok);
+	svc_update_end();
+}
+
+static int file_add(svc_t *svc, char *pidfile)
+{
+	char dir[PATH_MAX], *name;
+	int wd;
+
+	if (inotify_watcher.fd < 0)
+		return errno = EBADF;
+
+	strlcpy(dir, pidfile, sizeof(dir));
+	name = strrchr(dir, '/');
+	if (!name || !name[1])
+		return errno = EINVAL;
+	*name++ = 0;
+
+	wd = inotify_add_watch(inotify_watcher.fd, dir[0] ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0)
+		return errno;
+
+	if (num_files == max_files) {
+		ready_file_t *tmp;
+		int max = max_files ? max_files * 2 : 8;
+
+		tmp = realloc(files, max * sizeof(ready_file_t));
+		if (!tmp)
+			return errno = ENOMEM;
+		files = tmp;
+		max_files = max;
+	}
+
+	files[num_files].svc  = svc;
+	files[num_files].wd   = wd;
+	files[num_files].name = strdup(name);
+	if (!files[num_files].name)
+		return errno = ENOMEM;
+	num_files++;
+
+	return 0;
+}
+
+static void file_del(int i)
+{
+	int j, wd = files[i].wd;
+
+	free(files[i].name);
+	files[i] = files[--num_files];
+
+	/* Directory watches are shared, remove when last user is gone */
+	for (j = 0; j < num_files; j++) {
+		if (files[j].wd == wd)
+			return;
+	}
+	inotify_rm_watch(inotify_watcher.fd, wd);
+}
+
+/**
+ * ready_init - Set up notify socket and pidfile watcher
+ * @ctx: Event context
+ *
+ * The notify socket is an abstract unix datagram socket, compatible
+ * with sd_notify(), so a service does not need any file system access
+ * to tell us it is ready.  We only act on READY=1 and use the sender's
+ * credentials to find the service.
+ *
+ * Returns:
+ * POSIX OK(0) or non-zero on error.
+ */
+int ready_init(uev_ctx_t *ctx)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+	int sd, fd, on = 1;
+
+	notify_watcher.fd  = -1;
+	inotify_watcher.fd = -1;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		_pe("Failed creating pidfile watcher");
+	else if (uev_io_init(ctx, &inotify_watcher, inotify_cb, NULL, fd, UEV_READ)) {
+		close(fd);
+		inotify_watcher.fd = -1;
+	}
+
+	sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		_pe("Failed creating notify socket");
+		return 1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, READY_SOCKET, sizeof(sun.sun_path));
+	sun.sun_path[0] = 0;
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(READY_SOCKET);
+
+	if (bind(sd, (struct sockaddr *)&sun, len) ||
+	    setsockopt(sd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on))) {
+		_pe("Failed setting up notify socket %s", READY_SOCKET);
+		close(sd);
+		return 1;
+	}
+
+	if (uev_io_init(ctx, &notify_watcher, notify_cb, NULL, sd, UEV_READ)) {
+		close(sd);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * ready_watch - Start waiting for a service to become ready
+ * @svc: Service about to be started
+ *
+ * Must be called before the service is started, a stale pidfile is
+ * removed and the directory watched before the service can write it.
+ * The timer, ready:...,SEC, fails the service if it never signals it
+ * is ready.
+ *
+ * Returns:
+ * %TRUE(1) if @svc must signal it is ready, otherwise %FALSE(0).
+ */
+int ready_watch(svc_t *svc)
+{
+	char *spec = svc_ready(svc);
+
+	if (!spec[0])
+		return 0;
+
+	ready_cancel(svc);
+	if (spec[0] == '/') {
+		if (fexist(spec))
+			erase(spec);
+		if (file_add(svc, spec))
+			_pe("Cannot watch %s, checking for it at timeout", spec);
+	}
+
+	if (uev_timer_init(ctx, &svc_priv(svc)->ready_timer, timeout_cb, svc, svc->ready_tmo * 1000, 0))
+		_pe("Failed starting ready timer for %s", svc->cmd);
+
+	return 1;
+}
+
+/**
+ * ready_cancel - Stop waiting for a service
+ * @svc: Service that is ready, stopped, or has been removed
+ */
+void ready_cancel(svc_t *svc)
+{
+	int i;
+
+	uev_timer_stop(&svc_priv(svc)->ready_timer);
+	for (i = num_files - 1; i >= 0; i--) {
+		if (files[i].svc == svc)
+			file_del(i);
+	}
+}
+
+/**
+ * ready_env - Environment for a service using the notify socket
+ * @svc: Service to start
+ *
+ * Returns:
+ * "NOTIFY_SOCKET=..." for ready:notify, otherwise %NULL.
+ */
+char *ready_env(svc_t *svc)
+{
+	if (strcmp(svc_ready(svc), "notify"))
+		return NULL;
+
+	return "NOTIFY_SOCKET=" READY_SOCKET;
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
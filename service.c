@@ -24,6 +24,7 @@
 
 #include "config.h"		/* Generated by configure script */
 
+#include <ctype.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <net/if.h>
@@ -31,6 +32,7 @@
 
 #include "finit.h"
 #include "conf.h"
+#include "dag.h"
 #include "event.h"
 #include "helpers.h"
 #include "private.h"
@@ -38,12 +40,41 @@
 #include "tty.h"
 #include "service.h"
 #include "inetd.h"
-
-#define RESPAWN_MAX    10	        /* Prevent endless respawn of faulty services. */
-
-static int    dyn_stop_cnt = 0;
+#include "cgroup.h"
+#include "ready.h"
+#include "sock.h"
+#include "logbuf.h"
+#include "probe.h"
+#include "wdog.h"
+#include "cron.h"
+
+#define RESTART_MAX    10	        /* Prevent endless respawn of faulty services ... */
+#define RESTART_WINDOW 600	        /* ... by allowing max 10 restarts in 10 min.    */
+#define BACKOFF_MIN    1	        /* Delay before 2nd restart, doubled each time   */
+#define BACKOFF_MAX    30	        /* up to max 30 sec.                             */
+#define KILL_TIMEOUT   3	        /* Sec. between SIGTERM and SIGKILL at stop      */
+
+#define RELOAD_GRACE   2	        /* Sec. after kill:SEC before reload continues   */
+#define RELOAD_TIMEOUT 30	        /* Sec. for reloaded services to start           */
+
+typedef enum {
+	RELOAD_IDLE = 0,
+	RELOAD_STOPPING,	/* Waiting for removed/changed services to stop */
+	RELOAD_STARTING,	/* Waiting for new/changed services to start    */
+} reload_state_t;
+
+/* Reload of /etc/finit.d, see service_reload_dynamic() */
+static struct {
+	reload_state_t state;
+	int            stopping;	/* Services not yet collected      */
+	int            failed;	/* Steps failed or timed out       */
+	int            result;	/* Of last completed reload        */
+	int            again;	/* Requested again while busy      */
+	uev_t          timer;
+} reload = { .timer.fd = -1 };
 
 static int    is_norespawn       (void);
+static void   service_respawn    (svc_t *svc);
 static void   restart_lost_procs (void);
 static void   svc_dance          (svc_t *svc);
 #ifndef INETD_DISABLED
@@ -59,36 +90,46 @@ static svc_t *find_inetd_svc     (char *path, char *service, char *proto);
 void service_bootstrap(void)
 {
 	svc_t *svc;
+	svc_iter_t iter;
 
 	_d("Bootstrapping all services in runlevel S from %s", FINIT_CONF);
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
 		svc_cmd_t cmd;
 
-		/* Inetd services cannot be part of bootstrap currently. */
-		if (svc_is_inetd(svc))
+		/* Inetd services cannot be part of bootstrap currently,
+		 * and cron and at jobs are started when due. */
+		if (svc_is_inetd(svc) || svc_is_cron(svc))
 			continue;
 
 		cmd = service_enabled(svc, 0, NULL);
 		if (SVC_START == cmd  || (SVC_RELOAD == cmd))
-			service_start(svc);
+			dag_add(svc);
 	}
+
+	/* Start in parallel, as dependencies allow, see dag_wait() */
+	dag_run();
 }
 
 /**
  * service_enabled - Should the service run?
  * @svc:   Pointer to &svc_t object
  * @event: Dynamic event, opaque flag passed to callback
- * @arg:   Event argument, used only by external service plugins.
+ * @arg:   Event argument, cannot be passed to the callback helper process.
  *
  * This method calls an associated service callback, if registered by a
  * plugin, and returns the &svc_cmd_t status. If no plugin is registered
  * the service is statically enabled in /etc/finit.conf and the result
  * will always be %SVC_START.
  *
+ * The callback runs in a helper process, see plugin_svc_cb(), and its
+ * result is cached until the next event, runlevel change or reload.
+ * PID 1 does not wait for it, the last result is used until the reply
+ * arrives, see service_callback(), or %SVC_STOP if there is none yet.
+ *
  * Returns:
  * Either one of %SVC_START, %SVC_STOP, %SVC_RELOAD.
  */
-svc_cmd_t service_enabled(svc_t *svc, int event, void *arg)
+svc_cmd_t service_enabled(svc_t *svc, int event, void *UNUSED(arg))
 {
 	svc_cmd_t cmd = SVC_START; /* Default to start, since listed in finit.conf */
 
@@ -103,8 +144,8 @@ svc_cmd_t service_enabled(svc_t *svc, int event, void *arg)
 	/*
 	 * Event conditions for services are ignored during bootstrap.
 	 */
-	_d("Checking %s runlevel %d and events %s", svc->cmd, runlevel, svc->events);
-	if (runlevel && !event_service_cond(svc->events))
+	_d("Checking %s runlevel %d and events %s", svc->cmd, runlevel, svc_events(svc));
+	if (runlevel && !event_service_cond(svc))
 		return SVC_STOP;
 
 	if (svc->state == SVC_RELOAD_STATE)
@@ -114,37 +155,17 @@ svc_cmd_t service_enabled(svc_t *svc, int event, void *arg)
 
 	/* Is there a service plugin registered? */
 	if (svc->cb) {
-		int   status;
-		pid_t pid;
-
-		/* Let callback run in separate process so it doesn't crash PID 1 */
-		pid = fork();
-		if (-1 == pid) {
-			_pe("Failed in %s callback", svc->cmd);
-			return SVC_STOP;
-		}
+		unsigned int gen = event_generation();
 
-		if (!pid)
-			_exit(svc->cb(svc, event, arg));
+		/* Only ask callback again if events have changed */
+		if (svc->cb_gen != gen || svc->cb_event != event)
+			plugin_svc_cb(svc, event, gen);
 
-		if (waitpid(pid, &status, 0) == -1) {
-			_pe("Failed reading status from %s callback", svc->cmd);
+		/* Not replied yet, do not start before it has */
+		if (!svc->cb_gen)
 			return SVC_STOP;
-		}
-
-		/* Callback normally exits here. */
-		if (WIFEXITED(status)) {
-			svc_cmd_t tmp = WEXITSTATUS(status);
-			return tmp == SVC_START ? cmd : tmp;
-		}
 
-		/* Check for SEGFAULT or other error ... */
-		if (WIFSIGNALED(status) && WCOREDUMP(status))
-			_e("Callback to %s crashed!\n", svc->cmd);
-		else
-			_e("Callback to %s did not exit normally!\n", svc->cmd);
-
-		return SVC_STOP;
+		return svc->cb_cmd == SVC_START ? cmd : svc->cb_cmd;
 	}
 
 	_d("%s => %s", svc->cmd, (cmd == SVC_START
@@ -156,12 +177,142 @@ svc_cmd_t service_enabled(svc_t *svc, int event, void *arg)
 	return cmd;
 }
 
+/*
+ * Internal inetd services run a function in the child, this is the
+ * only case which still needs the full fork() of Finit.
+ */
+static pid_t service_fork_internal(svc_t *svc, int sd)
+{
+	pid_t pid;
+	sigset_t nmask, omask;
+
+	/* Block sigchild while forking.  */
+	sigemptyset(&nmask);
+	sigaddset(&nmask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &nmask, &omask);
+
+	pid = fork();
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+	if (pid == 0) {
+		int status;
+
+		sigemptyset(&nmask);
+		sigaddset(&nmask, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &nmask, NULL);
+
+		/* Redirect inetd socket to stdin for service */
+		dup2(sd, STDIN_FILENO);
+		close(sd);
+		dup2(STDIN_FILENO, STDOUT_FILENO);
+		dup2(STDIN_FILENO, STDERR_FILENO);
+
+		sig_unblock();
+
+		status = svc->inetd.cmd(svc->inetd.type);
+		if (svc->inetd.type == SOCK_STREAM) {
+			close(STDIN_FILENO);
+			close(STDOUT_FILENO);
+			close(STDERR_FILENO);
+		}
+
+		exit(status);
+	}
+
+	return pid;
+}
+
+/*
+ * Prepare credentials, environment and stdio for the service before
+ * calling spawn(), the child must not do anything but exec.
+ */
+static pid_t service_spawn(svc_t *svc, int sd, int respawn, char *args[])
+{
+	svc_priv_t *priv = svc_priv(svc);
+	int fd = -1;
+	pid_t pid;
+	spawn_t sp;
+	char fds[24], lpid[24] = "LISTEN_PID=";
+	char *extra[] = { ready_env(svc), NULL, NULL, NULL };
+	int i, lfd[MAX_NUM_SVC_SOCK];
+
+	/* Resolved at registration, unless the user did not exist then */
+	if (svc->username[0] && priv->cred.uid == (uid_t)-1) {
+		if (spawn_cred(&priv->cred, svc->username, svc->group)) {
+			_e("Not starting %s, unknown user %s or group %s", svc->cmd,
+			   svc->username, svc->group[0] ? svc->group : "(default)");
+			return -1;
+		}
+	}
+
+	sp.path  = svc->cmd;
+	sp.argv  = args;
+	sp.cred  = &priv->cred;
+	sp.fd[0] = sp.fd[1] = sp.fd[2] = -1;
+	sp.lfd   = NULL;
+	sp.lpid  = NULL;
+	sp.num_lfd = 0;
+	sp.cgfd  = svc_is_daemon(svc) ? cgroup_prepare(svc) : -1;
+	sp.attr  = priv->attr.set ? &priv->attr : NULL;
+
+	/* Socket activation, sd_listen_fds() style, see sock.c */
+	if (svc->num_sock) {
+		for (i = 0; i < svc->num_sock; i++)
+			lfd[i] = svc->sock[i];
+		sp.lfd     = lfd;
+		sp.num_lfd = svc->num_sock;
+		sp.lpid    = lpid;
+
+		snprintf(fds, sizeof(fds), "LISTEN_FDS=%d", svc->num_sock);
+		for (i = 0; extra[i]; i++)
+			;
+		extra[i++] = fds;
+		extra[i]   = lpid;
+	}
+	sp.envp  = spawn_env(priv->cred.uid, extra);
+
+	if (svc_is_inetd(svc)) {
+		/* Redirect inetd socket to stdin for service, sd set previously */
+		sp.fd[0] = sp.fd[1] = sp.fd[2] = sd;
+	} else if (debug) {
+		char buf[CMD_SIZE] = "";
+
+		fd = open(CONSOLE, O_WRONLY | O_APPEND | O_CLOEXEC);
+		sp.fd[1] = sp.fd[2] = fd;
+
+		for (i = 0; i < MAX_NUM_SVC_ARGS && args[i]; i++) {
+			char arg[MAX_ARG_LEN];
+
+			snprintf(arg, sizeof(arg), "%s ", args[i]);
+			if (strlen(arg) < (sizeof(buf) - strlen(buf)))
+				strcat(buf, arg);
+		}
+		_e("%starting %s: %s", respawn ? "Res" : "S", svc->cmd, buf);
+	} else if (svc_is_daemon(svc)) {
+		/* Output kept in a ring by the log helper, see logbuf.c */
+		fd = logbuf_open(svc);
+		sp.fd[1] = sp.fd[2] = fd;
+	}
+
+	pid = spawn(&sp);
+	if (-1 == pid)
+		_pe("Failed starting %s", svc->cmd);
+
+	if (fd >= 0)
+		close(fd);
+	if (sp.cgfd >= 0)
+		close(sp.cgfd);
+	if (sp.envp)
+		free(sp.envp);
+
+	return pid;
+}
+
 /* Remember: service_enabled() must be called before calling service_start() */
 int service_start(svc_t *svc)
 {
-	int respawn, sd = 0;
+	int respawn, starting = 0, sd = 0;
 	pid_t pid;
-	sigset_t nmask, omask;
+	char argbuf[LINE_SIZE], *args[MAX_NUM_SVC_ARGS];
 
 	if (!svc)
 		return 1;
@@ -184,6 +335,18 @@ int service_start(svc_t *svc)
 	if (is_norespawn())
 		return 0;
 
+	if (svc_is_daemon(svc)) {
+		/* Sockets are bound at boot, or when first started */
+		if (sock_open(svc)) {
+			_e("Not starting %s, failed binding its sockets", svc->cmd);
+			return 1;
+		}
+
+		/* Socket activated on demand, start on first traffic */
+		if (sock_wait(svc))
+			return 0;
+	}
+
 #ifndef INETD_DISABLED
 	if (svc_is_inetd(svc)) {
 		char ifname[IF_NAMESIZE] = "UNKNOWN";
@@ -221,108 +384,48 @@ int service_start(svc_t *svc)
 #endif
 	if (verbose) {
 		if (svc_is_daemon(svc))
-			print_desc("", svc->desc);
-		else if (!respawn)
-			print_desc("Starting ", svc->desc);
+			print_desc("", svc_desc(svc));
+		else if (!respawn && SVC_TYPE_RUN != svc->type)
+			print_desc("Starting ", svc_desc(svc));
 	}
 
-	/* Block sigchild while forking.  */
-	sigemptyset(&nmask);
-	sigaddset(&nmask, SIGCHLD);
-	sigprocmask(SIG_BLOCK, &nmask, &omask);
-
-	pid = fork();
-	sigprocmask(SIG_SETMASK, &omask, NULL);
-	if (pid == 0) {
-		int i = 0;
-		int status;
-#ifdef ENABLE_STATIC
-		int uid = 0; /* XXX: Fix better warning that dropprivs is disabled. */
-#else
-		int uid = getuser(svc->username);
-#endif
-		struct sigaction sa;
-		char *args[MAX_NUM_SVC_ARGS];
-
-		sigemptyset(&nmask);
-		sigaddset(&nmask, SIGCHLD);
-		sigprocmask(SIG_UNBLOCK, &nmask, NULL);
-
-		/* Reset signal handlers that were set by the parent process */
-		for (i = 1; i < NSIG; i++)
-			DFLSIG(sa, i, 0);
-
-		/* Set desired user */
-		if (uid >= 0) {
-			setuid(uid);
-
-			/* Set default path for regular users */
-			if (uid > 0)
-				setenv("PATH", _PATH_DEFPATH, 1);
-		}
-
-		/* Serve copy of args to process in case it modifies them. */
-		for (i = 0; i < (MAX_NUM_SVC_ARGS - 1) && svc->args[i][0] != 0; i++)
-			args[i] = svc->args[i];
-		args[i] = NULL;
-
-		/* Redirect inetd socket to stdin for service */
-		if (svc_is_inetd(svc)) {
-			/* sd set previously */
-			dup2(sd, STDIN_FILENO);
-			close(sd);
-			dup2(STDIN_FILENO, STDOUT_FILENO);
-			dup2(STDIN_FILENO, STDERR_FILENO);
-		} else if (debug) {
-			int fd;
-			char buf[CMD_SIZE] = "";
-
-			fd = open(CONSOLE, O_WRONLY | O_APPEND);
-			if (-1 != fd) {
-				dup2(fd, STDOUT_FILENO);
-				dup2(fd, STDERR_FILENO);
-				close(fd);
-			}
-
-			for (i = 0; i < MAX_NUM_SVC_ARGS && args[i]; i++) {
-				char arg[MAX_ARG_LEN];
-
-				snprintf(arg, sizeof(arg), "%s ", args[i]);
-				if (strlen(arg) < (sizeof(buf) - strlen(buf)))
-					strcat(buf, arg);
-			}
-			_e("%starting %s: %s", respawn ? "Res" : "S", svc->cmd, buf);
-		}
-
-		sig_unblock();
-
-		if (svc->inetd.cmd)
-			status = svc->inetd.cmd(svc->inetd.type);
-		else
-			status = execv(svc->cmd, args); /* XXX: Maybe use execve() to be able to launch scripts? */
+	/* Serve copy of args to process in case it modifies them. */
+	svc_argv(svc, argbuf, sizeof(argbuf), args, NELEMS(args));
 
-		if (svc_is_inetd(svc)) {
-			if (svc->inetd.type == SOCK_STREAM) {
-				close(STDIN_FILENO);
-				close(STDOUT_FILENO);
-				close(STDERR_FILENO);
-			}
-		}
+	/* Before starting, so we cannot miss the service being ready */
+	if (svc_is_daemon(svc))
+		starting = ready_watch(svc);
 
-		exit(status);
-	}
+	if (svc->inetd.cmd)
+		pid = service_fork_internal(svc, sd);
+	else
+		pid = service_spawn(svc, sd, respawn, args);
 	svc->pid = pid;
 	svc->state = SVC_RUNNING_STATE;
+	svc_priv(svc)->done = 0;
+	if (pid > 0) {
+		pid_track(pid, PID_TYPE_SVC, svc);
+		if (starting)
+			svc->state = SVC_STARTING_STATE;
+		if (svc_is_daemon(svc))
+			probe_start(svc);
+	} else if (starting) {
+		ready_cancel(svc);
+	}
 
 	if (svc_is_inetd(svc)) {
 		if (svc->inetd.type == SOCK_STREAM)
 			close(sd);
+	} else if (SVC_TYPE_RUN == svc->type) {
+		/* Result printed when collected, see service_collect() */
+		if (pid <= 0 && verbose) {
+			print_desc("Starting ", svc_desc(svc));
+			print_result(1);
+		}
 	} else {
 		int result;
 
-		if (SVC_TYPE_RUN == svc->type)
-			result = WEXITSTATUS(complete(svc->cmd, pid));
-		else if (!respawn)
+		if (!respawn)
 			result = svc->pid > 1 ? 0 : 1;
 		else
 			result = 0;
@@ -334,6 +437,52 @@ int service_start(svc_t *svc)
 	return 0;
 }
 
+/**
+ * service_ready - Service is ready, or never will be
+ * @svc: Service in %SVC_STARTING_STATE
+ * @ok:  Service signalled it is ready, or not (timeout, or it exited)
+ *
+ * Called from ready.c, and when a service exits or is stopped before
+ * it was ready.  Anything waiting for @svc is started, or failed, and
+ * any initctl client waiting for it is answered.
+ */
+void service_ready(svc_t *svc, int ok)
+{
+	ready_cancel(svc);
+	if (svc->state != SVC_STARTING_STATE)
+		return;
+
+	svc->state = SVC_RUNNING_STATE;
+	dag_done(svc, ok);
+	api_wakeup();
+}
+
+static void service_kill_cb(uev_t *w, void *arg, int UNUSED(events))
+{
+	svc_t *svc = arg;
+
+	uev_timer_stop(w);
+	if (svc->pid <= 1)
+		return;
+
+	_d("Service %s[%d] did not stop within %d sec, sending SIGKILL", svc->cmd, svc->pid, svc->kill_tmo);
+	if (cgroup_kill(svc))
+		pid_kill(svc->pid, SIGKILL);
+}
+
+/**
+ * service_stop - Stop a service
+ * @svc:   Service to stop
+ * @state: New state of service, set if SIGTERM was sent OK
+ *
+ * Sends SIGTERM and returns immediately, if the service has not been
+ * collected by service_monitor() within the service's kill timeout it
+ * is sent SIGKILL.  This way many services can be stopped in parallel
+ * without blocking PID 1.
+ *
+ * Returns:
+ * POSIX OK(0) or non-zero on error.
+ */
 int service_stop(svc_t *svc, int state)
 {
 	int res = 0;
@@ -341,8 +490,12 @@ int service_stop(svc_t *svc, int state)
 	if (!svc)
 		return 1;
 
+	/* Cancel any pending restart, or start on demand */
+	uev_timer_stop(&svc_priv(svc)->restart_timer);
+	sock_cancel(svc);
+
 	if (svc->pid <= 1) {
-		_d("Bad PID %d for %s, SIGTERM", svc->pid, svc->desc);
+		_d("Bad PID %d for %s, SIGTERM", svc->pid, svc->cmd);
 		res = 1;
 		goto exit;
 	}
@@ -355,10 +508,20 @@ int service_stop(svc_t *svc, int state)
 		goto exit;
 
 	if (runlevel != 1 && verbose)
-		print_desc("Stopping ", svc->desc);
+		print_desc("Stopping ", svc_desc(svc));
+
+	/* Stopped before it was ready, fail anything waiting for it */
+	service_ready(svc, 0);
+	probe_cancel(svc);
+	wdog_cancel(svc);
 
 	_d("Sending SIGTERM to pid:%d name:%s", svc->pid, pid_get_name(svc->pid, NULL, 0));
-	res = kill(svc->pid, SIGTERM);
+	res = pid_kill(svc->pid, SIGTERM);
+	if (!res && svc->kill_tmo > 0) {
+		uev_timer_stop(&svc_priv(svc)->kill_timer);
+		if (uev_timer_init(ctx, &svc_priv(svc)->kill_timer, service_kill_cb, svc, svc->kill_tmo * 1000, 0))
+			_pe("Failed starting kill timer for %s", svc->cmd);
+	}
 
 	if (runlevel != 1 && verbose)
 		print_result(res);
@@ -371,75 +534,248 @@ exit:
 }
 
 /**
- * service_start_dynamic - Start new or reload modified dynamic services
+ * service_unhealthy - Restart a service that fails its health check
+ * @svc: Service to restart
+ *
+ * Unlike service_stop() the state and restart counter are kept, so
+ * service_monitor() restarts @svc when it has been collected, with the
+ * same restart policy as if it had crashed.
  */
-void service_start_dynamic(void)
+void service_unhealthy(svc_t *svc)
 {
-	svc_t *svc;
+	if (svc->pid <= 1 || SVC_TYPE_SERVICE != svc->type)
+		return;
 
-	_d("Starting enabled/added services ...");
-	for (svc = svc_dynamic_iterator(1); svc; svc = svc_dynamic_iterator(0)) {
-		if (svc_is_updated(svc))
-			svc_dance(svc);
-	}
+	_d("Sending SIGTERM to unhealthy pid:%d name:%s", svc->pid, pid_get_name(svc->pid, NULL, 0));
+	if (pid_kill(svc->pid, SIGTERM) || svc->kill_tmo <= 0)
+		return;
 
-	/* Cleanup stale services */
-	svc_clean_dynamic(service_unregister);
+	uev_timer_stop(&svc_priv(svc)->kill_timer);
+	if (uev_timer_init(ctx, &svc_priv(svc)->kill_timer, service_kill_cb, svc, svc->kill_tmo * 1000, 0))
+		_pe("Failed starting kill timer for %s", svc->cmd);
 }
 
 /*
- * Unless there are services we must collect first (wait for
- * them to stop), we can call HOOK_SVC_RECONF here.
+ * Reload of /etc/finit.d is carried out in two steps, each with its own
+ * timeout.  First all removed and changed services are stopped, then,
+ * when they have all been collected, new and changed services are
+ * started by the startup graph, and touched ones sent SIGHUP.
  */
-static int service_stop_done(svc_t *svc)
+static void reload_done(void)
 {
-	if (svc && !svc_is_changed(svc))
-		return 0;
+	svc_iter_t iter;
+	svc_t *svc;
+
+	uev_timer_stop(&reload.timer);
+	for (svc = svc_dynamic_iterator(&iter, 1); svc; svc = svc_dynamic_iterator(&iter, 0)) {
+		if (dag_failed(svc) && (svc->plan == SVC_PLAN_ADD || svc->plan == SVC_PLAN_RESTART))
+			reload.failed++;
+		svc->plan = SVC_PLAN_NONE;
+	}
+
+	reload.result = reload.failed;
+	reload.state  = RELOAD_IDLE;
+	_d("Reload done, %d failed", reload.result);
+
+	/* Clients waiting for the first get the result of this one */
+	if (reload.again) {
+		reload.again = 0;
+		service_reload_dynamic();
+		return;
+	}
 
-	if (svc && dyn_stop_cnt)
-		dyn_stop_cnt--;
+	api_wakeup();
+}
 
-	_d("dyn_stop_cnt %d", dyn_stop_cnt);
-	if (!dyn_stop_cnt) {
-		_d("All disabled/removed services have been stoppped, calling reconf hooks ...");
-		plugin_run_hooks(HOOK_SVC_RECONF); /* Reconfigure HW/VLANs/etc here */
+static void reload_timeout_cb(uev_t *UNUSED(w), void *UNUSED(arg), int UNUSED(events))
+{
+	svc_update_begin();
+	if (reload.state == RELOAD_STOPPING) {
+		_e("Reload: %d service(s) did not stop in time, continuing.", reload.stopping);
+		reload.failed++;
+		reload.stopping = 0;
 
-		/* Finish off by starting/reload modified/new services */
+		plugin_run_hooks(HOOK_SVC_RECONF);
 		service_start_dynamic();
+	} else if (reload.state == RELOAD_STARTING) {
+		_e("Reload: services still starting after %d sec.", RELOAD_TIMEOUT);
+		reload.failed++;
+		reload_done();
+	}
+	svc_update_end();
+}
+
+static void reload_timer(int sec)
+{
+	uev_timer_stop(&reload.timer);
+	if (uev_timer_init(ctx, &reload.timer, reload_timeout_cb, NULL, sec * 1000, 0))
+		_pe("Failed starting reload timer");
+}
+
+/* Compare each dynamic service with what was loaded from /etc/finit.d */
+static void reload_plan(void)
+{
+	svc_t *svc;
+	svc_iter_t iter;
+
+	for (svc = svc_dynamic_iterator(&iter, 1); svc; svc = svc_dynamic_iterator(&iter, 0)) {
+		svc->plan = SVC_PLAN_NONE;
+		if (svc_is_inetd(svc))
+			continue;
+
+		if (svc_is_removed(svc))
+			svc->plan = SVC_PLAN_REMOVE;
+		else if (svc_is_cron(svc))
+			continue;	/* Rescheduled when registered */
+		else if (svc_is_updated(svc))
+			svc->plan = svc->pid ? SVC_PLAN_RESTART : SVC_PLAN_ADD;
+		else if (svc_is_touched(svc) && svc->pid && svc_has_sighup(svc))
+			svc->plan = SVC_PLAN_SIGHUP;
 	}
+}
+
+/* A service stopped by reload has been collected, returns %TRUE(1) if so */
+static int reload_collect(svc_t *svc)
+{
+	if (reload.state != RELOAD_STOPPING)
+		return 0;
+	if (svc->plan != SVC_PLAN_REMOVE && svc->plan != SVC_PLAN_RESTART)
+		return 0;
+
+	if (--reload.stopping > 0)
+		return 1;
+
+	_d("All removed/changed services have been stopped, calling reconf hooks ...");
+	plugin_run_hooks(HOOK_SVC_RECONF); /* Reconfigure HW/VLANs/etc here */
+	service_start_dynamic();
 
 	return 1;
 }
 
 /**
- * service_stop_dynamic - Stop disabled/removed dynamic services
+ * service_reload_check - Complete a reload waiting for services to start
+ *
+ * Called when the startup graph has no more nodes to start.
+ */
+void service_reload_check(void)
+{
+	if (reload.state == RELOAD_STARTING)
+		reload_done();
+}
+
+/**
+ * service_reload_busy - Check if a reload is in progress
+ * @result: Set to number of failed steps in last reload, if done
+ *
+ * Returns:
+ * %TRUE(1) if a reload is in progress, otherwise %FALSE(0).
+ */
+int service_reload_busy(int *result)
+{
+	if (reload.state != RELOAD_IDLE || reload.again)
+		return 1;
+
+	if (result)
+		*result = reload.result;
+
+	return 0;
+}
+
+/**
+ * service_start_dynamic - Start new or changed dynamic services
+ *
+ * Second step of reload, carries out the rest of the plan made by
+ * service_stop_dynamic().  The step is done when the startup graph
+ * has started all services, see service_reload_check().
+ */
+void service_start_dynamic(void)
+{
+	svc_t *svc;
+	svc_iter_t iter;
+
+	_d("Starting enabled/added services ...");
+	uev_timer_stop(&reload.timer);
+
+	/* From emit START, without a STOP first */
+	if (reload.state == RELOAD_IDLE)
+		reload_plan();
+
+	for (svc = svc_dynamic_iterator(&iter, 1); svc; svc = svc_dynamic_iterator(&iter, 0)) {
+		switch (svc->plan) {
+		case SVC_PLAN_ADD:
+		case SVC_PLAN_RESTART:
+			if (svc->pid > 0) {
+				_e("Not restarting %s, it did not stop.", svc->cmd);
+				reload.failed++;
+				break;
+			}
+			svc_dance(svc);
+			break;
+
+		case SVC_PLAN_SIGHUP:
+			svc->state = SVC_RELOAD_STATE;
+			svc_dance(svc);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	dag_run();
+
+	/* Cleanup stale services */
+	svc_clean_dynamic(service_unregister);
+
+	/* Not done until the startup graph is, see service_reload_check() */
+	reload.state = RELOAD_STARTING;
+	if (dag_busy())
+		reload_timer(RELOAD_TIMEOUT);
+	else
+		reload_done();
+}
+
+/**
+ * service_stop_dynamic - Plan reload and stop removed/changed services
  *
- * We call it "stop", but in reality it could be "skip" as well, if the
- * service supports SIGHUP.  This function is just one step on the road
- * to reload all modified services.
+ * First step of reload.  Each dynamic service is compared with what was
+ * just loaded from /etc/finit.d and given a plan, see &svc_plan_t.  All
+ * that must be stopped are sent SIGTERM at once, the next step starts
+ * when all have been collected, or after the longest kill:SEC of them,
+ * and a grace period.
  */
 void service_stop_dynamic(void)
 {
 	svc_t *svc;
+	svc_iter_t iter;
+	int tmo = 0;
 
 	_d("Stopping disabled/removed services ...");
-	for (svc = svc_dynamic_iterator(1); svc; svc = svc_dynamic_iterator(0)) {
-		if (svc_is_changed(svc) && svc->pid) {
-			svc_state_t new_state = SVC_RELOAD_STATE;
+	reload.state    = RELOAD_STOPPING;
+	reload.stopping = 0;
+
+	reload_plan();
+	for (svc = svc_dynamic_iterator(&iter, 1); svc; svc = svc_dynamic_iterator(&iter, 0)) {
+		if (svc->plan != SVC_PLAN_REMOVE && svc->plan != SVC_PLAN_RESTART)
+			continue;
+		if (SVC_TYPE_SERVICE != svc->type || svc->pid <= 0)
+			continue;
 
-			if (svc_is_removed(svc))
-				new_state = SVC_HALTED_STATE;
+		_d("Stopping %s, plan %d", svc->cmd, svc->plan);
+		if (service_stop(svc, SVC_HALTED_STATE))
+			continue;
 
-			if (!svc_has_sighup(svc))
-				dyn_stop_cnt++;
+		reload.stopping++;
+		tmo = MAX(tmo, svc->kill_tmo > 0 ? svc->kill_tmo : KILL_TIMEOUT);
+	}
 
-			_d("Marking service %s as state %d", svc->cmd, new_state);
-			service_stop(svc, new_state);
-		}
+	if (reload.stopping) {
+		reload_timer(tmo + RELOAD_GRACE);
+		return;
 	}
 
-	/* Check if we need to collect any services before calling user HOOK */
-	service_stop_done(NULL);
+	plugin_run_hooks(HOOK_SVC_RECONF);
+	service_start_dynamic();
 }
 
 /**
@@ -495,7 +831,7 @@ int service_reload(svc_t *svc)
 	svc->state = SVC_RUNNING_STATE;
 
 	_d("Sending SIGHUP to PID %d", svc->pid);
-	return kill(svc->pid, SIGHUP);
+	return pid_kill(svc->pid, SIGHUP);
 }
 
 /**
@@ -504,21 +840,22 @@ int service_reload(svc_t *svc)
  * This function is called when Finit has recieved SIGHUP to reload
  * .conf files in /etc/finit.d.  It is responsible for starting,
  * stopping and reloading (forwarding SIGHUP) to processes affected.
+ * A reload requested while one is in progress is done after it.
  */
 void service_reload_dynamic(void)
 {
+	if (reload.state != RELOAD_IDLE) {
+		reload.again = 1;
+		return;
+	}
+	reload.failed = 0;
+
 	/* First reload all *.conf in /etc/finit.d/ */
 	conf_reload_dynamic();
+	event_invalidate();
 
-	/* Then stop any disabled/removed services and non-reloadable */
+	/* Then stop removed and changed services, the rest follows */
 	service_stop_dynamic();
-
-	/*
-	 * Finish off by starting/reloading modified/new services.
-	 * Postponed to service_stop_done() to make sure all services
-	 * are guaranteed to have been stopped before being started
-	 * again.
-	 */
 }
 
 /**
@@ -531,6 +868,7 @@ void service_reload_dynamic(void)
 void service_runlevel(int newlevel)
 {
 	svc_t *svc;
+	svc_iter_t iter;
 
 	if (runlevel == newlevel)
 		return;
@@ -543,12 +881,14 @@ void service_runlevel(int newlevel)
 
 	_d("Setting new runlevel --> %d <-- previous %d", runlevel, prevlevel);
 	runlevel_set(prevlevel, newlevel);
+	svc_set_runlevel(prevlevel, newlevel);
+	event_invalidate();
 
 	/* Make sure to (re)load all *.conf in /etc/finit.d/ */
 	conf_reload_dynamic();
 
 	_d("Stopping services services not allowed in new runlevel ...");
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
 		if (!svc_in_runlevel(svc, runlevel)) {
 #ifndef INETD_DISABLED
 			if (svc_is_inetd(svc))
@@ -568,7 +908,7 @@ void service_runlevel(int newlevel)
 	plugin_run_hooks(HOOK_RUNLEVEL_CHANGE);  /* Reconfigure HW/VLANs/etc here */
 
 	_d("Starting services services new to this runlevel ...");
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
 #ifndef INETD_DISABLED
 		/* Inetd services have slightly different semantics */
 		if (svc_is_inetd(svc)) {
@@ -583,6 +923,15 @@ void service_runlevel(int newlevel)
 		svc_dance(svc);
 	}
 
+	/* Shutdown kills everything, let run/task stanzas complete first */
+	if (0 == runlevel || 6 == runlevel) {
+		dag_sync();
+		dag_run();
+		dag_wait();
+	} else {
+		dag_run();
+	}
+
 	/* Cleanup stale services */
 	svc_clean_dynamic(service_unregister);
 
@@ -605,68 +954,53 @@ void service_runlevel(int newlevel)
 		tty_runlevel(runlevel);
 }
 
-/**
- * service_register - Register service, task or run commands
- * @type:     %SVC_TYPE_SERVICE(0), %SVC_TYPE_TASK(1), %SVC_TYPE_RUN(2)
- * @line:     A complete command line with -- separated description text
- * @mtime:    The modification time if service is loaded from /etc/finit.d
- * @username: Optional username to run service as, or %NULL to run as root
- *
- * This function is used to register commands to be run on different
- * system runlevels with optional username.  The @type argument details
- * if it's service to bo monitored/respawned (daemon), a one-shot task
- * or a command that must run in sequence and not in parallell, like
- * service and task commands do.
- *
- * The @line can optionally start with a username, denoted by an @
- * character. Like this:
- *
- *     service @username [!0-6,S] <!EV> /path/to/daemon arg -- Description
- *     task @username [!0-6,S] /path/to/task arg            -- Description
- *     run  @username [!0-6,S] /path/to/cmd arg             -- Description
- *     inetd tcp/ssh nowait [2345] @root:root /sbin/sshd -i -- Description
- *
- * If the username is left out the command is started as root.  The []
- * brackets denote the allowed runlevels, if left out the default for a
- * service is set to [2-5].  Allowed runlevels mimic that of SysV init
- * with the addition of the 'S' runlevel, which is only run once at
- * startup.  It can be seen as the system bootstrap.  If a task or run
- * command is listed in more than the [S] runlevel they will be called
- * when changing runlevel.
- *
- * Services (daemons, not inetd services) also support an optional <!EV>
- * argument.  This is for services that, e.g., require a system gateway
- * or interface to be up before they are started.  Or restarted, or even
- * SIGHUP'ed, when the gateway changes or interfaces come and go.  The
- * special case when a service is declared with <!> means it does not
- * support SIGHUP but must be STOP/START'ed at system reconfiguration.
- *
- * Supported service events are: GW, IFUP[:ifname], IFDN[:ifname], where
- * the interface name (:ifname) is optional.  Actully, the check with a
- * service event declaration is string based, so 'IFUP:ppp' will match
- * any of "IFUP:ppp0" or "IFUP:pppoe1" sent by the netlink.so plugin.
- *
- * For multiple instances of the same command, e.g. multiple DHCP
- * clients, the user must enter an ID, using the :ID syntax.
- *
- *     service :1 /sbin/udhcpc -i eth1
- *     service :2 /sbin/udhcpc -i eth2
- *
- * Without the :ID syntax Finit will overwrite the first service line
- * with the contents of the second.  The :ID must be [1,MAXINT].
- *
- * Returns:
- * POSIX OK(0) on success, or non-zero errno exit status on failure.
+/*
+ * Parse restart:N[/T], backoff:MIN[,MAX] and kill:SEC from a stanza,
+ * resetting to defaults for any that are not given.
  */
-int service_register(int type, char *line, time_t mtime, char *username)
+static void service_policy(svc_t *svc, char *restart, char *backoff, char *kill)
+{
+	svc->restart_max    = RESTART_MAX;
+	svc->restart_window = RESTART_WINDOW;
+	svc->backoff_min    = BACKOFF_MIN;
+	svc->backoff_max    = BACKOFF_MAX;
+	svc->kill_tmo       = kill ? atoi(kill) : KILL_TIMEOUT;
+
+	if (restart) {
+		char *ptr = strchr(restart, '/');
+
+		svc->restart_max = atoi(restart);
+		svc->restart_window = ptr ? atoi(++ptr) : 0;
+	}
+
+	if (backoff) {
+		char *ptr = strchr(backoff, ',');
+
+		svc->backoff_min = atoi(backoff);
+		svc->backoff_max = ptr ? atoi(++ptr) : BACKOFF_MAX;
+		if (svc->backoff_max < svc->backoff_min)
+			svc->backoff_max = svc->backoff_min;
+	}
+}
+
+/* Register one service, @tmpl is set for instances of a :FIRST-LAST range */
+static int do_register(int type, char *line, time_t mtime, char *username, char *tmpl)
 {
 	int i = 0;
 	int id = 1;		/* Default to ID:1 */
+	char *args[MAX_NUM_SVC_ARGS];
 #ifndef INETD_DISABLED
 	int forking = 0;
 #endif
 	char *service = NULL, *proto = NULL, *ifaces = NULL;
 	char *cmd, *desc, *runlevels = NULL, *events = NULL;
+	char *restart = NULL, *backoff = NULL, *kill = NULL;
+	char *requires = NULL, *provides = NULL, *after = NULL;
+	char *ready = NULL, *listen = NULL, *cgroup = NULL, *logfile = NULL;
+	char *probe = NULL, check[LINE_SIZE], *heartbeat = NULL, *schedule = NULL;
+	svc_sched_t sched;
+	spawn_attr_t attr;
+	uint32_t hash;
 	svc_t *svc;
 	plugin_t *plugin = NULL;
 
@@ -674,6 +1008,8 @@ int service_register(int type, char *line, time_t mtime, char *username)
 		_e("Invalid input argument.");
 		return errno = EINVAL;
 	}
+	memset(&attr, 0, sizeof(attr));
+	hash = svc_hash(line);
 
 	desc = strstr(line, "-- ");
 	if (desc)
@@ -687,7 +1023,33 @@ int service_register(int type, char *line, time_t mtime, char *username)
 	}
 
 	while (cmd) {
-		if (cmd[0] != '/' && strchr(cmd, '/'))
+		if (!strncasecmp(cmd, "restart:", 8))	/* restart:N/T */
+			restart = &cmd[8];
+		else if (!strncasecmp(cmd, "backoff:", 8))	/* backoff:MIN,MAX */
+			backoff = &cmd[8];
+		else if (!strncasecmp(cmd, "kill:", 5))	/* kill:SEC */
+			kill = &cmd[5];
+		else if (!strncasecmp(cmd, "requires:", 9))	/* requires:NAME[,NAME] */
+			requires = &cmd[9];
+		else if (!strncasecmp(cmd, "provides:", 9))	/* provides:NAME[,NAME] */
+			provides = &cmd[9];
+		else if (!strncasecmp(cmd, "after:", 6))	/* after:NAME[,NAME] */
+			after = &cmd[6];
+		else if (!strncasecmp(cmd, "ready:", 6))	/* ready:notify|/path[,SEC] */
+			ready = &cmd[6];
+		else if (!strncasecmp(cmd, "listen:", 7))	/* listen:SPEC[,SPEC][,lazy] */
+			listen = &cmd[7];
+		else if (!strncasecmp(cmd, "cgroup:", 7))	/* cgroup:KEY=VAL[,KEY=VAL] */
+			cgroup = &cmd[7];
+		else if (!strncasecmp(cmd, "log:", 4))	/* log:/path[,size:N][,count:M] */
+			logfile = &cmd[4];
+		else if (!strncasecmp(cmd, "probe:", 6))	/* probe:TYPE:TARGET[,OPT:VAL] */
+			probe = &cmd[6];
+		else if (!strncasecmp(cmd, "heartbeat:", 10))	/* heartbeat:restart|reboot */
+			heartbeat = &cmd[10];
+		else if (spawn_attr(&attr, cmd) != ENOENT)
+			;	/* cpus:, nice:, sched:, ... may contain '/' */
+		else if (cmd[0] != '/' && strchr(cmd, '/'))
 			service = cmd;   /* inetd service/proto */
 #ifndef INETD_DISABLED
 		else if (!strncasecmp(cmd, "nowait", 6))
@@ -695,6 +1057,9 @@ int service_register(int type, char *line, time_t mtime, char *username)
 		else if (!strncasecmp(cmd, "wait", 4))
 			forking = 0;
 #endif
+		else if (cmd[0] == '@' && !schedule &&
+			 (type == SVC_TYPE_CRON || type == SVC_TYPE_AT))
+			schedule = &cmd[1];	/* @SCHEDULE, see cron_parse() */
 		else if (cmd[0] == '@')	/* @username[:group] */
 			username = &cmd[1];
 		else if (cmd[0] == '[')	/* [runlevels] */
@@ -712,6 +1077,14 @@ int service_register(int type, char *line, time_t mtime, char *username)
 			goto incomplete;
 	}
 
+	/* Example: cron @*-*-*T03:00 /sbin/logrotate */
+	if (type == SVC_TYPE_CRON || type == SVC_TYPE_AT) {
+		if (!schedule || cron_parse(schedule, &sched)) {
+			_e("Missing or invalid schedule for %s, skipping.", cmd);
+			return errno = EINVAL;
+		}
+	}
+
 	/* Example: inetd ssh/tcp@eth0,eth1 or 222/tcp@eth2 */
 	if (service) {
 		ifaces = strchr(service, '@');
@@ -764,11 +1137,79 @@ int service_register(int type, char *line, time_t mtime, char *username)
 	}
 
 	/* New, recently modified or unchanged ... used on reload. */
-	svc_check_dirty(svc, mtime);
+	svc_check_dirty(svc, mtime, hash);
+	service_policy(svc, restart, backoff, kill);
+	svc_priv(svc)->attr = attr;
+	if (svc_set_deps(svc, requires, provides, after))
+		_pe("Failed saving dependencies for %s", svc->cmd);
+
+	svc->ready_tmo = READY_TIMEOUT;
+	if (ready) {
+		char *ptr = strchr(ready, ',');
+
+		if (ptr) {
+			*ptr++ = 0;
+			svc->ready_tmo = atoi(ptr);
+		}
+		if (svc->ready_tmo <= 0)
+			svc->ready_tmo = READY_TIMEOUT;
+	}
+	if (svc_set_ready(svc, ready))
+		_pe("Failed saving readiness for %s", svc->cmd);
+
+	/* Limits are applied when the service is started */
+	if (svc_set_cgroup(svc, cgroup))
+		_pe("Failed saving cgroup settings for %s", svc->cmd);
+
+	/* Takes effect when the service is (re)started */
+	if (logfile) {
+		char path[PATH_MAX];
+		off_t size;
+		int count;
+
+		if (logbuf_parse(logfile, path, sizeof(path), &size, &count)) {
+			_e("Invalid log:%s for %s, logging to memory", logfile, svc->cmd);
+			logfile = NULL;
+		}
+	}
+	if (svc_set_log(svc, logfile))
+		_pe("Failed saving log file for %s", svc->cmd);
+
+	/* Checked from a timer while the service runs, see probe.c */
+	if (probe && probe_parse(svc, probe, check, sizeof(check))) {
+		_e("Invalid probe:%s for %s, ignoring", probe, svc->cmd);
+		probe = NULL;
+	}
+	if (svc_set_probe(svc, probe ? check : NULL))
+		_pe("Failed saving health check for %s", svc->cmd);
+
+	/* Process may subscribe to the watchdog, see wdog.c */
+	if (heartbeat && strcmp(heartbeat, "restart") && strcmp(heartbeat, "reboot"))
+		_e("Invalid heartbeat:%s for %s, using restart", heartbeat, svc->cmd);
+	svc->wdog_reboot = heartbeat && !strcmp(heartbeat, "reboot");
+
+	/* Only a new or changed job is (re)scheduled, so at jobs run once */
+	if (svc_is_cron(svc) && svc_is_updated(svc)) {
+		svc->sched = sched;
+		cron_add(svc);
+	}
+
+	/* Instance of a :FIRST-LAST range, see service_scale() */
+	if (svc_set_template(svc, tmpl))
+		_pe("Failed saving template for %s", svc->cmd);
+
+	/* Changed sockets are bound again when the service is started */
+	if (strcmp(svc_listen(svc), listen ? listen : "")) {
+		sock_close(svc);
+		if (svc_set_listen(svc, listen))
+			_pe("Failed saving sockets for %s", svc->cmd);
+	}
 
 	if (desc)
-		strlcpy(svc->desc, desc + 3, sizeof(svc->desc));
+		svc_set_desc(svc, desc + 3);
 
+	/* Resolved here, and on reload, not in the child of every spawn */
+	svc->username[0] = svc->group[0] = 0;
 	if (username) {
 		char *ptr = strchr(username, ':');
 
@@ -778,15 +1219,25 @@ int service_register(int type, char *line, time_t mtime, char *username)
 		}
 		strlcpy(svc->username, username, sizeof(svc->username));
 	}
+	if (spawn_cred(&svc_priv(svc)->cred, svc->username, svc->group))
+		_e("Unknown user %s or group %s for %s, retrying at start", svc->username,
+		   svc->group[0] ? svc->group : "(default)", svc->cmd);
 
 	if (plugin) {
 		/* Internal plugin provides this service */
 		svc->inetd.cmd = plugin->inetd.cmd;
 	} else {
-		strlcpy(svc->args[i++], cmd, sizeof(svc->args[0]));
-		while ((cmd = strtok(NULL, " ")))
-			strlcpy(svc->args[i++], cmd, sizeof(svc->args[0]));
-		svc->args[i][0] = 0;
+		args[i++] = cmd;
+		while ((cmd = strtok(NULL, " "))) {
+			if (i == NELEMS(args) - 1) {
+				_e("Too many arguments to %s, skipping %s ...", svc->cmd, cmd);
+				break;
+			}
+			args[i++] = cmd;
+		}
+
+		if (svc_set_args(svc, args, i))
+			_pe("Failed saving arguments for %s", svc->cmd);
 
 		plugin = plugin_find(svc->cmd);
 		if (plugin && plugin->svc.cb) {
@@ -834,18 +1285,400 @@ int service_register(int type, char *line, time_t mtime, char *username)
 	return 0;
 }
 
+/* Find :FIRST-LAST before the command, @tmpl is @line without it */
+static int instance_range(char *line, char *tmpl, size_t len, int *first, int *last)
+{
+	char *ptr = line;
+
+	while (*ptr) {
+		char *end;
+		size_t tok;
+
+		ptr += strspn(ptr, " ");
+		tok  = strcspn(ptr, " ");
+		if (!tok || ptr[0] == '/' || (tok == 2 && !strncmp(ptr, "--", 2)))
+			break;
+
+		if (ptr[0] == ':' && isdigit(ptr[1])) {
+			*first = strtol(&ptr[1], &end, 10);
+			if (*end++ != '-' || !isdigit(*end))
+				return 0;
+
+			*last = strtol(end, &end, 10);
+			if (end != &ptr[tok] || *first < 1 || *last < *first ||
+			    *last - *first >= MAX_NUM_INSTANCES)
+				return 0;
+
+			if ((size_t)(ptr - line) + strlen(&ptr[tok]) >= len)
+				return 0;
+
+			snprintf(tmpl, len, "%.*s%s", (int)(ptr - line), line, &ptr[tok]);
+			return 1;
+		}
+
+		ptr += tok;
+	}
+
+	return 0;
+}
+
+/* Line of instance @id: ":ID " and @tmpl with each %i replaced by ID */
+static int instance_line(char *tmpl, int id, char *buf, size_t len)
+{
+	size_t pos;
+
+	pos = snprintf(buf, len, ":%d ", id);
+	while (*tmpl && pos < len) {
+		if (!strncmp(tmpl, "%i", 2)) {
+			pos += snprintf(&buf[pos], len - pos, "%d", id);
+			tmpl += 2;
+		} else {
+			buf[pos++] = *tmpl++;
+		}
+	}
+	if (pos >= len)
+		return errno = E2BIG;
+	buf[pos] = 0;
+
+	return 0;
+}
+
+static int register_instance(int type, char *tmpl, int id, time_t mtime, char *username)
+{
+	char line[LINE_SIZE], user[2 * MAX_USER_LEN];
+
+	if (instance_line(tmpl, id, line, sizeof(line))) {
+		_e("Too long command line for instance %d, skipping.", id);
+		return errno;
+	}
+
+	/* Both are modified by do_register() */
+	if (username) {
+		strlcpy(user, username, sizeof(user));
+		username = user;
+	}
+
+	return do_register(type, line, mtime, username, tmpl);
+}
+
+/**
+ * service_register - Register service, task or run commands
+ * @type:     %SVC_TYPE_SERVICE(0), %SVC_TYPE_TASK(1), %SVC_TYPE_RUN(2)
+ * @line:     A complete command line with -- separated description text
+ * @mtime:    The modification time if service is loaded from /etc/finit.d
+ * @username: Optional username to run service as, or %NULL to run as root
+ *
+ * This function is used to register commands to be run on different
+ * system runlevels with optional username.  The @type argument details
+ * if it's service to bo monitored/respawned (daemon), a one-shot task
+ * or a command that must run in sequence and not in parallell, like
+ * service and task commands do.
+ *
+ * The @line can optionally start with a username, denoted by an @
+ * character. Like this:
+ *
+ *     service @username [!0-6,S] <!EV> /path/to/daemon arg -- Description
+ *     task @username [!0-6,S] /path/to/task arg            -- Description
+ *     run  @username [!0-6,S] /path/to/cmd arg             -- Description
+ *     inetd tcp/ssh nowait [2345] @root:root /sbin/sshd -i -- Description
+ *     cron @*-*-*T03:00 @username [2345] /path/to/cmd arg  -- Description
+ *     at   @2025-12-24T18:00 [2345] /path/to/cmd arg       -- Description
+ *
+ * If the username is left out the command is started as root.  The []
+ * brackets denote the allowed runlevels, if left out the default for a
+ * service is set to [2-5].  Allowed runlevels mimic that of SysV init
+ * with the addition of the 'S' runlevel, which is only run once at
+ * startup.  It can be seen as the system bootstrap.  If a task or run
+ * command is listed in more than the [S] runlevel they will be called
+ * when changing runlevel.
+ *
+ * Cron and at jobs start with their schedule, see cron_parse(), they
+ * are only started when due and in an allowed runlevel.
+ *
+ * Services (daemons, not inetd services) also support an optional <!EV>
+ * argument.  This is for services that, e.g., require a system gateway
+ * or interface to be up before they are started.  Or restarted, or even
+ * SIGHUP'ed, when the gateway changes or interfaces come and go.  The
+ * special case when a service is declared with <!> means it does not
+ * support SIGHUP but must be STOP/START'ed at system reconfiguration.
+ *
+ * Supported service events are: GW and IFUP:ifname, all of which must
+ * be up for the service to run.  They are compiled to conditions when
+ * registered, see event_compile(), so an event from the netlink.so
+ * plugin only concerns the services requiring it.
+ *
+ * For multiple instances of the same command, e.g. multiple DHCP
+ * clients, the user must enter an ID, using the :ID syntax.
+ *
+ *     service :1 /sbin/udhcpc -i eth1
+ *     service :2 /sbin/udhcpc -i eth2
+ *
+ * Without the :ID syntax Finit will overwrite the first service line
+ * with the contents of the second.  The :ID must be [1,MAXINT].
+ *
+ * A pool of identical services can instead be declared with a range of
+ * IDs, :FIRST-LAST, each %i in the line is replaced with the ID of the
+ * instance.  The number of instances can be changed at runtime with
+ * service_scale().
+ *
+ *     service :1-8 /usr/sbin/worker --id %i -- Worker %i
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno exit status on failure.
+ */
+int service_register(int type, char *line, time_t mtime, char *username)
+{
+	char tmpl[LINE_SIZE];
+	int id, first, last, rc = 0;
+
+	if (!line || type != SVC_TYPE_SERVICE ||
+	    !instance_range(line, tmpl, sizeof(tmpl), &first, &last))
+		return do_register(type, line, mtime, username, NULL);
+
+	for (id = first; id <= last; id++) {
+		if (register_instance(type, tmpl, id, mtime, username))
+			rc = errno;
+	}
+
+	return rc;
+}
+
+/**
+ * service_scale - Change the number of instances of a service
+ * @name: Name of service, the basename of its command
+ * @num:  Number of instances to run, ID 1 to @num
+ *
+ * Only for services declared with a :FIRST-LAST range of IDs.  Missing
+ * instances are registered from the same line, and are removed again at
+ * reload if not in the range.  Instances above @num are stopped like
+ * with initctl stop.  All are started and stopped in parallel, without
+ * waiting for any of them.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if @name is not declared with a range.
+ */
+int service_scale(char *name, int num)
+{
+	char tmpl[LINE_SIZE] = "", user[2 * MAX_USER_LEN] = "";
+	svc_iter_t iter;
+	time_t mtime = 0;
+	svc_t *svc;
+	int id;
+
+	for (svc = svc_named_iterator(&iter, 1, name); svc; svc = svc_named_iterator(&iter, 0, name)) {
+		if (!svc_template(svc)[0])
+			continue;
+
+		strlcpy(tmpl, svc_template(svc), sizeof(tmpl));
+		if (svc->username[0])
+			snprintf(user, sizeof(user), "%s%s%s", svc->username,
+				 svc->group[0] ? ":" : "", svc->group);
+		mtime = svc->mtime;
+		break;
+	}
+	if (!tmpl[0])
+		return errno = EINVAL;
+
+	for (svc = svc_named_iterator(&iter, 1, name); svc; svc = svc_named_iterator(&iter, 0, name)) {
+		if (svc->id <= num || svc->state == SVC_PAUSED_STATE)
+			continue;
+
+		/* Also if not running, so it is not started at runlevel change */
+		service_stop(svc, SVC_PAUSED_STATE);
+		svc->state = SVC_PAUSED_STATE;
+	}
+
+	/* Registering may grow the table, so no iterator here */
+	for (id = 1; id <= num; id++) {
+		svc = svc_find_by_nameid(name, id);
+		if (!svc) {
+			if (register_instance(SVC_TYPE_SERVICE, tmpl, id, mtime, user[0] ? user : NULL))
+				continue;
+
+			svc = svc_find_by_nameid(name, id);
+			if (!svc)
+				continue;
+		}
+
+		if (svc->pid > 0)
+			continue;
+
+		if (svc->state == SVC_PAUSED_STATE)
+			svc->state = SVC_HALTED_STATE;
+		if (service_enabled(svc, 0, NULL) == SVC_START)
+			service_start(svc);
+	}
+
+	return 0;
+}
+
+static void service_respawn_cb(uev_t *w, void *arg, int UNUSED(events))
+{
+	svc_t *svc = arg;
+
+	uev_timer_stop(w);
+
+	if (svc->pid || fexist(SYNC_SHUTDOWN) || is_norespawn())
+		return;
+
+	svc_update_begin();
+	if (service_enabled(svc, 0, NULL))
+		service_start(svc);
+	svc_update_end();
+}
+
+/*
+ * Restart a lost service according to its restart policy.  The restart
+ * counter works as a leaky bucket, one restart is forgiven every
+ * restart_window / restart_max seconds, so a service is only given up
+ * on if it crashes more than restart_max times within restart_window.
+ * Repeated restarts are delayed, doubling from backoff_min, using a
+ * timer so we never block or busy loop in PID 1.
+ */
+static void service_respawn(svc_t *svc)
+{
+	int64_t now = now_ms();
+	int delay = 0;
+
+	if (svc->restart_window > 0 && svc->restart_max > 0 && svc->restart_counter) {
+		int64_t step = (int64_t)svc->restart_window * 1000 / svc->restart_max;
+		int64_t num  = (now - svc->restart_tm) / step;
+
+		if (num >= svc->restart_counter)
+			svc->restart_counter = 0;
+		else
+			svc->restart_counter -= num;
+		svc->restart_tm += num * step;
+	}
+	if (!svc->restart_counter)
+		svc->restart_tm = now;
+
+	if (svc->restart_counter >= (unsigned int)svc->restart_max) {
+		_e("Not restarting %s id %d, max %d restarts within %d sec reached!",
+		   svc->cmd, svc->id, svc->restart_max, svc->restart_window);
+		return;
+	}
+
+	if (svc->restart_counter && svc->backoff_min > 0) {
+		unsigned int i;
+
+		delay = svc->backoff_min;
+		for (i = 1; i < svc->restart_counter && delay < svc->backoff_max; i++)
+			delay *= 2;
+		if (delay > svc->backoff_max)
+			delay = svc->backoff_max;
+	}
+	svc->restart_counter++;
+
+	if (!delay) {
+		service_start(svc);
+		return;
+	}
+
+	_d("Restarting %s id %d in %d sec ...", svc->cmd, svc->id, delay);
+	uev_timer_stop(&svc_priv(svc)->restart_timer);
+	if (uev_timer_init(ctx, &svc_priv(svc)->restart_timer, service_respawn_cb, svc, delay * 1000, 0)) {
+		_pe("Failed delaying restart of %s, restarting now", svc->cmd);
+		service_start(svc);
+	}
+}
+
 void service_unregister(svc_t *svc)
 {
 	if (svc->state != SVC_HALTED_STATE)
 		_e("Failed stopping %s, removing anyway from list of monitored services.", svc->cmd);
+	if (svc->pid > 0)
+		pid_untrack(svc->pid, NULL);
+	uev_timer_stop(&svc_priv(svc)->restart_timer);
+	uev_timer_stop(&svc_priv(svc)->kill_timer);
+	ready_cancel(svc);
+	probe_cancel(svc);
+	wdog_cancel(svc);
+	cron_del(svc);
+	event_forget(svc);
+	plugin_svc_forget(svc);
+	sock_close(svc);
+	logbuf_close(svc);
+	if (svc_is_daemon(svc))
+		cgroup_remove(svc);
+	dag_done(svc, 0);
 	svc_del(svc);
 }
 
-void service_monitor(pid_t lost)
+/**
+ * service_callback - Handle reply from a service plugin callback
+ * @svc:   Service the callback was called for
+ * @event: Event passed to the callback
+ * @gen:   Event generation when the call was queued
+ * @cmd:   Result from the callback
+ *
+ * Caches the result, see service_enabled(), then starts, stops, or
+ * reloads @svc accordingly.  If events have changed since the call was
+ * queued the callback is asked again.
+ */
+void service_callback(svc_t *svc, int event, unsigned int gen, svc_cmd_t cmd)
+{
+	svc->cb_gen   = gen;
+	svc->cb_event = event;
+	svc->cb_cmd   = cmd;
+
+	svc_update_begin();
+	svc_dance(svc);
+	dag_run();
+	svc_update_end();
+}
+
+/*
+ * A run/task has been collected, print result of run commands and
+ * let the startup graph start anything that waited for it.  Same for
+ * a service that exits before it is ready.
+ */
+static void service_collect(svc_t *svc, pid_t lost, int status)
+{
+	int fail = !WIFEXITED(status) || WEXITSTATUS(status);
+
+	if (lost != svc->pid || svc_is_inetd(svc))
+		return;
+
+	/* Exited before it was ready */
+	if (svc_is_daemon(svc)) {
+		if (svc->state == SVC_STARTING_STATE) {
+			_e("Service %s exited before it was ready", svc->cmd);
+			service_ready(svc, 0);
+		}
+		return;
+	}
+
+	if (SVC_TYPE_RUN == svc->type && verbose) {
+		print_desc("Starting ", svc_desc(svc));
+		print_result(fail);
+	}
+
+	svc_priv(svc)->done = !fail;
+	dag_done(svc, !fail);
+}
+
+void service_monitor(pid_t lost, int status)
 {
 	svc_t *svc;
+	void *obj = NULL;
+	pid_type_t type = PID_TYPE_NONE;
 	static int was_stopped = 0;
 
+	/* Collected, so forget about it regardless of what happens next */
+	if (lost > 1)
+		obj = pid_untrack(lost, &type);
+	if (PID_TYPE_SVC == type)
+		service_collect(obj, lost, status);
+	if (PID_TYPE_PROBE == type) {
+		probe_collect(obj, lost, status);
+		return;
+	}
+	if (PID_TYPE_LOG == type) {
+		logbuf_collect(lost);
+		return;
+	}
+
 	if (was_stopped && !is_norespawn()) {
 		was_stopped = 0;
 		restart_lost_procs();
@@ -861,53 +1694,72 @@ void service_monitor(pid_t lost)
 		return;
 	}
 
-	if (tty_respawn(lost))
+	switch (type) {
+	case PID_TYPE_TTY:
+		tty_respawn(obj);
+		return;
+
+	case PID_TYPE_SVC:
+		svc = obj;
+		break;
+
+	default:
+		_d("Collected unknown PID %d, orphan?", lost);
 		return;
+	}
 
 #ifndef INETD_DISABLED
-	if (inetd_respawn(lost))
+	if (svc_is_inetd(svc)) {
+		inetd_respawn(&svc->inetd, lost);
 		return;
+	}
 #endif
 
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
-		if (lost != svc->pid)
-			continue;
-
-		if (!prevlevel && svc_clean_bootstrap(svc))
-			continue;
+	if (lost != svc->pid)
+		return;
 
-		if (SVC_TYPE_SERVICE != svc->type) {
-			svc->pid = 0;
-			continue;
-		}
+	/* Run again when due, see cron.c */
+	if (svc_is_cron(svc)) {
+		svc->pid = 0;
+		cron_collect(svc);
+		return;
+	}
 
-		_d("Ouch, lost pid %d - %s(%d)", lost, basename(svc->cmd), svc->pid);
+	if (!prevlevel && svc_clean_bootstrap(svc, service_unregister))
+		return;
 
-		/* No longer running, update books. */
+	if (SVC_TYPE_SERVICE != svc->type) {
 		svc->pid = 0;
+		return;
+	}
 
-		/* Check if we're still collecting stopped dynamic services */
-		if (service_stop_done(svc))
-			break;
+	_d("Ouch, lost pid %d - %s(%d)", lost, basename(svc->cmd), svc->pid);
 
-		if (sig_stopped()) {
-			_e("Stopped, not respawning killed processes.");
-			break;
-		}
+	/* No longer running, update books. */
+	uev_timer_stop(&svc_priv(svc)->kill_timer);
+	probe_cancel(svc);
+	wdog_cancel(svc);
+	svc->pid = 0;
 
-		/* Restarting lost service. */
-		if (service_enabled(svc, 0, NULL)) {
-			if (svc->restart_counter > RESPAWN_MAX) {
-				_e("Not restarting %s id %d, respawn MAX (%d) reached!",
-				   svc->cmd, svc->id, RESPAWN_MAX);
-				break;
-			}
+	/* Reap anything it left behind, e.g. double-forked processes */
+	cgroup_kill(svc);
 
-			svc->restart_counter++;
-			service_start(svc);
-		}
+	/* Stopped by reload, started again by service_start_dynamic() */
+	if (reload_collect(svc))
+		return;
 
-		break;
+	if (sig_stopped()) {
+		_e("Stopped, not respawning killed processes.");
+		return;
+	}
+
+	/* Restarting lost service. */
+	if (service_enabled(svc, 0, NULL)) {
+		/* On demand service exited cleanly, wait for more traffic */
+		if (svc->lazy && WIFEXITED(status) && !WEXITSTATUS(status))
+			service_start(svc);
+		else
+			service_respawn(svc);
 	}
 }
 
@@ -921,8 +1773,9 @@ static int is_norespawn(void)
 static void restart_lost_procs(void)
 {
 	svc_t *svc;
+	svc_iter_t iter;
 
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
 		if (svc->pid > 0 && pid_alive(svc->pid))
 			continue;
 
@@ -936,11 +1789,18 @@ static void restart_lost_procs(void)
 	}
 }
 
-/* Singing and dancing ... */
+/* Singing and dancing ... new services are started by dag_run() */
 static void svc_dance(svc_t *svc)
 {
 	svc_cmd_t cmd = service_enabled(svc, 0, NULL);
 
+	/* Cron and at jobs are only started when due, see cron.c */
+	if (svc_is_cron(svc)) {
+		if (svc->pid && SVC_STOP == cmd)
+			service_stop(svc, SVC_HALTED_STATE);
+		return;
+	}
+
 	if (svc->pid) {
 		if (SVC_STOP == cmd)
 			service_stop(svc, SVC_HALTED_STATE);
@@ -948,7 +1808,7 @@ static void svc_dance(svc_t *svc)
 			service_reload(svc);
 	} else {
 		if (SVC_START == cmd || SVC_RELOAD == cmd)
-			service_start(svc);
+			dag_add(svc);
 	}
 }
 
@@ -956,8 +1816,9 @@ static void svc_dance(svc_t *svc)
 static svc_t *find_inetd_svc(char *path, char *service, char *proto)
 {
 	svc_t *svc;
+	svc_iter_t iter;
 
-	for (svc = svc_inetd_iterator(1); svc; svc = svc_inetd_iterator(0)) {
+	for (svc = svc_inetd_iterator(&iter, 1); svc; svc = svc_inetd_iterator(&iter, 0)) {
 		if (strncmp(path, svc->cmd, strlen(svc->cmd)))
 			continue;
 
@@ -29,6 +29,7 @@
 
 void	  service_runlevel	 (int newlevel);
 int	  service_register	 (int type, char *line, time_t mtime, char *username);
+int       service_scale          (char *name, int num);
 void      service_unregister     (svc_t *svc);
 svc_cmd_t service_enabled	 (svc_t *svc, int event, void *arg);
 
@@ -38,7 +39,11 @@ void      service_start_dynamic  (void);
 void      service_stop_dynamic   (void);
 int       service_restart        (svc_t *svc);
 int	  service_reload	 (svc_t *svc);
+void      service_ready          (svc_t *svc, int ok);
+void      service_unhealthy      (svc_t *svc);
 void      service_reload_dynamic (void);
+void      service_reload_check   (void);
+int       service_reload_busy    (int *result);
 
 #endif	/* FINIT_SERVICE_H_ */
 
@@ -51,6 +51,7 @@
 #include "private.h"
 #include "sig.h"
 #include "service.h"
+#include "wdog.h"
 #include "libite/lite.h"
 
 static int   stopped = 0;
@@ -99,6 +100,7 @@ void do_shutdown(int sig)
 	if (sig == SIGINT || sig == SIGUSR1)
 		reboot(RB_AUTOBOOT);
 
+	wdog_exit();
 	reboot(RB_POWER_OFF);
 }
 
@@ -108,7 +110,9 @@ void do_shutdown(int sig)
 static void sighup_cb(uev_t *UNUSED(w), void *UNUSED(arg), int UNUSED(events))
 {
 	/* INIT_CMD_RELOAD: 'init q', 'initctl reload', and SIGHUP */
+	svc_update_begin();
 	service_reload_dynamic();
+	svc_update_end();
 }
 
 /*
@@ -125,15 +129,18 @@ static void sigint_cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
 static void sigchld_cb(uev_t *UNUSED(w), void *UNUSED(arg), int UNUSED(events))
 {
 	pid_t pid;
+	int status;
 
 	/* Reap all the children! */
+	svc_update_begin();
 	do {
-		pid = waitpid(-1, NULL, WNOHANG);
+		pid = waitpid(-1, &status, WNOHANG);
 		if (pid > 0) {
 			_d("Collected child %d", pid);
-			service_monitor(pid);
+			service_monitor(pid, status);
 		}
 	} while (pid > 0);
+	svc_update_end();
 }
 
 /*
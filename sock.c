@@ -0,0 +1,312 @@
+/* Socket activation, sockets bound by Finit and passed to services
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "config.h"		/* Generated by configure script */
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "libite/lite.h"
+#include "libuev/uev.h"
+
+#include "finit.h"
+#include "helpers.h"
+#include "private.h"
+#include "service.h"
+#include "sock.h"
+
+#define SOCK_MODE 0666		/* Like sockets in /run, before the service */
+
+/* Port number, or name in /etc/services, of a PORT/PROTO socket */
+static int sock_port(char *port, char *proto)
+{
+	const char *errstr;
+	int num;
+#ifndef ENABLE_STATIC
+	struct servent *sv;
+#endif
+
+	num = strtonum(port, 1, UINT16_MAX, &errstr);
+	if (!errstr)
+		return num;
+
+#ifdef ENABLE_STATIC
+	(void)proto;
+	num = fgetint("/etc/services", " \n\t", port);
+#else
+	sv = getservbyname(port, proto);
+	num = sv ? ntohs(sv->s_port) : -1;
+#endif
+
+	return num > 0 ? num : -1;
+}
+
+/* Bind and listen to /path/to/unix/socket, or PORT/tcp or PORT/udp */
+static int sock_bind(svc_t *svc, char *spec)
+{
+	struct sockaddr_storage ss;
+	struct stat st;
+	socklen_t len;
+	int sd, type = SOCK_STREAM, on = 1;
+
+	memset(&ss, 0, sizeof(ss));
+	if (spec[0] == '/') {
+		struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+
+		if (strlen(spec) >= sizeof(sun->sun_path)) {
+			_e("%s: socket path %s too long", svc->cmd, spec);
+			return -1;
+		}
+
+		sun->sun_family = AF_UNIX;
+		strlcpy(sun->sun_path, spec, sizeof(sun->sun_path));
+		len = sizeof(*sun);
+
+		/* Stale from previous boot, or previous instance */
+		if (!lstat(spec, &st)) {
+			if (!S_ISSOCK(st.st_mode)) {
+				_e("%s: %s exists and is not a socket", svc->cmd, spec);
+				return -1;
+			}
+			erase(spec);
+		}
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+		char *proto = strchr(spec, '/');
+		int port;
+
+		if (!proto) {
+			_e("%s: invalid socket %s, expected PORT/PROTO", svc->cmd, spec);
+			return -1;
+		}
+		*proto++ = 0;
+
+		if (!strcmp(proto, "udp"))
+			type = SOCK_DGRAM;
+		else if (strcmp(proto, "tcp")) {
+			_e("%s: unsupported protocol %s", svc->cmd, proto);
+			return -1;
+		}
+
+		port = sock_port(spec, proto);
+		if (port < 0) {
+			_e("%s: unknown port %s/%s", svc->cmd, spec, proto);
+			return -1;
+		}
+
+		sin->sin_family      = AF_INET;
+		sin->sin_addr.s_addr = INADDR_ANY;
+		sin->sin_port        = htons(port);
+		len = sizeof(*sin);
+	}
+
+	/* Close-on-exec, the child of spawn() moves it to fd 3.. */
+	sd = socket(ss.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		_pe("%s: failed opening socket", svc->cmd);
+		return -1;
+	}
+
+	if (ss.ss_family == AF_INET)
+		setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (bind(sd, (struct sockaddr *)&ss, len) < 0) {
+		_pe("%s: failed binding socket", svc->cmd);
+		goto error;
+	}
+
+	/* Not our umask, clients of an @user service need not be root */
+	if (ss.ss_family == AF_UNIX) {
+		spawn_cred_t *cred = &svc_priv(svc)->cred;
+
+		if (chmod(spec, SOCK_MODE))
+			_pe("%s: failed setting mode of %s", svc->cmd, spec);
+		if (cred->uid != (uid_t)-1 && chown(spec, cred->uid, cred->gid))
+			_pe("%s: failed setting owner of %s", svc->cmd, spec);
+	}
+
+	if (type == SOCK_STREAM && listen(sd, SOMAXCONN) < 0) {
+		_pe("%s: failed listening on socket", svc->cmd);
+		goto error;
+	}
+
+	return sd;
+error:
+	close(sd);
+	return -1;
+}
+
+static void sock_cb(uev_t *UNUSED(w), void *arg, int UNUSED(events))
+{
+	svc_t *svc = arg;
+
+	/* Only the first traffic starts the service, it takes over from here */
+	sock_cancel(svc);
+	if (svc->pid > 0 || SVC_START != service_enabled(svc, -1, NULL))
+		return;
+
+	_d("Traffic for %s, starting it", svc->cmd);
+	svc->activate = 1;
+	svc_update_begin();
+	service_start(svc);
+	svc_update_end();
+}
+
+/**
+ * sock_open - Bind all listen: sockets of a service
+ * @svc: Service with listen:SPEC[,SPEC][,lazy]
+ *
+ * Does nothing if the sockets are already bound, they are kept open
+ * by PID 1 across restarts of the service.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if any socket could not be bound.
+ */
+int sock_open(svc_t *svc)
+{
+	char buf[LINE_SIZE], *spec, *ptr;
+
+	if (svc->num_sock || !svc_listen(svc)[0])
+		return 0;
+
+	svc->lazy = 0;
+	strlcpy(buf, svc_listen(svc), sizeof(buf));
+	for (spec = strtok_r(buf, ",", &ptr); spec; spec = strtok_r(NULL, ",", &ptr)) {
+		int sd;
+
+		if (!strcmp(spec, "lazy")) {
+			svc->lazy = 1;
+			continue;
+		}
+
+		if (svc->num_sock == MAX_NUM_SVC_SOCK) {
+			_e("%s: too many sockets, max %d", svc->cmd, MAX_NUM_SVC_SOCK);
+			break;
+		}
+
+		sd = sock_bind(svc, spec);
+		if (sd < 0) {
+			sock_close(svc);
+			return 1;
+		}
+
+		svc->sock[svc->num_sock++] = sd;
+	}
+
+	return 0;
+}
+
+/**
+ * sock_close - Close sockets of a removed or changed service
+ * @svc: Service with listen:SPEC[,SPEC][,lazy]
+ */
+void sock_close(svc_t *svc)
+{
+	int i;
+
+	sock_cancel(svc);
+	for (i = 0; i < svc->num_sock; i++)
+		close(svc->sock[i]);
+	svc->num_sock = 0;
+	svc->activate = 0;
+}
+
+/**
+ * sock_init - Bind sockets of all socket activated services
+ *
+ * Called at boot, once the file systems are up, before any service is
+ * started.  Services can then connect to a socket activated service
+ * regardless of the order they are started in.
+ */
+void sock_init(void)
+{
+	svc_t *svc;
+	svc_iter_t iter;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (SVC_TYPE_SERVICE == svc->type)
+			sock_open(svc);
+	}
+}
+
+/**
+ * sock_wait - Wait for traffic before starting a lazy service
+ * @svc: Service about to be started
+ *
+ * Returns:
+ * %TRUE(1) if @svc is started on demand and must not start yet,
+ * otherwise %FALSE(0).
+ */
+int sock_wait(svc_t *svc)
+{
+	int i;
+
+	if (!svc->lazy || !svc->num_sock)
+		return 0;
+
+	if (svc->activate) {
+		svc->activate = 0;
+		return 0;
+	}
+
+	sock_cancel(svc);
+	for (i = 0; i < svc->num_sock; i++) {
+		if (uev_io_init(ctx, &svc_priv(svc)->sock_watcher[i], sock_cb, svc, svc->sock[i], UEV_READ)) {
+			_pe("%s: failed watching socket, starting now", svc->cmd);
+			sock_cancel(svc);
+			return 0;
+		}
+	}
+
+	svc->state = SVC_WAITING_STATE;
+
+	return 1;
+}
+
+/**
+ * sock_cancel - Stop waiting for traffic on the sockets of a service
+ * @svc: Service that is started, stopped, or removed
+ */
+void sock_cancel(svc_t *svc)
+{
+	int i;
+
+	for (i = 0; i < svc->num_sock; i++)
+		uev_io_stop(&svc_priv(svc)->sock_watcher[i]);
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -22,181 +22,1480 @@
  * THE SOFTWARE.
  */
 
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
 #include "libite/lite.h"
 
 #include "finit.h"
 #include "svc.h"
 #include "helpers.h"
 
+/*
+ * Layout of the file in /dev/shm: the table header and its slots, then
+ * the string arena at a fixed offset past the last possible slot.  The
+ * file is sparse, so unused slots cost nothing, and the table can grow
+ * without moving the arena.
+ */
+#define TABLE_LEN(num)  (sizeof(svc_table_t) + (num) * sizeof(svc_t))
+#define ARENA_OFFSET    ((TABLE_LEN(MAX_NUM_SVC) + 4095) & ~4095)
+#define FILE_LEN(arena) (ARENA_OFFSET + (arena))
+
+#define SNAPSHOT_SPIN   100	   /* Retries before backing off, see svc_snapshot() */
+#define SNAPSHOT_TRIES  2000	   /* ~2 sec with 1 ms back-off */
+
+#define ARENA_MIN       16384	   /* Initial size of arena, doubled when full */
+#define ARENA_MAX       (4 * 1024 * 1024)
+#define ARENA_HASH_LEN  256
+#define NAME_HASH_LEN   (MAX_NUM_SVC / 8)
+#define ARENA_START     sizeof(arena_rec_t)	/* Offset 0 means no string */
+#define REC_LEN(len)    ((sizeof(arena_rec_t) + (len) + 3) & ~3)
+
+/*
+ * String arena record, strings are interned so services with the same
+ * arguments or description share one record.  For argv all arguments
+ * are packed, NUL separated, into one record.
+ */
+typedef struct {
+	uint32_t     next;		/* Offset of next record in hash chain */
+	uint16_t     refcnt;
+	uint16_t     len;		/* Length of @str, including NUL */
+	char         str[];
+} arena_rec_t;
+
 /* Each svc_t needs a unique job# */
 static int jobcounter = 1;
 
-static svc_t *__connect_shm(void)
+/* Our view of the shared service table, see svc_init() */
+static struct {
+	int          fd;
+	int          writable;	/* Set in PID 1, initctl maps read-only */
+	int          depth;		/* Nesting of svc_update_begin() in PID 1 */
+	uint32_t     generation;	/* Generation of table when mapped */
+	svc_table_t *shm;		/* The shared mapping */
+	size_t       len;
+
+	/* Table used by iterators, the shared mapping or a snapshot */
+	svc_table_t *table;
+	char        *arena;
+	uint32_t     arena_size;	/* Bytes of arena currently mapped */
+
+	/* Private copy of table, only used by readers */
+	svc_table_t *snap;
+	size_t       snap_len;
+
+	/* State of each slot only used by PID 1, see svc_priv() */
+	svc_priv_t  *priv;
+
+	/* Stack of released slots, only used by PID 1 */
+	uint32_t    *free;
+	uint32_t     nfree, maxfree;
+
+	/* List heads, @next is the first and @prev the last, only in PID 1 */
+	svc_link_t   all;
+	svc_link_t   type[SVC_TYPE_AT + 1];
+	svc_link_t   dynamic;
+	svc_link_t   name[NAME_HASH_LEN];	/* Hashed by basename */
+	svc_link_t   provides;
+	svc_link_t  *job;		/* Indexed by job n:o */
+	int          maxjob;
+
+	/* Hash of interned strings, only used by PID 1 */
+	uint32_t     bucket[ARENA_HASH_LEN];
+} tbl = { .fd = -1 };
+
+#define LIST_INIT_HEAD(h) (h)->prev = (h)->next = -1
+
+static svc_t   *__connect_shm (void);
+static uint32_t __used        (void);
+
+/* FNV-1a */
+static uint32_t fnv1a(const char *str, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Basename of command, without modifying it like basename(3) may */
+static char *cmd_name(const char *cmd)
+{
+	char *ptr = strrchr(cmd, '/');
+
+	return ptr ? ptr + 1 : (char *)cmd;
+}
+
+static int name_hash(const char *name)
+{
+	return fnv1a(name, strlen(name)) % NAME_HASH_LEN;
+}
+
+static void table_view(svc_table_t *table, uint32_t arena_size)
+{
+	tbl.table      = table;
+	tbl.arena      = (char *)table + ARENA_OFFSET;
+	tbl.arena_size = arena_size;
+}
+
+/* Map table from file, used by readers on connect and when PID 1 has
+ * grown the arena */
+static int table_map(void)
+{
+	struct stat st;
+	svc_table_t *table;
+
+	if (fstat(tbl.fd, &st))
+		return -1;
+
+	if ((size_t)st.st_size < FILE_LEN(0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	table = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, tbl.fd, 0);
+	if (MAP_FAILED == table)
+		return -1;
+
+	if (table->magic != FINIT_SHM_MAGIC || table->arena != ARENA_OFFSET) {
+		munmap(table, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (tbl.shm)
+		munmap(tbl.shm, tbl.len);
+
+	tbl.shm        = table;
+	tbl.len        = st.st_size;
+	tbl.generation = table->generation;
+	if (!tbl.snap)
+		table_view(table, st.st_size - ARENA_OFFSET);
+
+	return 0;
+}
+
+/* Extend our read-write mapping to the arena size set by PID 1 */
+static void table_remap(void)
+{
+	int fd;
+	void *ptr;
+	uint32_t size = tbl.table->arena_size;
+
+	fd = open(FINIT_SHM, O_RDWR | O_CLOEXEC);
+	if (-1 == fd) {
+		_pe("Failed re-opening service table");
+		return;
+	}
+
+	ptr = mmap(tbl.table, FILE_LEN(size), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_FIXED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == ptr) {
+		_pe("Failed re-mapping service table");
+		return;
+	}
+
+	tbl.len        = FILE_LEN(size);
+	tbl.arena_size = size;
+}
+
+/* Check if PID 1 has grown the arena since we last mapped it */
+static void table_sync(void)
+{
+	if (tbl.writable) {
+		/* In a process forked from PID 1, e.g. plugin helper */
+		if (tbl.table && tbl.table->arena_size != tbl.arena_size)
+			table_remap();
+		return;
+	}
+
+	if (!tbl.shm || tbl.snap)
+		return;
+
+	if (tbl.shm->generation != tbl.generation && table_map())
+		_pe("Failed re-mapping service table");
+}
+
+/* Double the number of slots, the file already spans all of them */
+static int table_grow(void)
+{
+	uint32_t size = tbl.table->size * 2;
+
+	if (size > MAX_NUM_SVC) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	tbl.table->size = size;
+	_d("Service table grown to %u slots", size);
+
+	return 0;
+}
+
+/* Head of @list, with @key being the type or job n:o for those lists */
+static svc_link_t *list_head(svc_list_t list, int key)
+{
+	switch (list) {
+	case SVC_LIST_TYPE:
+		if (key <= SVC_TYPE_FREE || key > SVC_TYPE_AT)
+			return NULL;
+		return &tbl.type[key];
+
+	case SVC_LIST_JOB:
+		if (key < 0 || key >= tbl.maxjob)
+			return NULL;
+		return &tbl.job[key];
+
+	case SVC_LIST_DYNAMIC:
+		return &tbl.dynamic;
+
+	case SVC_LIST_PROVIDES:
+		return &tbl.provides;
+
+	case SVC_LIST_NAME:
+		if (key < 0 || key >= NAME_HASH_LEN)
+			return NULL;
+		return &tbl.name[key];
+
+	default:
+		break;
+	}
+
+	return &tbl.all;
+}
+
+static int list_key(svc_list_t list, svc_t *svc)
+{
+	if (SVC_LIST_TYPE == list)
+		return svc->type;
+	if (SVC_LIST_JOB == list)
+		return svc->job;
+	if (SVC_LIST_NAME == list)
+		return name_hash(cmd_name(svc->cmd));
+
+	return 0;
+}
+
+/* Job n:o are handed out in sequence, so a flat array of heads will do */
+static int list_job_grow(int job)
+{
+	int i, max = tbl.maxjob ? tbl.maxjob : MIN_NUM_SVC;
+	svc_link_t *ptr;
+
+	while (job >= max)
+		max *= 2;
+
+	ptr = realloc(tbl.job, max * sizeof(svc_link_t));
+	if (!ptr)
+		return 1;
+
+	for (i = tbl.maxjob; i < max; i++)
+		LIST_INIT_HEAD(&ptr[i]);
+
+	tbl.job    = ptr;
+	tbl.maxjob = max;
+
+	return 0;
+}
+
+/* Append @svc to the tail of @list, keeping the order of registration */
+static void list_insert(svc_t *svc, svc_list_t list)
+{
+	int32_t i = svc - tbl.table->list;
+	svc_link_t *head = list_head(list, list_key(list, svc));
+	svc_link_t *link = &svc->link[list];
+
+	LIST_INIT_HEAD(link);
+	if (!head)
+		return;
+
+	link->prev = head->prev;
+	if (-1 == head->prev)
+		head->next = i;
+	else
+		tbl.table->list[head->prev].link[list].next = i;
+	head->prev = i;
+}
+
+static void list_remove(svc_t *svc, svc_list_t list)
+{
+	svc_link_t *head = list_head(list, list_key(list, svc));
+	svc_link_t *link = &svc->link[list];
+
+	if (!head)
+		return;
+
+	if (-1 == link->prev)
+		head->next = link->next;
+	else
+		tbl.table->list[link->prev].link[list].next = link->next;
+
+	if (-1 == link->next)
+		head->prev = link->prev;
+	else
+		tbl.table->list[link->next].link[list].prev = link->prev;
+
+	LIST_INIT_HEAD(link);
+}
+
+/* Readers cannot trust the links while PID 1 may be changing them,
+ * instead they scan all slots, filtering out the ones not on @list */
+static svc_t *list_scan(svc_iter_t *iter, svc_list_t list, int key)
+{
+	while (iter->next >= 0 && (uint32_t)iter->next < __used()) {
+		svc_t *svc = &tbl.table->list[iter->next++];
+
+		if (svc->type == SVC_TYPE_FREE)
+			continue;
+		if (SVC_LIST_DYNAMIC == list && !svc_is_dynamic(svc))
+			continue;
+		if (SVC_LIST_PROVIDES == list && !svc_provides(svc)[0])
+			continue;
+		if ((SVC_LIST_TYPE == list || SVC_LIST_JOB == list || SVC_LIST_NAME == list) &&
+		    list_key(list, svc) != key)
+			continue;
+
+		return svc;
+	}
+
+	return NULL;
+}
+
+/*
+ * Step @iter along @list.  The next entry is looked up before the
+ * current one is returned, so callers may svc_del() what they got.
+ */
+static svc_t *list_walk(svc_iter_t *iter, int first, svc_list_t list, int key)
+{
+	svc_t *svc;
+
+	__connect_shm();
+	if (first) {
+		table_sync();
+		if (tbl.writable) {
+			svc_link_t *head = list_head(list, key);
+
+			iter->next = head ? head->next : -1;
+		} else {
+			iter->next = 0;
+		}
+	}
+
+	if (!tbl.writable)
+		return list_scan(iter, list, key);
+
+	if (iter->next < 0)
+		return NULL;
+
+	svc = &tbl.table->list[iter->next];
+	iter->next = svc->link[list].next;
+
+	return svc;
+}
+
+/* Wall clock time at boot, may change when the system clock is set */
+static int64_t boottime(void)
+{
+	struct sysinfo si;
+
+	if (sysinfo(&si))
+		return 0;
+
+	return (int64_t)time(NULL) - si.uptime;
+}
+
+/**
+ * svc_init - Create service table, called once by PID 1 at boot
+ *
+ * Address space for %MAX_NUM_SVC slots and the largest string arena is
+ * reserved up front, but only the pages touched in the file in /dev/shm
+ * take up memory.  This way the table and the arena can grow without
+ * moving, so &svc_t pointers held by PID 1 and its plugins stay valid.
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero on error.
+ */
+int svc_init(void)
+{
+	size_t i;
+	void *ptr;
+
+	tbl.fd = open(FINIT_SHM, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (-1 == tbl.fd)
+		return 1;
+
+	if (ftruncate(tbl.fd, FILE_LEN(ARENA_MIN)))
+		goto error;
+
+	ptr = mmap(NULL, FILE_LEN(ARENA_MAX), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == ptr)
+		goto error;
+
+	ptr = mmap(ptr, FILE_LEN(ARENA_MIN), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_FIXED, tbl.fd, 0);
+	if (MAP_FAILED == ptr)
+		goto error;
+
+	/* Never moves either, libuev holds pointers to the watchers */
+	tbl.priv = mmap(NULL, MAX_NUM_SVC * sizeof(svc_priv_t), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (MAP_FAILED == tbl.priv) {
+		tbl.priv = NULL;
+		goto error;
+	}
+
+	tbl.shm      = ptr;
+	tbl.len      = FILE_LEN(ARENA_MIN);
+	tbl.writable = 1;
+	table_view(ptr, ARENA_MIN);
+
+	tbl.table->size        = MIN_NUM_SVC;
+	tbl.table->used        = 0;
+	tbl.table->arena       = ARENA_OFFSET;
+	tbl.table->arena_size  = ARENA_MIN;
+	tbl.table->arena_used  = ARENA_START;
+	tbl.table->arena_waste = 0;
+	tbl.table->runlevel    = 0;
+	tbl.table->prevlevel   = -1;
+	tbl.table->boottime    = boottime();
+	tbl.table->magic       = FINIT_SHM_MAGIC;
+
+	LIST_INIT_HEAD(&tbl.all);
+	LIST_INIT_HEAD(&tbl.dynamic);
+	LIST_INIT_HEAD(&tbl.provides);
+	for (i = 0; i < NELEMS(tbl.type); i++)
+		LIST_INIT_HEAD(&tbl.type[i]);
+	for (i = 0; i < NELEMS(tbl.name); i++)
+		LIST_INIT_HEAD(&tbl.name[i]);
+
+	return 0;
+error:
+	close(tbl.fd);
+	tbl.fd = -1;
+
+	return 1;
+}
+
+/**
+ * finit_svc_connect - Connect to the service table
+ *
+ * In PID 1 the table is created by svc_init(), all other processes,
+ * e.g. initctl, map it read-only on first use.
+ *
+ * Returns:
+ * Pointer to the first slot in the table, or %NULL on error.
+ */
+svc_t *finit_svc_connect(void)
+{
+	if (!tbl.shm) {
+		tbl.fd = open(FINIT_SHM, O_RDONLY | O_CLOEXEC);
+		if (-1 == tbl.fd)
+			return NULL;
+
+		if (table_map()) {
+			close(tbl.fd);
+			tbl.fd = -1;
+			return NULL;
+		}
+	}
+
+	return tbl.table->list;
+}
+
+static svc_t *__connect_shm(void)
+{
+	svc_t *list = finit_svc_connect();
+
+	if (!list) {
+		/* This should never happen, but if it does we're probably
+		 * knee-deep in more serious problems already... */
+		_e("Failed connecting to shared memory, error %d: %s", errno, strerror(errno));
+		abort();
+	}
+
+	return list;
+}
+
+/* Number of slots safe to look at */
+static uint32_t __used(void)
+{
+	return MIN(tbl.table->used, MAX_NUM_SVC);
+}
+
+/* Find a free slot, reuse released ones first, grow table if full */
+static svc_t *__alloc(void)
+{
+	svc_table_t *table = tbl.table;
+
+	if (tbl.nfree)
+		return &table->list[tbl.free[--tbl.nfree]];
+
+	if (table->used == table->size && table_grow())
+		return NULL;
+
+	return &table->list[table->used++];
+}
+
+/* Look up arena record, readers may see anything so check all bounds */
+static arena_rec_t *arena_rec(uint32_t off)
+{
+	arena_rec_t *rec;
+
+	if (!off || off + sizeof(arena_rec_t) > tbl.arena_size)
+		return NULL;
+
+	rec = (arena_rec_t *)(tbl.arena + off);
+	if (!rec->len || off + sizeof(arena_rec_t) + rec->len > tbl.arena_size)
+		return NULL;
+	if (rec->str[rec->len - 1])
+		return NULL;
+
+	return rec;
+}
+
+static char *arena_str(uint32_t off)
+{
+	arena_rec_t *rec = arena_rec(off);
+
+	return rec ? rec->str : "";
+}
+
+static uint32_t arena_hash(const char *str, size_t len)
+{
+	return fnv1a(str, len) % ARENA_HASH_LEN;
+}
+
+/* Double the size of the arena, the mapping address never changes */
+static int arena_grow(size_t need)
+{
+	void *ptr;
+	uint32_t size = tbl.table->arena_size;
+
+	while (size - tbl.table->arena_used < need)
+		size *= 2;
+
+	if (size > ARENA_MAX) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (ftruncate(tbl.fd, FILE_LEN(size)))
+		return -1;
+
+	ptr = mmap(tbl.table, FILE_LEN(size), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_FIXED, tbl.fd, 0);
+	if (MAP_FAILED == ptr)
+		return -1;
+
+	tbl.len        = FILE_LEN(size);
+	tbl.arena_size = size;
+	tbl.table->arena_size = size;
+	tbl.table->generation++;
+	_d("String arena grown to %u bytes", size);
+
+	return 0;
+}
+
+/*
+ * Squeeze out released records.  First the new offset of each live
+ * record is stored in its hash link, then all references are updated,
+ * and finally the records are moved down and the hash is rebuilt.
+ */
+static void arena_compact(void)
+{
+	svc_t *svc;
+	svc_iter_t iter;
+	arena_rec_t *rec;
+	uint32_t off, next, to = ARENA_START;
+
+	for (off = ARENA_START; off < tbl.table->arena_used; off += REC_LEN(rec->len)) {
+		rec = (arena_rec_t *)(tbl.arena + off);
+		if (!rec->refcnt)
+			continue;
+
+		rec->next = to;
+		to += REC_LEN(rec->len);
+	}
+
+#define FORWARD(off) if (off) off = ((arena_rec_t *)(tbl.arena + off))->next
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		FORWARD(svc->args);
+		FORWARD(svc->desc);
+		FORWARD(svc->events);
+		FORWARD(svc->requires);
+		FORWARD(svc->provides);
+		FORWARD(svc->after);
+		FORWARD(svc->ready);
+		FORWARD(svc->listen);
+		FORWARD(svc->cgroup);
+		FORWARD(svc->log);
+		FORWARD(svc->tmpl);
+		FORWARD(svc->probe);
+	}
+#undef FORWARD
+
+	memset(tbl.bucket, 0, sizeof(tbl.bucket));
+	for (off = ARENA_START; off < tbl.table->arena_used; off = next) {
+		uint32_t hash;
+
+		rec  = (arena_rec_t *)(tbl.arena + off);
+		next = off + REC_LEN(rec->len);
+		if (!rec->refcnt)
+			continue;
+
+		to = rec->next;
+		memmove(tbl.arena + to, rec, REC_LEN(rec->len));
+
+		rec  = (arena_rec_t *)(tbl.arena + to);
+		hash = arena_hash(rec->str, rec->len);
+		rec->next = tbl.bucket[hash];
+		tbl.bucket[hash] = to;
+		to += REC_LEN(rec->len);
+	}
+
+	_d("String arena compacted from %u to %u bytes", tbl.table->arena_used, to);
+	tbl.table->arena_used  = to;
+	tbl.table->arena_waste = 0;
+}
+
+/* Find @str in arena, or add it, returns offset or 0 on error */
+static uint32_t arena_intern(const char *str, size_t len)
+{
+	uint32_t off, hash = arena_hash(str, len);
+	arena_rec_t *rec;
+
+	for (off = tbl.bucket[hash]; off; off = rec->next) {
+		rec = (arena_rec_t *)(tbl.arena + off);
+		if (rec->len == len && !memcmp(rec->str, str, len)) {
+			rec->refcnt++;
+			return off;
+		}
+	}
+
+	if (len > UINT16_MAX) {
+		errno = E2BIG;
+		return 0;
+	}
+
+	if (tbl.table->arena_used + REC_LEN(len) > tbl.table->arena_size &&
+	    arena_grow(REC_LEN(len)))
+		return 0;
+
+	off = tbl.table->arena_used;
+	rec = (arena_rec_t *)(tbl.arena + off);
+	rec->refcnt = 1;
+	rec->len    = len;
+	memcpy(rec->str, str, len);
+
+	rec->next = tbl.bucket[hash];
+	tbl.bucket[hash] = off;
+	tbl.table->arena_used += REC_LEN(len);
+
+	return off;
+}
+
+static void arena_release(uint32_t off)
+{
+	uint32_t *link;
+	arena_rec_t *rec = arena_rec(off);
+
+	if (!rec || !rec->refcnt || --rec->refcnt)
+		return;
+
+	link = &tbl.bucket[arena_hash(rec->str, rec->len)];
+	while (*link && *link != off)
+		link = &((arena_rec_t *)(tbl.arena + *link))->next;
+	if (*link)
+		*link = rec->next;
+
+	tbl.table->arena_waste += REC_LEN(rec->len);
+	if (tbl.table->arena_waste > tbl.table->arena_used / 2)
+		arena_compact();
+}
+
+/* Replace string at @field, new string is added before the old is
+ * released, since releasing may compact the arena */
+static int arena_set(uint32_t *field, const char *str, size_t len)
+{
+	uint32_t old, off = 0;
+
+	if (!tbl.writable)
+		return errno = EROFS;
+
+	if (str && len > 1) {
+		off = arena_intern(str, len);
+		if (!off)
+			return errno;
+	}
+
+	if (off == *field) {
+		arena_release(off);
+		return 0;
+	}
+
+	old = *field;
+	*field = off;
+	arena_release(old);
+
+	return 0;
+}
+
+/* Walk services with same basename as @name, may include other names
+ * with the same hash, so callers must compare */
+static svc_t *name_walk(svc_iter_t *iter, int first, const char *name)
+{
+	return list_walk(iter, first, SVC_LIST_NAME, name_hash(name));
+}
+
+/* Find any instance of @cmd, compared like svc_new() stores it */
+static svc_t *cmd_find(const char *cmd)
+{
+	char buf[MAX_ARG_LEN];
+	svc_iter_t iter;
+	svc_t *svc;
+
+	strlcpy(buf, cmd, sizeof(buf));
+	for (svc = name_walk(&iter, 1, cmd_name(buf)); svc; svc = name_walk(&iter, 0, cmd_name(buf))) {
+		if (!strcmp(svc->cmd, buf))
+			return svc;
+	}
+
+	return NULL;
+}
+
+/*
+ * Watchers of a new slot have never been started.  Stopping a zeroed
+ * uev_t is not safe with all libuev versions, fd 0 and a NULL ctx.
+ */
+static void priv_init(svc_priv_t *priv)
+{
+	int i;
+
+	memset(priv, 0, sizeof(*priv));
+	priv->restart_timer.fd = -1;
+	priv->kill_timer.fd    = -1;
+	priv->ready_timer.fd   = -1;
+	priv->probe_timer.fd   = -1;
+	priv->probe_watcher.fd = -1;
+	for (i = 0; i < MAX_NUM_SVC_SOCK; i++)
+		priv->sock_watcher[i].fd = -1;
+}
+
+/**
+ * svc_new - Create a new service
+ * @cmd:  External program to call, or 'internal' for internal inetd services
+ * @id:   Instance id
+ * @type: Service type, one of service, task, run or inetd
+ *
+ * Returns:
+ * A pointer to a new &svc_t object, or %NULL if the table is full.
+ */
+svc_t *svc_new(char *cmd, int id, int type)
+{
+	int job;
+	svc_t *svc;
+
+	__connect_shm();
+	if (!tbl.writable) {
+		errno = EROFS;
+		return NULL;
+	}
+
+	/* Reuse job n:o if registering multiple instances */
+	svc = cmd_find(cmd);
+	if (svc)
+		job = svc->job;
+	else
+		job = jobcounter++;
+
+	if (job >= tbl.maxjob && list_job_grow(job)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	svc = __alloc();
+	if (!svc) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(svc, 0, sizeof(*svc));
+	priv_init(svc_priv(svc));
+	svc->type = type;
+	svc->job  = job;
+	svc->id   = id;
+	strlcpy(svc->cmd, cmd, sizeof(svc->cmd));
+
+	list_insert(svc, SVC_LIST_ALL);
+	list_insert(svc, SVC_LIST_TYPE);
+	list_insert(svc, SVC_LIST_JOB);
+	list_insert(svc, SVC_LIST_NAME);
+	LIST_INIT_HEAD(&svc->link[SVC_LIST_DYNAMIC]);
+	LIST_INIT_HEAD(&svc->link[SVC_LIST_PROVIDES]);
+
+	return svc;
+}
+
+/**
+ * svc_priv - State of a service only used by PID 1
+ * @svc: Pointer to an &svc_t object in the table of PID 1
+ *
+ * Returns:
+ * Pointer to the &svc_priv_t of the slot @svc is in.
+ */
+svc_priv_t *svc_priv(svc_t *svc)
+{
+	return &tbl.priv[svc - tbl.table->list];
+}
+
+/**
+ * svc_del - Delete a service object
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * Always succeeds, returning POSIX OK(0).
+ */
+int svc_del(svc_t *svc)
+{
+	if (svc_provides(svc)[0])
+		list_remove(svc, SVC_LIST_PROVIDES);
+
+	arena_set(&svc->args, NULL, 0);
+	arena_set(&svc->desc, NULL, 0);
+	arena_set(&svc->events, NULL, 0);
+	arena_set(&svc->requires, NULL, 0);
+	arena_set(&svc->provides, NULL, 0);
+	arena_set(&svc->after, NULL, 0);
+	arena_set(&svc->ready, NULL, 0);
+	arena_set(&svc->listen, NULL, 0);
+	arena_set(&svc->cgroup, NULL, 0);
+	arena_set(&svc->log, NULL, 0);
+	arena_set(&svc->tmpl, NULL, 0);
+	arena_set(&svc->probe, NULL, 0);
+
+	list_remove(svc, SVC_LIST_ALL);
+	list_remove(svc, SVC_LIST_TYPE);
+	list_remove(svc, SVC_LIST_JOB);
+	list_remove(svc, SVC_LIST_NAME);
+	if (svc_is_dynamic(svc))
+		list_remove(svc, SVC_LIST_DYNAMIC);
+	svc->type = SVC_TYPE_FREE;
+
+	if (tbl.nfree == tbl.maxfree) {
+		uint32_t max = tbl.maxfree ? tbl.maxfree * 2 : MIN_NUM_SVC;
+		uint32_t *ptr;
+
+		ptr = realloc(tbl.free, max * sizeof(uint32_t));
+		if (!ptr) {
+			_e("Out of memory, cannot reuse slot of %s", svc->cmd);
+			return 0;
+		}
+
+		tbl.free    = ptr;
+		tbl.maxfree = max;
+	}
+	tbl.free[tbl.nfree++] = svc - tbl.table->list;
+
+	return 0;
+}
+
+/**
+ * svc_sync - Re-map service table if PID 1 has grown it
+ *
+ * For processes forked from PID 1 that outlive changes to the table,
+ * like the plugin callback helper.  Iterators do this automatically.
+ */
+void svc_sync(void)
+{
+	if (tbl.table)
+		table_sync();
+}
+
+/**
+ * svc_update_begin - Start updating the service table
+ *
+ * Called by PID 1 before changing any service, or the runlevel.  Calls
+ * nest, only the outermost pair is seen by readers, which retry their
+ * svc_snapshot() until the sequence counter is even and unchanged.
+ */
+void svc_update_begin(void)
+{
+	if (!tbl.writable || tbl.depth++)
+		return;
+
+	tbl.table->seq++;
+	__sync_synchronize();
+}
+
+/**
+ * svc_update_end - Done updating the service table
+ */
+void svc_update_end(void)
+{
+	if (!tbl.writable || !tbl.depth || --tbl.depth)
+		return;
+
+	__sync_synchronize();
+	tbl.table->seq++;
+}
+
+/**
+ * svc_set_runlevel - Publish new runlevel to readers
+ * @prev: Previous runlevel
+ * @now:  New runlevel
+ */
+void svc_set_runlevel(int prev, int now)
+{
+	if (!tbl.writable)
+		return;
+
+	svc_update_begin();
+	tbl.table->prevlevel = prev;
+	tbl.table->runlevel  = now;
+	tbl.table->boottime  = boottime();
+	svc_update_end();
+}
+
+/**
+ * svc_snapshot - Take a consistent copy of the service table
+ *
+ * Readers, like initctl, call this to get a private copy of the table
+ * that all iterators and accessors then use.  The copy is retried if
+ * PID 1 changes the table while copying, no locks or syscalls needed.
+ * If PID 1 is busy for too long the last attempt is used anyway.  In
+ * PID 1 this does nothing.
+ *
+ * Returns:
+ * POSIX OK(0) on success, %EBUSY if the copy may be inconsistent, or
+ * any other errno if the table could not be mapped.
+ */
+int svc_snapshot(void)
+{
+	int try;
+	uint32_t seq, used, arena = 0;
+
+	if (tbl.writable)
+		return 0;
+
+	if (!finit_svc_connect())
+		return errno;
+
+	for (try = 0; try < SNAPSHOT_TRIES; try++) {
+		size_t len;
+
+		if (try > SNAPSHOT_SPIN)
+			usleep(1000);
+		else if (try)
+			sched_yield();
+
+		seq = tbl.shm->seq;
+		__sync_synchronize();
+		if (seq & 1)
+			continue;
+
+		if (tbl.shm->generation != tbl.generation && table_map())
+			return errno;
+
+		used  = MIN(tbl.shm->used, MAX_NUM_SVC);
+		arena = MIN(tbl.shm->arena_used, tbl.len - ARENA_OFFSET);
+		len   = FILE_LEN(arena);
+		if (len > tbl.snap_len) {
+			void *ptr;
+
+			/* Anonymous memory, so slots not copied read as free */
+			ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (MAP_FAILED == ptr)
+				return errno;
+
+			if (tbl.snap)
+				munmap(tbl.snap, tbl.snap_len);
+			tbl.snap     = ptr;
+			tbl.snap_len = len;
+		}
+
+		memcpy(tbl.snap, tbl.shm, TABLE_LEN(used));
+		memcpy((char *)tbl.snap + ARENA_OFFSET, (char *)tbl.shm + ARENA_OFFSET, arena);
+
+		__sync_synchronize();
+		if (tbl.shm->seq == seq)
+			break;
+	}
+
+	if (!tbl.snap)
+		return errno = EBUSY;
+
+	table_view(tbl.snap, arena);
+	if (try == SNAPSHOT_TRIES)
+		return errno = EBUSY;
+
+	return 0;
+}
+
+/**
+ * svc_runlevel - Current runlevel, as published by PID 1
+ * @prevlevel: Optional pointer to store previous runlevel in
+ *
+ * Returns:
+ * The current runlevel, 0 being bootstrap (S), or -1 on error.
+ */
+int svc_runlevel(int *prevlevel)
 {
-	svc_t *list = finit_svc_connect();
+	if (!finit_svc_connect())
+		return -1;
 
-	if (!list) {
-		/* This should never happen, but if it does we're probably
-		 * knee-deep in more serious problems already... */
-		_e("Failed connecting to shared memory, error %d: %s", errno, strerror(errno));
-		abort();
-	}
+	if (prevlevel)
+		*prevlevel = tbl.table->prevlevel;
 
-	return list;
+	return tbl.table->runlevel;
 }
 
 /**
- * svc_new - Create a new service
- * @cmd:  External program to call, or 'internal' for internal inetd services
- * @id:   Instance id
- * @type: Service type, one of service, task, run or inetd
+ * svc_boottime - Time of boot, as published by PID 1
  *
  * Returns:
- * A pointer to a new &svc_t object, or %NULL if out of empty slots.
+ * Wall clock time when system was booted, or 0 on error.
  */
-svc_t *svc_new(char *cmd, int id, int type)
+time_t svc_boottime(void)
 {
-	int i, job = -1;
-	svc_t *svc, *list = __connect_shm();
+	if (!finit_svc_connect())
+		return 0;
 
-	/* Find first job n:o if registering multiple instances */
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
-		if (!strcmp(svc->cmd, cmd)) {
-			job = svc->job;
-			break;
-		}
-	}
-	if (job == -1)
-		job = jobcounter++;
+	return (time_t)tbl.table->boottime;
+}
+
+/**
+ * svc_desc - Service description
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * The description, or an empty string if none is set.
+ */
+char *svc_desc(svc_t *svc)
+{
+	return arena_str(svc->desc);
+}
+
+/**
+ * svc_events - Events, or conditions, required for service to run
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * Comma separated list of events, or an empty string if none are set.
+ */
+char *svc_events(svc_t *svc)
+{
+	return arena_str(svc->events);
+}
+
+/**
+ * svc_requires - Services required to have started before this one
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * Comma separated list of names, or an empty string if none are set.
+ */
+char *svc_requires(svc_t *svc)
+{
+	return arena_str(svc->requires);
+}
 
-	for (i = 0; i < MAX_NUM_SVC; i++) {
-		svc_t *svc = &list[i];
+/**
+ * svc_provides - Names this service can be required by, besides its own
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * Comma separated list of names, or an empty string if none are set.
+ */
+char *svc_provides(svc_t *svc)
+{
+	return arena_str(svc->provides);
+}
 
-		if (svc->type == SVC_TYPE_FREE) {
-			memset(svc, 0, sizeof(*svc));
-			svc->type = type;
-			svc->job  = job;
-			svc->id   = id;
-			strlcpy(svc->cmd, cmd, sizeof(svc->cmd));
+/**
+ * svc_after - Services to start after, if they are to be started at all
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * Comma separated list of names, or an empty string if none are set.
+ */
+char *svc_after(svc_t *svc)
+{
+	return arena_str(svc->after);
+}
 
-			return svc;
+/**
+ * svc_ready - How the service signals it is ready
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * "notify", an absolute path to a pidfile, or an empty string if the
+ * service is ready as soon as it has been started.
+ */
+char *svc_ready(svc_t *svc)
+{
+	return arena_str(svc->ready);
+}
+
+/**
+ * svc_listen - Sockets bound for the service by Finit
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * Comma separated list of PORT/PROTO and /path/to/unix/socket, with
+ * an optional "lazy", or an empty string if none are set.
+ */
+char *svc_listen(svc_t *svc)
+{
+	return arena_str(svc->listen);
+}
+
+/**
+ * svc_cgroup - Resource limits for the cgroup of the service
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * Comma separated list of KEY=VAL, e.g. "memory.max=64M", or an empty
+ * string if none are set.
+ */
+char *svc_cgroup(svc_t *svc)
+{
+	return arena_str(svc->cgroup);
+}
+
+/**
+ * svc_log - Log file settings of the service
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * The log:/path[,size:N][,count:M] argument, or an empty string if the
+ * service only logs to memory.
+ */
+char *svc_log(svc_t *svc)
+{
+	return arena_str(svc->log);
+}
+
+/**
+ * svc_template - Service line of an instance range
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * The line, with %i for the ID, that @svc was registered from, or an
+ * empty string if @svc is not part of a :FIRST-LAST range.
+ */
+char *svc_template(svc_t *svc)
+{
+	return arena_str(svc->tmpl);
+}
+
+/**
+ * svc_probe - Health check of the service
+ * @svc: Pointer to an &svc_t object
+ *
+ * Returns:
+ * The TYPE:TARGET of the probe:... argument, or an empty string if the
+ * service has no health check.
+ */
+char *svc_probe(svc_t *svc)
+{
+	return arena_str(svc->probe);
+}
+
+/**
+ * svc_argv - Unpack service arguments
+ * @svc:  Pointer to an &svc_t object
+ * @buf:  Buffer to copy arguments to
+ * @len:  Size of @buf
+ * @argv: Array of @max pointers, set to arguments in @buf
+ * @max:  Number of pointers in @argv, including terminating %NULL
+ *
+ * The arguments are copied, so @argv stays valid even if PID 1 changes
+ * the arena, e.g. in a forked child before calling execv().
+ *
+ * Returns:
+ * Number of arguments in @argv, which is always %NULL terminated.
+ */
+int svc_argv(svc_t *svc, char *buf, size_t len, char **argv, int max)
+{
+	arena_rec_t *rec = arena_rec(svc->args);
+	size_t pos = 0;
+	int argc = 0;
+
+	if (rec && len > 0) {
+		len = MIN(len, rec->len);
+		memcpy(buf, rec->str, len);
+		buf[len - 1] = 0;
+
+		while (pos < len && argc < svc->argc && argc < max - 1) {
+			argv[argc++] = &buf[pos];
+			pos += strlen(&buf[pos]) + 1;
 		}
 	}
+	argv[argc] = NULL;
 
-	errno = ENOMEM;
-	return NULL;
+	return argc;
 }
 
 /**
- * svc_del - Delete a service object
+ * svc_set_desc - Set service description
+ * @svc:  Pointer to an &svc_t object
+ * @desc: New description, or %NULL to clear
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on error.
+ */
+int svc_set_desc(svc_t *svc, char *desc)
+{
+	return arena_set(&svc->desc, desc, desc ? strlen(desc) + 1 : 0);
+}
+
+/**
+ * svc_set_events - Set events required for service to run
+ * @svc:    Pointer to an &svc_t object
+ * @events: Comma separated list of events, or %NULL to clear
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on error.
+ */
+int svc_set_events(svc_t *svc, char *events)
+{
+	return arena_set(&svc->events, events, events ? strlen(events) + 1 : 0);
+}
+
+/**
+ * svc_set_deps - Set startup dependencies
+ * @svc:      Pointer to an &svc_t object
+ * @requires: Comma separated list of names, or %NULL to clear
+ * @provides: Comma separated list of names, or %NULL to clear
+ * @after:    Comma separated list of names, or %NULL to clear
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on error.
+ */
+int svc_set_deps(svc_t *svc, char *requires, char *provides, char *after)
+{
+	int had = svc_provides(svc)[0] != 0, has, rc = 0;
+
+	if (arena_set(&svc->requires, requires, requires ? strlen(requires) + 1 : 0) ||
+	    arena_set(&svc->provides, provides, provides ? strlen(provides) + 1 : 0) ||
+	    arena_set(&svc->after, after, after ? strlen(after) + 1 : 0))
+		rc = errno;
+
+	/* Only services with provides: are on the list, see svc_del() */
+	has = svc_provides(svc)[0] != 0;
+	if (had && !has)
+		list_remove(svc, SVC_LIST_PROVIDES);
+	else if (!had && has)
+		list_insert(svc, SVC_LIST_PROVIDES);
+
+	return rc;
+}
+
+/**
+ * svc_set_ready - Set how the service signals it is ready
+ * @svc:   Pointer to an &svc_t object
+ * @ready: "notify", path to pidfile, or %NULL to clear
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on error.
+ */
+int svc_set_ready(svc_t *svc, char *ready)
+{
+	return arena_set(&svc->ready, ready, ready ? strlen(ready) + 1 : 0);
+}
+
+/**
+ * svc_set_listen - Set sockets to bind for the service
+ * @svc:    Pointer to an &svc_t object
+ * @listen: Comma separated list, see svc_listen(), or %NULL to clear
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on error.
+ */
+int svc_set_listen(svc_t *svc, char *listen)
+{
+	return arena_set(&svc->listen, listen, listen ? strlen(listen) + 1 : 0);
+}
+
+/**
+ * svc_set_cgroup - Set resource limits for the cgroup of the service
+ * @svc:    Pointer to an &svc_t object
+ * @cgroup: Comma separated list of KEY=VAL, or %NULL to clear
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on error.
+ */
+int svc_set_cgroup(svc_t *svc, char *cgroup)
+{
+	return arena_set(&svc->cgroup, cgroup, cgroup ? strlen(cgroup) + 1 : 0);
+}
+
+/**
+ * svc_set_log - Set log file of the service
  * @svc: Pointer to an &svc_t object
+ * @log: Path, with optional size:N and count:M, or %NULL to clear
  *
  * Returns:
- * Always succeeds, returning POSIX OK(0).
+ * POSIX OK(0) on success, or non-zero errno on error.
  */
-int svc_del(svc_t *svc)
+int svc_set_log(svc_t *svc, char *log)
 {
-	svc->type = SVC_TYPE_FREE;
-	return 0;
+	return arena_set(&svc->log, log, log ? strlen(log) + 1 : 0);
 }
 
 /**
- * svc_iterator - Naive iterator over all registered services.
- * @first: Get first &svc_t object, or next until end.
+ * svc_set_template - Set service line of an instance range
+ * @svc:  Pointer to an &svc_t object
+ * @tmpl: Service line, without :FIRST-LAST, or %NULL to clear
  *
  * Returns:
- * The first &svc_t when @first is set, otherwise the next &svc_t until
- * the end when %NULL is returned.
+ * POSIX OK(0) on success, or non-zero errno on error.
+ */
+int svc_set_template(svc_t *svc, char *tmpl)
+{
+	return arena_set(&svc->tmpl, tmpl, tmpl ? strlen(tmpl) + 1 : 0);
+}
+
+/**
+ * svc_set_probe - Set health check of the service
+ * @svc:   Pointer to an &svc_t object
+ * @probe: TYPE:TARGET, or %NULL to clear
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on error.
+ */
+int svc_set_probe(svc_t *svc, char *probe)
+{
+	return arena_set(&svc->probe, probe, probe ? strlen(probe) + 1 : 0);
+}
+
+/**
+ * svc_set_args - Set service arguments
+ * @svc:  Pointer to an &svc_t object
+ * @argv: Arguments, including argv[0]
+ * @argc: Number of arguments in @argv
+ *
+ * The arguments are packed, NUL separated, into one arena record.
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on error.
  */
-svc_t *svc_iterator(int first)
+int svc_set_args(svc_t *svc, char **argv, int argc)
 {
-	static int i = 0;
-	svc_t *list = __connect_shm();
+	char buf[LINE_SIZE];
+	size_t len = 0;
+	int i, rc;
 
-	if (first)
-		i = 0;
+	for (i = 0; i < argc; i++) {
+		size_t sz = strlen(argv[i]) + 1;
 
-	while (i < MAX_NUM_SVC) {
-		svc_t *svc = &list[i++];
+		if (len + sz > sizeof(buf))
+			return errno = E2BIG;
 
-		if (svc->type != SVC_TYPE_FREE)
-			return svc;
+		memcpy(&buf[len], argv[i], sz);
+		len += sz;
 	}
 
-	return NULL;
+	rc = arena_set(&svc->args, buf, len);
+	if (!rc)
+		svc->argc = argc;
+
+	return rc;
 }
 
 
 /**
- * svc_inetd_iterator - Naive iterator over all registered inetd services.
+ * svc_iterator - Iterate over all registered services.
+ * @iter:  Cursor, kept by the caller, so walks may be nested.
  * @first: Get first &svc_t object, or next until end.
  *
  * Returns:
- * The first inetd &svc_t when @first is set, otherwise the next
- * inetd &svc_t until the end when %NULL is returned.
+ * The first &svc_t when @first is set, otherwise the next &svc_t until
+ * the end when %NULL is returned.
  */
-svc_t *svc_inetd_iterator(int first)
+svc_t *svc_iterator(svc_iter_t *iter, int first)
 {
-	svc_t *svc;
+	return list_walk(iter, first, SVC_LIST_ALL, 0);
+}
 
-	for (svc = svc_iterator(first); svc; svc = svc_iterator(0)) {
-		if (svc_is_inetd(svc))
-			return svc;
-	}
 
-	return NULL;
+/**
+ * svc_inetd_iterator - Iterate over all registered inetd services.
+ * @iter:  Cursor, kept by the caller, so walks may be nested.
+ * @first: Get first &svc_t object, or next until end.
+ *
+ * Returns:
+ * The first inetd &svc_t when @first is set, otherwise the next
+ * inetd &svc_t until the end when %NULL is returned.
+ */
+svc_t *svc_inetd_iterator(svc_iter_t *iter, int first)
+{
+	return list_walk(iter, first, SVC_LIST_TYPE, SVC_TYPE_INETD);
 }
 
 
 /**
- * svc_dynamic_iterator - Naive iterator over all registered dynamic services.
+ * svc_dynamic_iterator - Iterate over all registered dynamic services.
+ * @iter:  Cursor, kept by the caller, so walks may be nested.
  * @first: Get first &svc_t object, or next until end.
  *
  * Returns:
  * The first dynamically loaded &svc_t when @first is set, otherwise the
  * next dynamically loaded &svc_t until the end when %NULL is returned.
  */
-svc_t *svc_dynamic_iterator(int first)
+svc_t *svc_dynamic_iterator(svc_iter_t *iter, int first)
 {
-	svc_t *svc;
-
-	for (svc = svc_iterator(first); svc; svc = svc_iterator(0)) {
-		if (svc->mtime)
-			return svc;
-	}
-
-	return NULL;
+	return list_walk(iter, first, SVC_LIST_DYNAMIC, 0);
 }
 
 
 /**
  * svc_named_iterator - Iterates over all instances of a service.
+ * @iter:  Cursor, kept by the caller, so walks may be nested.
  * @first: Get first &svc_t object, or next until end.
- * @cmd:   Service name to look for.
+ * @cmd:   Service basename to look for, e.g. syslogd
  *
  * Returns:
  * The first matching &svc_t when @first is set, otherwise the next
  * &svc_t instance with the same @cmd until the end when %NULL is
  * returned.
  */
-svc_t *svc_named_iterator(int first, char *cmd)
+svc_t *svc_named_iterator(svc_iter_t *iter, int first, char *cmd)
 {
 	svc_t *svc;
 
-	for (svc = svc_iterator(first); svc; svc = svc_iterator(0)) {
-		char *name = basename(svc->cmd);
-
-		if (!strncmp(name, cmd, strlen(name)))
+	for (svc = name_walk(iter, first, cmd); svc; svc = name_walk(iter, 0, cmd)) {
+		if (!strcmp(cmd_name(svc->cmd), cmd))
 			return svc;
 	}
 
 	return NULL;
 }
 
+/**
+ * svc_provides_iterator - Iterates over all services with provides:
+ * @iter:  Cursor, kept by the caller, so walks may be nested.
+ * @first: Get first &svc_t object, or next until end.
+ *
+ * Returns:
+ * The first &svc_t with provides: when @first is set, otherwise the
+ * next one until the end when %NULL is returned.
+ */
+svc_t *svc_provides_iterator(svc_iter_t *iter, int first)
+{
+	return list_walk(iter, first, SVC_LIST_PROVIDES, 0);
+}
 
 /**
  * svc_job_iterator - Iterates over all instances of a service.
+ * @iter:  Cursor, kept by the caller, so walks may be nested.
  * @first: Get first &svc_t object, or next until end.
  * @job:   Job to look for.
  *
@@ -205,16 +1504,9 @@ svc_t *svc_named_iterator(int first, char *cmd)
  * &svc_t instance with the same @job until the end when %NULL is
  * returned.
  */
-svc_t *svc_job_iterator(int first, int job)
+svc_t *svc_job_iterator(svc_iter_t *iter, int first, int job)
 {
-	svc_t *svc;
-
-	for (svc = svc_iterator(first); svc; svc = svc_iterator(0)) {
-		if (svc->job == job)
-			return svc;
-	}
-
-	return NULL;
+	return list_walk(iter, first, SVC_LIST_JOB, job);
 }
 
 
@@ -225,11 +1517,12 @@ svc_t *svc_job_iterator(int first, int job)
 void svc_foreach(void (*cb)(svc_t *))
 {
 	svc_t *svc;
+	svc_iter_t iter;
 
 	if (!cb)
 		return;
 
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0))
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0))
 		cb(svc);
 }
 
@@ -241,11 +1534,12 @@ void svc_foreach(void (*cb)(svc_t *))
 void svc_foreach_dynamic(void (*cb)(svc_t *))
 {
 	svc_t *svc;
+	svc_iter_t iter;
 
 	if (!cb)
 		return;
 
-	for (svc = svc_dynamic_iterator(1); svc; svc = svc_dynamic_iterator(0))
+	for (svc = svc_dynamic_iterator(&iter, 1); svc; svc = svc_dynamic_iterator(&iter, 0))
 		cb(svc);
 }
 
@@ -259,10 +1553,17 @@ void svc_foreach_dynamic(void (*cb)(svc_t *))
  */
 svc_t *svc_find(char *cmd, int id)
 {
+	int job;
 	svc_t *svc;
+	svc_iter_t iter;
+
+	svc = cmd_find(cmd);
+	if (!svc)
+		return NULL;
 
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
-		if (svc->id == id && !strncmp(svc->cmd, cmd, strlen(svc->cmd))) {
+	job = svc->job;
+	for (svc = svc_job_iterator(&iter, 1, job); svc; svc = svc_job_iterator(&iter, 0, job)) {
+		if (svc->id == id) {
 			_d("Found a matching svc for %s", cmd);
 			return svc;
 		}
@@ -281,8 +1582,9 @@ svc_t *svc_find(char *cmd, int id)
 svc_t *svc_find_by_pid(pid_t pid)
 {
 	svc_t *svc;
+	svc_iter_t iter;
 
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
 		if (svc->pid == pid)
 			return svc;
 	}
@@ -301,9 +1603,10 @@ svc_t *svc_find_by_pid(pid_t pid)
 svc_t *svc_find_by_jobid(int job, int id)
 {
 	svc_t *svc;
+	svc_iter_t iter;
 
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
-		if (svc->job == job && svc->id == id)
+	for (svc = svc_job_iterator(&iter, 1, job); svc; svc = svc_job_iterator(&iter, 0, job)) {
+		if (svc->id == id)
 			return svc;
 	}
 
@@ -320,17 +1623,11 @@ svc_t *svc_find_by_jobid(int job, int id)
  */
 svc_t *svc_find_by_nameid(char *name, int id)
 {
-	char *ptr;
 	svc_t *svc;
+	svc_iter_t iter;
 
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
-		ptr = strrchr(svc->cmd, '/');
-		if (ptr)
-			ptr++;
-		else
-			ptr = svc->cmd;
-
-		if (svc->id == id && !strcmp(name, ptr))
+	for (svc = svc_named_iterator(&iter, 1, name); svc; svc = svc_named_iterator(&iter, 0, name)) {
+		if (svc->id == id)
 			return svc;
 	}
 
@@ -349,21 +1646,44 @@ svc_t *svc_find_by_nameid(char *name, int id)
  */
 void svc_mark_dynamic(void)
 {
-	svc_t *svc = svc_dynamic_iterator(1);
+	svc_iter_t iter;
+	svc_t *svc = svc_dynamic_iterator(&iter, 1);
 
 	while (svc) {
 		svc->dirty = -1;
-		svc = svc_dynamic_iterator(0);
+		svc = svc_dynamic_iterator(&iter, 0);
 	}
 }
 
-void svc_check_dirty(svc_t *svc, time_t mtime)
+/**
+ * svc_check_dirty - Check if a service has changed since last loaded
+ * @svc:   Pointer to &svc_t object, new or just registered again
+ * @mtime: Modification time of its .conf file in /etc/finit.d/
+ * @hash:  Of its service line, from svc_hash()
+ *
+ * Only a changed service line makes a service updated, if only the
+ * .conf file is newer the service is marked as touched.  New services
+ * are always updated.
+ */
+void svc_check_dirty(svc_t *svc, time_t mtime, uint32_t hash)
 {
-	if (svc->mtime != mtime)
+	if (!svc->mtime && mtime && tbl.writable)
+		list_insert(svc, SVC_LIST_DYNAMIC);
+
+	if (svc->hash != hash)
 		svc->dirty = 1;
+	else if (svc->mtime != mtime)
+		svc->dirty = 2;
 	else
 		svc->dirty = 0;
 	svc->mtime = mtime;
+	svc->hash  = hash;
+}
+
+/* Fingerprint of a service line, before it is split into arguments */
+uint32_t svc_hash(char *line)
+{
+	return fnv1a(line, strlen(line));
 }
 
 /**
@@ -375,35 +1695,60 @@ void svc_check_dirty(svc_t *svc, time_t mtime)
  */
 void svc_clean_dynamic(void (*cb)(svc_t *))
 {
-	svc_t *svc = svc_dynamic_iterator(1);
+	svc_iter_t iter;
+	svc_t *svc = svc_dynamic_iterator(&iter, 1);
 
 	while (svc) {
 		if (svc->dirty == -1 && cb)
 			cb(svc);
 
 		svc->dirty = 0;
-		svc = svc_dynamic_iterator(0);
+		svc = svc_dynamic_iterator(&iter, 0);
 	}
 }
 
 /**
  * svc_clean_bootstrap - Remove bootstrap-only services after boot
  * @svc: Pointer to &svc_t object
+ * @cb:  Callback to stop all watchers of @svc and delete it
  *
  * Returns:
  * %TRUE(1) if object was bootstrap-only, otherwise %FALSE(0)
  */
-int svc_clean_bootstrap(svc_t *svc)
+int svc_clean_bootstrap(svc_t *svc, void (*cb)(svc_t *))
 {
 	if (!ISOTHER(svc->runlevels, 0)) {
 		svc->pid = 0;
-		svc_del(svc);
+		svc->state = SVC_HALTED_STATE;
+		cb(svc);
 		return 1;
 	}
 
 	return 0;
 }
 
+/**
+ * svc_ident - Short name of a service, used for cgroups and log rings
+ * @svc: Service
+ * @buf: Buffer for the name
+ * @len: Size of @buf
+ *
+ * Services are named after the basename of their command, with :ID
+ * added for all but the first instance.
+ *
+ * Returns:
+ * Always @buf, truncated if too small.
+ */
+char *svc_ident(svc_t *svc, char *buf, size_t len)
+{
+	if (svc->id > 1)
+		snprintf(buf, len, "%s:%d", basename(svc->cmd), svc->id);
+	else
+		snprintf(buf, len, "%s", basename(svc->cmd));
+
+	return buf;
+}
+
 char *svc_status(svc_t *svc)
 {
 	if (!svc_in_runlevel(svc, runlevel))
@@ -425,6 +1770,9 @@ char *svc_status(svc_t *svc)
 	case SVC_RELOAD_STATE:
 		return "reload";
 
+	case SVC_STARTING_STATE:
+		return "starting";
+
 	case SVC_RUNNING_STATE:
 		if (svc->pid)
 			return "running";
@@ -441,11 +1789,17 @@ char *svc_status(svc_t *svc)
 /* Same base service, return unique ID */
 int svc_next_id(char *cmd)
 {
-	int id = 0;
+	int job, id = 0;
 	svc_t *svc;
+	svc_iter_t iter;
+
+	svc = cmd_find(cmd);
+	if (!svc)
+		return 1;
 
-	for (svc = svc_iterator(1); svc; svc = svc_iterator(0)) {
-		if (!strcmp(svc->cmd, cmd) && id < svc->id)
+	job = svc->job;
+	for (svc = svc_job_iterator(&iter, 1, job); svc; svc = svc_job_iterator(&iter, 0, job)) {
+		if (id < svc->id)
 			id = svc->id;
 	}
 
@@ -454,25 +1808,15 @@ int svc_next_id(char *cmd)
 
 int svc_is_unique(svc_t *svc)
 {
-	svc_t *list = __connect_shm();
-	int i, unique = 1;
+	svc_t *s;
+	svc_iter_t iter;
 
-	for (i = 0; i < MAX_NUM_SVC; i++) {
-		svc_t *s = &list[i];
-
-		if (svc->type == SVC_TYPE_FREE)
-			continue;
-
-		if (s == svc)
-			continue;
-
-		if (s->job == svc->job) {
-			unique = 0;
-			break;
-		}
+	for (s = svc_job_iterator(&iter, 1, svc->job); s; s = svc_job_iterator(&iter, 0, svc->job)) {
+		if (s != svc)
+			return 0;
 	}
 
-	return unique;
+	return 1;
 }
 
 
@@ -25,8 +25,8 @@
 #ifndef FINIT_SVC_H_
 #define FINIT_SVC_H_
 
-#include <sys/ipc.h>		/* IPC_CREAT */
-#include <sys/shm.h>		/* shmat() */
+#include <paths.h>		/* _PATH_DEV */
+#include <stdint.h>		/* uint32_t */
 #include <sys/types.h>		/* pid_t */
 #include "libite/lite.h"
 #include "inetd.h"
@@ -43,7 +43,9 @@ typedef enum {
 	SVC_TYPE_SERVICE,	/* Monitored, will be respawned */
 	SVC_TYPE_TASK,		/* One-shot, runs in parallell */
 	SVC_TYPE_RUN,		/* Like task, but wait for completion */
-	SVC_TYPE_INETD		/* Classic inetd service */
+	SVC_TYPE_INETD,		/* Classic inetd service */
+	SVC_TYPE_CRON,		/* Task started at a recurring time */
+	SVC_TYPE_AT		/* Task started once, at a given time */
 } svc_type_t;
 
 typedef enum {
@@ -53,16 +55,61 @@ typedef enum {
 	SVC_CONDHALT_STATE,	/* Not allowed to run atm. event/state lost */
 	SVC_RESTART_STATE,	/* Restarting service waiting to be stopped */
 	SVC_RELOAD_STATE,	/* Reloading services, after .conf changed  */
+	SVC_STARTING_STATE,	/* Started, waiting for service to be ready */
 	SVC_RUNNING_STATE,	/* Currently running service, see svc->pid  */
 } svc_state_t;
 
-#define FINIT_SHM_ID     0x494E4954  /* "INIT", see ascii(7) */
+typedef enum {
+	SVC_PLAN_NONE = 0,	/* Unchanged, or not part of a reload       */
+	SVC_PLAN_ADD,		/* New, or changed and not running, start   */
+	SVC_PLAN_REMOVE,	/* Removed from /etc/finit.d, stop + delete */
+	SVC_PLAN_RESTART,	/* Changed service line, stop + start       */
+	SVC_PLAN_SIGHUP,	/* Same line, .conf touched, reload service */
+} svc_plan_t;
+
+#define FINIT_SHM        _PATH_DEV "shm/finit"
+#define FINIT_SHM_MAGIC  0x494E4954  /* "INIT", see ascii(7) */
 #define MAX_ARG_LEN      64
-#define MAX_STR_LEN      64
 #define MAX_USER_LEN     16
 #define MAX_NUM_FDS      64	     /* Max number of I/O plugins */
-#define MAX_NUM_SVC      64	     /* Enough? */
+#define MIN_NUM_SVC      64	     /* Initial size of table, doubled when full */
+#define MAX_NUM_SVC      8192	     /* Address space reserved for growth */
 #define MAX_NUM_SVC_ARGS 32
+#define MAX_NUM_SVC_SOCK 4	     /* Max listen: sockets per service */
+#define MAX_NUM_INSTANCES 1024	     /* Max instances in a :FIRST-LAST range */
+#define MAX_NUM_SVC_COND 8	     /* Max conditions in <EV> per service */
+
+/*
+ * Lists each &svc_t is linked into by PID 1, all services in order of
+ * registration, services of the same type, instances of the same job,
+ * services loaded from /etc/finit.d, services hashed by basename, and
+ * services with provides:.  See svc_iterator().
+ */
+typedef enum {
+	SVC_LIST_ALL = 0,
+	SVC_LIST_TYPE,
+	SVC_LIST_JOB,
+	SVC_LIST_DYNAMIC,
+	SVC_LIST_NAME,
+	SVC_LIST_PROVIDES,
+	SVC_LIST_MAX
+} svc_list_t;
+
+/* Schedule of cron and at jobs, fields are -1 for any, see cron.c */
+typedef struct {
+	int            year, mon, mday, wday;
+	int            hour, min;
+} svc_sched_t;
+
+/* Intrusive list link, slot index of previous/next &svc_t, or -1 */
+typedef struct {
+	int32_t        prev, next;
+} svc_link_t;
+
+/* Iterator cursor, kept by the caller so walks can be nested */
+typedef struct {
+	int32_t        next;
+} svc_iter_t;
 
 /* Default enable for all services, can be stopped by means
  * of issuing an initctl call. E.g.
@@ -70,32 +117,115 @@ typedef enum {
 typedef struct svc {
 	/* Instance specifics */
 	int            job, id;	       /* JOB:ID */
+	svc_link_t     link[SVC_LIST_MAX];
 
 	/* Service details */
 	pid_t	       pid;
 	svc_state_t    state;	       /* Paused, Reloading, Restart, Running, ... */
 	svc_type_t     type;
 	time_t	       mtime;	       /* Modification time for .conf from /etc/finit.d/ */
-	int            dirty;	       /* Set if old mtime != new mtime  => reloaded,
+	uint32_t       hash;	       /* Of service line, to find changes on reload */
+	int            dirty;	       /* 1 if service line changed, 2 if only mtime,
 					* or -1 when marked for removal */
+	svc_plan_t     plan;	       /* What reload does with it, see service.c */
 	int	       runlevels;
 	int            sighup;	       /* This service supports SIGHUP :) */
-	char           events[MAX_ARG_LEN];
 
-	/* Incremented for each restart by service monitor. */
+	/* Restart policy, restart:N/T backoff:MIN,MAX, see service_monitor().
+	 * Each restart by the service monitor increments @restart_counter,
+	 * which then decays by one every @restart_window / @restart_max sec.
+	 * The first restart is immediate, the next is delayed @backoff_min
+	 * sec, doubling for each restart up to @backoff_max sec. */
 	unsigned int   restart_counter;
+	int            restart_max;
+	int            restart_window;
+	int            backoff_min;
+	int            backoff_max;
+	int64_t        restart_tm;     /* Last decay of @restart_counter, in ms */
+
+	/* Stop policy, kill:SEC, SIGKILL sent if still running @kill_tmo
+	 * sec after SIGTERM, see service_stop() */
+	int            kill_tmo;
+
+	/* Readiness, ready:notify|/path/to/pidfile[,SEC], offset in string
+	 * arena, see svc_ready().  Service is in %SVC_STARTING_STATE until
+	 * ready, or @ready_tmo sec have passed, see ready.c */
+	uint32_t       ready;
+	int            ready_tmo;
+
+	/* Socket activation, listen:SPEC[,SPEC][,lazy], offset in string
+	 * arena, see svc_listen().  Sockets are bound by PID 1 at boot and
+	 * passed to the service as fd 3 and up, see sock.c */
+	uint32_t       listen;
+	int            lazy;	       /* Start on first traffic */
+	int            activate;       /* Traffic seen, start for real */
+	int            num_sock;
+	int            sock[MAX_NUM_SVC_SOCK];
+
+	/* cgroup v2 limits, cgroup:KEY=VAL[,KEY=VAL], offset in string
+	 * arena, see svc_cgroup() and cgroup.c */
+	uint32_t       cgroup;
+
+	/* Log file for stdout/stderr, log:/path[,size:N][,count:M], offset
+	 * in string arena, see logbuf.c */
+	uint32_t       log;
+
+	/* Service line of a :FIRST-LAST range, without the range, offset
+	 * in string arena, see service_scale() */
+	uint32_t       tmpl;
+
+	/* Health check, probe:TYPE:TARGET[,interval:SEC][,timeout:SEC]
+	 * [,fail:N][,age:SEC], TYPE:TARGET is an offset in string arena,
+	 * see svc_probe() and probe.c.  Latency of the last probe is in
+	 * @probe_ms, -1 until the first has passed or if it failed */
+	uint32_t       probe;
+	int            probe_interval;
+	int            probe_tmo;
+	int            probe_max;      /* Consecutive failures before restart */
+	int            probe_age;      /* Max age of file:, in sec */
+	int            probe_fails;    /* Consecutive failures so far */
+	int            probe_ms;
+	int64_t        probe_tm;       /* Start of probe in progress, in ms */
+	pid_t          probe_pid;      /* Of exec: probe in progress */
+	int            probe_sd;       /* Of tcp:/unix: probe in progress */
+
+	/* Heartbeat, heartbeat:restart|reboot, what to do if a subscribed
+	 * process misses its deadline, see wdog.c */
+	int            wdog_reboot;
+
+	/* Schedule, @[YYYY]-mm-ddTHH:MM, of cron and at jobs, next time
+	 * it is due in @sched_next, or 0 if never again.  Jobs added with
+	 * initctl at have @sched_api set, they are removed once run, see
+	 * cron.c */
+	svc_sched_t    sched;
+	time_t         sched_next;
+	int            sched_api;
 
 	/* For inetd services */
 	inetd_t        inetd;
 
-	/* Identity */
+	/* Identity, resolved to uid, gid and groups in svc_priv_t */
 	char	       username[MAX_USER_LEN];
 	char	       group[MAX_USER_LEN];
 
-	/* Command, arguments and service description */
+	/* Command, and offsets in string arena to arguments, description
+	 * and events.  Use svc_argv(), svc_desc() and svc_events() */
 	char	       cmd[MAX_ARG_LEN];
-	char	       args[MAX_NUM_SVC_ARGS][MAX_ARG_LEN];
-	char	       desc[MAX_STR_LEN];
+	int            argc;
+	uint32_t       args;
+	uint32_t       desc;
+	uint32_t       events;
+
+	/* Events compiled to condition IDs, see event_compile() */
+	int            num_cond;
+	uint16_t       cond[MAX_NUM_SVC_COND];
+
+	/* Startup dependencies, offsets in string arena to comma separated
+	 * names, see svc_requires(), and node in startup graph, see dag.c */
+	uint32_t       requires;
+	uint32_t       provides;
+	uint32_t       after;
+	int            dag;
 
 	/* For external plugins. If @cb is set, a plugin is loaded.
 	 * @dynamic:	  Set by plugins that want dynamic events.
@@ -106,47 +236,128 @@ typedef struct svc {
 	int	       dynamic_stop;
 	int	       private;
 	svc_cmd_t    (*cb)(struct svc *svc, int event, void *event_arg);
+
+	/* Last result from @cb, valid for @cb_event until events change */
+	unsigned int   cb_gen;
+	int            cb_event;
+	svc_cmd_t      cb_cmd;
 } svc_t;
 
-typedef struct svc_map svc_map_t;
+/*
+ * State of a service only used by PID 1, timers and watchers, which
+ * libuev links to each other, and resolved limits and credentials.
+ * Kept out of the shared table, in a private array indexed by slot,
+ * see svc_priv().  Cleared by svc_new(), with all watchers unarmed.
+ */
+typedef struct {
+	uev_t          restart_timer;  /* Delayed restart, see service_respawn() */
+	uev_t          kill_timer;     /* SIGKILL after kill:SEC, see service_stop() */
+	uev_t          ready_timer;    /* See ready.c */
+	uev_t          sock_watcher[MAX_NUM_SVC_SOCK];	/* See sock.c */
+	uev_t          probe_timer;    /* See probe.c */
+	uev_t          probe_watcher;
+
+	/* Scheduling and resource limits, cpus:, nice:, sched:, ioprio:,
+	 * rlimit: and oom:, applied between fork and exec, see spawn() */
+	spawn_attr_t   attr;
 
-/* Put services array in shm */
-static inline svc_t *finit_svc_connect(void)
-{
-	static void *ptr = (void *)-1;
+	/* Identity, uid, gid and groups, see spawn_cred() */
+	spawn_cred_t   cred;
 
-	if ((void *)-1 == ptr) {
-		ptr = shmat(shmget(FINIT_SHM_ID, sizeof(svc_t) * MAX_NUM_SVC,
-				   0600 | IPC_CREAT), NULL, 0);
-		if ((void *)-1 == ptr)
-			return NULL;
-	}
+	/* Run/task has completed successfully since it was last started */
+	int            done;
+} svc_priv_t;
+
+/*
+ * The service table is a file in /dev/shm, shared with initctl.  It
+ * starts out with %MIN_NUM_SVC slots and is doubled by PID 1 when full.
+ * Slots at or above @used have never been allocated, so iterators stop
+ * there.  Strings are kept in an arena at file offset @arena, each time
+ * the arena grows @generation is bumped, telling readers they need to
+ * re-map the file.  PID 1 makes @seq odd while updating the table, see
+ * svc_snapshot().
+ */
+typedef struct {
+	uint32_t       magic;	       /* FINIT_SHM_MAGIC */
+	uint32_t       seq;	       /* Sequence lock, odd while updating */
+	uint32_t       generation;     /* Bumped when the file grows */
+	uint32_t       size;	       /* Number of slots in table */
+	uint32_t       used;	       /* High watermark of allocated slots */
 
-	return (svc_t *)ptr;
-}
+	uint32_t       arena;	       /* File offset of string arena */
+	uint32_t       arena_size;
+	uint32_t       arena_used;     /* High watermark of arena */
+	uint32_t       arena_waste;    /* Released, compacted when > used/2 */
+
+	int32_t        runlevel;
+	int32_t        prevlevel;
+	int64_t        boottime;       /* Wall clock time at boot */
+
+	svc_t          list[];
+} svc_table_t;
+
+int       svc_init             (void);
+svc_t    *finit_svc_connect    (void);
+void      svc_sync             (void);
+
+void      svc_update_begin     (void);
+void      svc_update_end       (void);
+void      svc_set_runlevel     (int prev, int now);
+
+int       svc_snapshot         (void);
+int       svc_runlevel         (int *prevlevel);
+time_t    svc_boottime         (void);
 
 svc_t    *svc_new              (char *cmd, int id, int type);
+svc_priv_t *svc_priv           (svc_t *svc);
 int	  svc_del	       (svc_t *svc);
 
+char     *svc_desc             (svc_t *svc);
+char     *svc_events           (svc_t *svc);
+char     *svc_requires         (svc_t *svc);
+char     *svc_provides         (svc_t *svc);
+char     *svc_after            (svc_t *svc);
+char     *svc_ready            (svc_t *svc);
+char     *svc_listen           (svc_t *svc);
+char     *svc_cgroup           (svc_t *svc);
+char     *svc_log              (svc_t *svc);
+char     *svc_template         (svc_t *svc);
+char     *svc_probe            (svc_t *svc);
+int       svc_argv             (svc_t *svc, char *buf, size_t len, char **argv, int max);
+
+int       svc_set_desc         (svc_t *svc, char *desc);
+int       svc_set_events       (svc_t *svc, char *events);
+int       svc_set_deps         (svc_t *svc, char *requires, char *provides, char *after);
+int       svc_set_ready        (svc_t *svc, char *ready);
+int       svc_set_listen       (svc_t *svc, char *listen);
+int       svc_set_cgroup       (svc_t *svc, char *cgroup);
+int       svc_set_log          (svc_t *svc, char *log);
+int       svc_set_template     (svc_t *svc, char *tmpl);
+int       svc_set_probe        (svc_t *svc, char *probe);
+int       svc_set_args         (svc_t *svc, char **argv, int argc);
+
 svc_t	 *svc_find	       (char *cmd, int id);
 svc_t	 *svc_find_by_pid      (pid_t pid);
 svc_t	 *svc_find_by_jobid    (int job, int id);
 svc_t	 *svc_find_by_nameid   (char *name, int id);
 
-svc_t	 *svc_iterator	       (int first);
-svc_t	 *svc_inetd_iterator   (int first);
-svc_t	 *svc_dynamic_iterator (int first);
-svc_t	 *svc_named_iterator   (int first, char *cmd);
-svc_t    *svc_job_iterator     (int first, int job);
+svc_t	 *svc_iterator	       (svc_iter_t *iter, int first);
+svc_t	 *svc_inetd_iterator   (svc_iter_t *iter, int first);
+svc_t	 *svc_dynamic_iterator (svc_iter_t *iter, int first);
+svc_t	 *svc_named_iterator   (svc_iter_t *iter, int first, char *cmd);
+svc_t	 *svc_provides_iterator(svc_iter_t *iter, int first);
+svc_t    *svc_job_iterator     (svc_iter_t *iter, int first, int job);
 
 void	  svc_foreach	       (void (*cb)(svc_t *));
 void	  svc_foreach_dynamic  (void (*cb)(svc_t *));
 
 void	  svc_mark_dynamic     (void);
-void	  svc_check_dirty      (svc_t *svc, time_t mtime);
+void	  svc_check_dirty      (svc_t *svc, time_t mtime, uint32_t hash);
+uint32_t  svc_hash             (char *line);
 void	  svc_clean_dynamic    (void (*cb)(svc_t *));
-int	  svc_clean_bootstrap  (svc_t *svc);
+int	  svc_clean_bootstrap  (svc_t *svc, void (*cb)(svc_t *));
 
+char     *svc_ident            (svc_t *svc, char *buf, size_t len);
 char     *svc_status           (svc_t *svc);
 int       svc_next_id          (char *cmd);
 int       svc_is_unique        (svc_t *svc);
@@ -158,9 +369,11 @@ static inline int svc_is_dynamic(svc_t *svc) { return svc &&  0 != svc->mtime; }
 static inline int svc_is_removed(svc_t *svc) { return svc && -1 == svc->dirty; }
 static inline int svc_is_changed(svc_t *svc) { return svc &&  0 != svc->dirty; }
 static inline int svc_is_updated(svc_t *svc) { return svc &&  1 == svc->dirty; }
+static inline int svc_is_touched(svc_t *svc) { return svc &&  2 == svc->dirty; }
 
 static inline int svc_is_inetd  (svc_t *svc) { return svc && SVC_TYPE_INETD   == svc->type; }
 static inline int svc_is_daemon (svc_t *svc) { return svc && SVC_TYPE_SERVICE == svc->type; }
+static inline int svc_is_cron   (svc_t *svc) { return svc && (SVC_TYPE_CRON == svc->type || SVC_TYPE_AT == svc->type); }
 
 #endif	/* FINIT_SVC_H_ */
 
@@ -30,8 +30,11 @@
 #include "conf.h"
 #include "helpers.h"
 #include "libite/lite.h"
+#include "private.h"
 #include "tty.h"
 
+#define TTY_KILL_TIMEOUT 2	/* Sec. between SIGTERM and SIGKILL */
+
 LIST_HEAD(, tty_node) tty_list = LIST_HEAD_INITIALIZER();
 
 
@@ -76,6 +79,7 @@ int tty_register(char *line)
 		entry = calloc(1, sizeof(*entry));
 		if (!entry)
 			return errno = ENOMEM;
+		entry->data.timer.fd = -1;	/* Not started, see tty_stop() */
 	}
 
 	entry->data.name = strdup(dev);
@@ -115,18 +119,6 @@ size_t tty_num(void)
 	return num;
 }
 
-tty_node_t *tty_find_by_pid(pid_t pid)
-{
-	tty_node_t *entry;
-
-	LIST_FOREACH(entry, &tty_list, link) {
-		if (entry->data.pid == pid)
-			return entry;
-	}
-
-	return NULL;
-}
-
 void tty_start(finit_tty_t *tty)
 {
 	int i = 0, is_console = 0;
@@ -161,19 +153,35 @@ void tty_start(finit_tty_t *tty)
 
 	_d("Starting %s: %s on %s", is_console ? "console" : "TTY", cmd, tty->name);
 	tty->pid = run_getty(cmd, args, is_console);
+	if (tty->pid > 0)
+		pid_track(tty->pid, PID_TYPE_TTY, tty);
+}
+
+static void tty_kill_cb(uev_t *w, void *arg, int UNUSED(events))
+{
+	finit_tty_t *tty = arg;
+
+	uev_timer_stop(w);
+	if (tty->pid > 1)
+		pid_kill(tty->pid, SIGKILL);
 }
 
+/*
+ * Send SIGTERM, followed by SIGKILL after TTY_KILL_TIMEOUT sec, without
+ * blocking.  The getty is collected and tty->pid cleared in tty_respawn()
+ */
 void tty_stop(finit_tty_t *tty)
 {
 	if (!tty->pid)
 		return;
 
 	_d("Stopping TTY %s", tty->name);
-	kill(tty->pid, SIGTERM);
-	do_sleep(2);
-	kill(tty->pid, SIGKILL);
-	waitpid(tty->pid, NULL, 0);
-	tty->pid = 0;
+	if (pid_kill(tty->pid, SIGTERM))
+		return;
+
+	uev_timer_stop(&tty->timer);
+	if (uev_timer_init(ctx, &tty->timer, tty_kill_cb, tty, TTY_KILL_TIMEOUT * 1000, 0))
+		pid_kill(tty->pid, SIGKILL);
 }
 
 int tty_enabled(finit_tty_t *tty, int runlevel)
@@ -189,23 +197,17 @@ int tty_enabled(finit_tty_t *tty, int runlevel)
 	return 0;
 }
 
-/* TTY monitor, called by service_monitor() */
-int tty_respawn(pid_t pid)
+/* TTY monitor, called by service_monitor() when a getty is collected */
+void tty_respawn(finit_tty_t *tty)
 {
-	tty_node_t *entry = tty_find_by_pid(pid);
-
-	if (!entry)
-		return 0;
-
 	/* Clear PID to be able to respawn it. */
-	entry->data.pid = 0;
+	uev_timer_stop(&tty->timer);
+	tty->pid = 0;
 
-	if (!tty_enabled(&entry->data, runlevel))
-		tty_stop(&entry->data);
+	if (!tty_enabled(tty, runlevel))
+		tty_stop(tty);
 	else
-		tty_start(&entry->data);
-
-	return 1;
+		tty_start(tty);
 }
 
 /* Start all TTYs that exist in the system and are allowed at this runlevel */
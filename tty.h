@@ -26,6 +26,7 @@
 #define FINIT_TTY_H_
 
 #include <limits.h>
+#include "libuev/uev.h"
 #include "queue.h"		/* BSD sys/queue.h API */
 
 #define EVENT_SIZE ((sizeof(struct inotify_event) + NAME_MAX + 1))
@@ -37,6 +38,7 @@ typedef struct {
 	int    runlevels;
 
 	int    pid;
+	uev_t  timer;		/* SIGKILL timer, see tty_stop() */
 } finit_tty_t;
 
 typedef struct tty_node {
@@ -49,11 +51,10 @@ typedef struct tty_node {
 int	    tty_register    (char *line);
 tty_node_t *tty_find	    (char *dev);
 size_t	    tty_num	    (void);
-tty_node_t *tty_find_by_pid (pid_t pid);
 void	    tty_start	    (finit_tty_t *tty);
 void	    tty_stop	    (finit_tty_t *tty);
 int	    tty_enabled	    (finit_tty_t *tty, int runlevel);
-int	    tty_respawn	    (pid_t pid);
+void	    tty_respawn	    (finit_tty_t *tty);
 void	    tty_runlevel    (int runlevel);
 
 #endif /* FINIT_TTY_H_ */
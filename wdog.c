@@ -0,0 +1,389 @@
+/* Built-in /dev/watchdog kicker and process heartbeat supervision
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/watchdog.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "libite/lite.h"
+
+#include "finit.h"
+#include "helpers.h"
+#include "private.h"
+#include "service.h"
+#include "sig.h"
+#include "wdog.h"
+#include "wdt.h"
+
+/* Process that has subscribed with wdt_subscribe() */
+typedef struct {
+	pid_t    pid;
+	svc_t   *svc;		/* NULL if not started by us  */
+	int      period;	/* msec                       */
+	int64_t  deadline;	/* now_ms() of next kick, max */
+} wdog_sub_t;
+
+static uev_t kick_watcher     = { .fd = -1 };
+static uev_t sub_watcher;
+static uev_t deadline_watcher = { .fd = -1 };
+
+static int  fd = -1;		/* Watchdog device */
+static int  starved;		/* Kicks stopped, waiting for reset */
+
+static wdog_sub_t *subs;
+static int num_subs, max_subs;
+
+static void kick_cb(uev_t *UNUSED(w), void *UNUSED(arg), int UNUSED(events))
+{
+	if (fd < 0 || starved)
+		return;
+
+	/* Any write kicks a watchdog, so we can be tested with a file */
+	if (ioctl(fd, WDIOC_KEEPALIVE, 0) && write(fd, "\0", 1) != 1)
+		_pe("Failed kicking watchdog");
+}
+
+static void deadline_cb(uev_t *w, void *arg, int events);
+
+/* Wake up at the earliest deadline of all subscribers */
+static void deadline_timer(void)
+{
+	int64_t next = INT64_MAX;
+	int i;
+
+	uev_timer_stop(&deadline_watcher);
+	for (i = 0; i < num_subs; i++) {
+		if (subs[i].deadline < next)
+			next = subs[i].deadline;
+	}
+	if (next == INT64_MAX)
+		return;
+
+	next -= now_ms();
+	if (uev_timer_init(ctx, &deadline_watcher, deadline_cb, NULL, next > 0 ? (int)next : 1, 0))
+		_pe("Failed starting watchdog deadline timer");
+}
+
+static int sub_find(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < num_subs; i++) {
+		if (subs[i].pid == pid)
+			return i;
+	}
+
+	return -1;
+}
+
+static int sub_add(pid_t pid, svc_t *svc)
+{
+	if (num_subs == max_subs) {
+		wdog_sub_t *tmp;
+		int max = max_subs ? max_subs * 2 : 8;
+
+		tmp = realloc(subs, max * sizeof(wdog_sub_t));
+		if (!tmp)
+			return -1;
+		subs = tmp;
+		max_subs = max;
+	}
+
+	memset(&subs[num_subs], 0, sizeof(wdog_sub_t));
+	subs[num_subs].pid = pid;
+	subs[num_subs].svc = svc;
+
+	return num_subs++;
+}
+
+static void sub_del(int i)
+{
+	subs[i] = subs[--num_subs];
+}
+
+/* Reboot, by starving the watchdog, or the hard way if there is none */
+static void starve(void)
+{
+	if (fd < 0) {
+		_e("No watchdog device, rebooting.");
+		do_shutdown(SIGUSR1);
+		return;
+	}
+
+	starved = 1;
+	uev_timer_stop(&kick_watcher);
+}
+
+/* A subscriber has missed its deadline */
+static void expire(int i)
+{
+	wdog_sub_t *sub = &subs[i];
+	svc_t *svc = sub->svc;
+
+	if (svc && !svc->wdog_reboot) {
+		_e("Service %s[%d] missed its %d ms heartbeat, restarting", svc->cmd, sub->pid, sub->period);
+		sub_del(i);
+		service_unhealthy(svc);
+		return;
+	}
+
+	_e("%s[%d] missed its %d ms heartbeat, system will reboot",
+	   svc ? svc->cmd : pid_get_name(sub->pid, NULL, 0), sub->pid, sub->period);
+	sub_del(i);
+	starve();
+}
+
+static void deadline_cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
+{
+	int64_t now = now_ms();
+	int i;
+
+	uev_timer_stop(w);
+
+	svc_update_begin();
+	for (i = num_subs - 1; i >= 0; i--) {
+		if (i < num_subs && subs[i].deadline <= now)
+			expire(i);
+	}
+	svc_update_end();
+
+	deadline_timer();
+}
+
+static void sub_msg(struct ucred *cred, char *line)
+{
+	pid_type_t type;
+	svc_t *svc;
+	int i;
+
+	i = sub_find(cred->pid);
+	if (!strncmp(line, "SUBSCRIBE=", 10)) {
+		const char *errstr;
+		int period;
+
+		period = strtonum(&line[10], 1, INT32_MAX / 2, &errstr);
+		if (errstr) {
+			_e("Invalid heartbeat period from PID %d: %s", cred->pid, &line[10]);
+			return;
+		}
+
+		if (i < 0) {
+			/* Only root may make us reboot the system */
+			svc = pid_find(cred->pid, &type);
+			if (type != PID_TYPE_SVC)
+				svc = NULL;
+			if (!svc && cred->uid != 0) {
+				_e("Ignoring heartbeat from PID %d, not a service", cred->pid);
+				return;
+			}
+
+			i = sub_add(cred->pid, svc);
+			if (i < 0) {
+				_pe("Cannot supervise PID %d", cred->pid);
+				return;
+			}
+		}
+		subs[i].period = period;
+	} else if (i < 0) {
+		_d("Ignoring %s from PID %d, not subscribed", line, cred->pid);
+		return;
+	} else if (!strcmp(line, "UNSUBSCRIBE=1")) {
+		sub_del(i);
+		return;
+	} else if (strcmp(line, "KICK=1")) {
+		return;
+	}
+
+	subs[i].deadline = now_ms() + subs[i].period;
+}
+
+static void sub_cb(uev_t *w, void *UNUSED(arg), int UNUSED(events))
+{
+	char buf[64];
+	char cbuf[CMSG_SPACE(sizeof(struct ucred))];
+	struct iovec iov = { buf, sizeof(buf) - 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	while (1) {
+		struct ucred *cred = NULL;
+		ssize_t len;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		len = recvmsg(w->fd, &msg, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				_pe("Failed reading watchdog socket");
+			break;
+		}
+		buf[len] = 0;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS)
+				cred = (struct ucred *)CMSG_DATA(cmsg);
+		}
+		if (cred)
+			sub_msg(cred, buf);
+	}
+
+	deadline_timer();
+}
+
+/* watchdog DEVICE[,timeout:SEC], from finit.conf */
+static void wdog_open(char *spec)
+{
+	char dev[PATH_MAX], *ptr;
+	int tmo = 0;
+
+	strlcpy(dev, spec, sizeof(dev));
+	ptr = strchr(dev, ',');
+	if (ptr) {
+		*ptr++ = 0;
+		if (strncmp(ptr, "timeout:", 8) || (tmo = atonum(&ptr[8])) <= 0) {
+			_e("Invalid watchdog option %s, ignoring", ptr);
+			tmo = 0;
+		}
+	}
+
+	fd = open(dev, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		_pe("Failed opening watchdog %s", dev);
+		return;
+	}
+
+	if (tmo && ioctl(fd, WDIOC_SETTIMEOUT, &tmo))
+		_d("Cannot set watchdog timeout, %s is not a watchdog?", dev);
+	if (ioctl(fd, WDIOC_GETTIMEOUT, &tmo) || tmo <= 0)
+		tmo = tmo > 0 ? tmo : WDOG_TIMEOUT;
+
+	/* Kick at half the timeout, and once now */
+	_d("Kicking watchdog %s every %d sec", dev, tmo / 2 ?: 1);
+	kick_cb(NULL, NULL, 0);
+	if (uev_timer_init(ctx, &kick_watcher, kick_cb, NULL, 1, (tmo / 2 ?: 1) * 1000))
+		_pe("Failed starting watchdog kick timer");
+}
+
+/**
+ * wdog_init - Open watchdog device and heartbeat socket
+ * @ctx: Event context
+ *
+ * The watchdog device is only opened if set in finit.conf, it is then
+ * kicked from a timer for as long as we run.  The heartbeat socket is
+ * an abstract unix datagram socket, like the notify socket, processes
+ * are told apart by their credentials.  Subscribers started by us as
+ * a service are restarted if they miss a deadline, unless they have
+ * heartbeat:reboot.  Other processes, only root, and heartbeat:reboot
+ * services make us stop kicking the watchdog so the system reboots.
+ *
+ * Returns:
+ * POSIX OK(0) or non-zero on error.
+ */
+int wdog_init(uev_ctx_t *ctx)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+	int sd, on = 1;
+
+	if (watchdog)
+		wdog_open(watchdog);
+
+	sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		_pe("Failed creating heartbeat socket");
+		return 1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, WDT_SOCKET, sizeof(sun.sun_path));
+	sun.sun_path[0] = 0;
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(WDT_SOCKET);
+
+	if (bind(sd, (struct sockaddr *)&sun, len) ||
+	    setsockopt(sd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on))) {
+		_pe("Failed setting up heartbeat socket %s", WDT_SOCKET);
+		close(sd);
+		return 1;
+	}
+
+	if (uev_io_init(ctx, &sub_watcher, sub_cb, NULL, sd, UEV_READ)) {
+		close(sd);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * wdog_cancel - Stop supervising a service
+ * @svc: Service that has been stopped, collected or removed
+ *
+ * A new process of @svc must subscribe again.
+ */
+void wdog_cancel(svc_t *svc)
+{
+	int i;
+
+	for (i = num_subs - 1; i >= 0; i--) {
+		if (subs[i].svc == svc)
+			sub_del(i);
+	}
+}
+
+/**
+ * wdog_exit - Disable watchdog before power off
+ *
+ * At reboot the watchdog is left running, so the system is reset even
+ * if the reboot hangs.  Drivers compiled with nowayout ignore this.
+ */
+void wdog_exit(void)
+{
+	if (fd < 0)
+		return;
+
+	if (write(fd, "V", 1) != 1)
+		_pe("Failed disarming watchdog");
+	close(fd);
+	fd = -1;
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
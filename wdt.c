@@ -0,0 +1,121 @@
+/* libwdt - Heartbeat API for processes supervised by the Finit watchdog
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "wdt.h"
+
+static int sd = -1;
+
+/* Only libc here, this is linked into other programs */
+static int wdt_send(char *msg)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+
+	if (sd < 0) {
+		sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (sd < 0)
+			return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, WDT_SOCKET, strlen(WDT_SOCKET));
+	sun.sun_path[0] = 0;
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(WDT_SOCKET);
+
+	/* Finit knows who we are from our credentials */
+	if (sendto(sd, msg, strlen(msg), 0, (struct sockaddr *)&sun, len) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * wdt_subscribe - Ask Finit to supervise this process
+ * @period: Max time between calls to wdt_kick(), in milliseconds
+ *
+ * Can be called again to change the period, this also counts as a kick.
+ *
+ * Returns:
+ * POSIX OK(0), or -1 with errno set on error.
+ */
+int wdt_subscribe(int period)
+{
+	char msg[32];
+
+	if (period <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	snprintf(msg, sizeof(msg), "SUBSCRIBE=%d", period);
+
+	return wdt_send(msg);
+}
+
+/**
+ * wdt_kick - Tell Finit this process is alive
+ *
+ * Returns:
+ * POSIX OK(0), or -1 with errno set on error.
+ */
+int wdt_kick(void)
+{
+	return wdt_send("KICK=1");
+}
+
+/**
+ * wdt_unsubscribe - Stop supervision of this process
+ *
+ * Returns:
+ * POSIX OK(0), or -1 with errno set on error.
+ */
+int wdt_unsubscribe(void)
+{
+	int rc;
+
+	rc = wdt_send("UNSUBSCRIBE=1");
+	if (sd >= 0) {
+		close(sd);
+		sd = -1;
+	}
+
+	return rc;
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
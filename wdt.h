@@ -0,0 +1,50 @@
+/* libwdt - Heartbeat API for processes supervised by the Finit watchdog
+ *
+ * Copyright (c) 2015  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef FINIT_WDT_H_
+#define FINIT_WDT_H_
+
+#define WDT_SOCKET  "@finit/watchdog"	/* Abstract socket, '@' is NUL */
+
+/*
+ * Call wdt_subscribe() once, with the period in milliseconds, then
+ * wdt_kick() from the main loop at least once every period.  If a
+ * kick is missed, Finit restarts the service, or, for services with
+ * heartbeat:reboot and processes not started by Finit, stops kicking
+ * the watchdog so the system reboots.  Call wdt_unsubscribe() before
+ * exiting on purpose.  All return 0, or -1 with errno set.
+ */
+int wdt_subscribe   (int period);
+int wdt_kick        (void);
+int wdt_unsubscribe (void);
+
+#endif	/* FINIT_WDT_H_ */
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */